@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../pl0.h"
+
+// Cost of a small compile through libpl0 against writing a temp file and running the compiler on it
+// Build: cc -O2 -DPL0_LIBRARY bench/embed.c parsercodegen.c -o embed -pthread
+// Usage: embed [compiler] [compiles]
+// Without a compiler binary only the library is timed
+
+const char * Snippet =
+    "const limit = 10;\n"
+    "var i, sum;\n"
+    "procedure add;\n"
+    "begin\n"
+    "    sum := sum + i * i\n"
+    "end;\n"
+    "begin\n"
+    "    i := 0; sum := 0;\n"
+    "    while i < limit do begin call add; i := i + 1 end;\n"
+    "    write sum\n"
+    "end.\n";
+
+double seconds();
+double libraryCompiles(int count);
+double processCompiles(const char * compiler, int count);
+
+int main(int argc, char *argv[]) {
+    const char * compiler = argc > 1 ? argv[1] : NULL;
+    int count = argc > 2 ? atoi(argv[2]) : 1000;
+
+    if(count < 1) {
+        count = 1;
+    }
+
+    double library = libraryCompiles(count);
+
+    if(library < 0) {
+        fprintf(stderr, "The snippet did not compile\n");
+        return 1;
+    }
+
+    printf("library %10.2f us/compile\n", library * 1e6 / count);
+    // Children would print whatever is still buffered when they reopen stdout
+    fflush(stdout);
+
+    if(compiler != NULL) {
+        double process = processCompiles(compiler, count);
+
+        if(process < 0) {
+            fprintf(stderr, "Could not run %s\n", compiler);
+            return 1;
+        }
+
+        printf("process %10.2f us/compile %8.1fx\n", process * 1e6 / count, library > 0 ? process / library : 0.0);
+    }
+
+    return 0;
+}
+
+double seconds() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// One context for every compile, the way a service would keep one per thread
+double libraryCompiles(int count) {
+    pl0_context * ctx = pl0_context_new();
+    pl0_options options = { 1, 0, 0 };
+    pl0_result result;
+    size_t length = strlen(Snippet);
+
+    if(ctx == NULL) {
+        return -1;
+    }
+
+    double start = seconds();
+
+    for(int i = 0; i < count; i++) {
+        if(pl0_compile(ctx, Snippet, length, &options, &result) != 0) {
+            pl0_context_free(ctx);
+            return -1;
+        }
+    }
+
+    double elapsed = seconds() - start;
+
+    pl0_context_free(ctx);
+
+    return elapsed;
+}
+
+// A temp file and a fork/exec per compile, listing discarded
+double processCompiles(const char * compiler, int count) {
+    char path[] = "/tmp/embedXXXXXX";
+    int fd = mkstemp(path);
+
+    if(fd == -1) {
+        return -1;
+    }
+    close(fd);
+    unlink(path);
+
+    double start = seconds();
+
+    for(int i = 0; i < count; i++) {
+        FILE * fp = fopen(path, "w");
+
+        if(fp == NULL) {
+            return -1;
+        }
+        fputs(Snippet, fp);
+        fclose(fp);
+
+        pid_t child = fork();
+
+        if(child == 0) {
+            if(freopen("/dev/null", "w", stdout) == NULL || freopen("/dev/null", "w", stderr) == NULL) {
+                _exit(127);
+            }
+            execl(compiler, compiler, "-O", path, (char *) NULL);
+            _exit(127);
+        }
+
+        int status;
+
+        if(child == -1 || waitpid(child, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            unlink(path);
+            return -1;
+        }
+
+        unlink(path);
+    }
+
+    return seconds() - start;
+}
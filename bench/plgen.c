@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Synthetic PL/0 workloads for the benchmark harness
+// Usage: plgen <decls|nested|chains|comments|mixed> <count>
+// The output only depends on the arguments, so runs are repeatable
+
+// Nesting depth of begin/end blocks and parenthesised expressions in the nested workload
+#define BLOCK_DEPTH 48
+#define PAREN_DEPTH 32
+
+// Fixed seed linear congruential generator
+unsigned int Seed = 12345;
+
+unsigned int nextRandom();
+void printName(char prefix, long index);
+void declarations(long count, long constants);
+void nested(long count);
+void chains(long count);
+void comments(long count);
+void mixed(long count);
+
+int main(int argc, char *argv[]) {
+    if(argc != 3 || atol(argv[2]) < 1) {
+        fprintf(stderr, "Usage: %s <decls|nested|chains|comments|mixed> <count>\n", argv[0]);
+        return 1;
+    }
+
+    long count = atol(argv[2]);
+
+    if(strcmp(argv[1], "decls") == 0) {
+        declarations(count, count / 2);
+        printf("begin\n  qa := 1\nend.\n");
+    } else if(strcmp(argv[1], "nested") == 0) {
+        nested(count);
+    } else if(strcmp(argv[1], "chains") == 0) {
+        chains(count);
+    } else if(strcmp(argv[1], "comments") == 0) {
+        comments(count);
+    } else if(strcmp(argv[1], "mixed") == 0) {
+        mixed(count);
+    } else {
+        fprintf(stderr, "Unknown workload %s\n", argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
+
+unsigned int nextRandom() {
+    Seed = Seed * 1103515245 + 12345;
+
+    return (Seed >> 16) & 0x7fff;
+}
+
+// Names are a prefix letter followed by the index in base 26, at most 11 characters
+// No reserved word starts with k or q, the prefixes used here
+void printName(char prefix, long index) {
+    char name[12];
+    int length = 0;
+
+    do {
+        name[length++] = 'a' + index % 26;
+        index /= 26;
+    } while(index > 0 && length < 10);
+
+    putchar(prefix);
+    while(length > 0) {
+        putchar(name[--length]);
+    }
+}
+
+// count names in total, the first constants of them constants, ten to a line
+void declarations(long count, long constants) {
+    if(constants > 0) {
+        printf("const ");
+        for(long i = 0; i < constants; i++) {
+            printName('k', i);
+            printf(" = %u%s", nextRandom() % 100000, i + 1 < constants ? (i % 10 == 9 ? ",\n  " : ", ") : ";\n");
+        }
+    }
+
+    // qa is always declared, the other workloads assign to it
+    printf("var qa");
+    for(long i = 1; i < count - constants; i++) {
+        printf(i % 10 == 9 ? ",\n  " : ", ");
+        printName('q', i);
+    }
+    printf(";\n");
+}
+
+// count assignments, each inside BLOCK_DEPTH begin/end and with a PAREN_DEPTH deep expression
+void nested(long count) {
+    declarations(4, 0);
+    printf("begin\n");
+
+    for(long i = 0; i < count; i++) {
+        for(int d = 0; d < BLOCK_DEPTH; d++) {
+            printf("begin ");
+        }
+
+        printf("qa := ");
+        for(int d = 0; d < PAREN_DEPTH; d++) {
+            printf("(qb + ");
+        }
+        printf("%u", nextRandom() % 1000);
+        for(int d = 0; d < PAREN_DEPTH; d++) {
+            printf(d % 2 == 0 ? ") * 2" : ") - qc");
+        }
+
+        for(int d = 0; d < BLOCK_DEPTH; d++) {
+            printf(" end");
+        }
+
+        printf("%s\n", i + 1 < count ? ";" : "");
+    }
+
+    printf("end.\n");
+}
+
+// count alternating while loops and if statements over a few variables
+void chains(long count) {
+    declarations(4, 0);
+    printf("begin\n  read qa;\n");
+
+    for(long i = 0; i < count; i++) {
+        unsigned int limit = nextRandom() % 100;
+
+        if(i % 2 == 0) {
+            printf("  while qa < %u do begin qb := qb + qa; qa := qa + 1 end", limit);
+        } else {
+            printf("  if qb >= %u then qc := qc - qb / 2", limit);
+        }
+
+        printf(";\n");
+    }
+
+    printf("  write qc\nend.\n");
+}
+
+// count statements, each after a comment several times longer than the statement
+void comments(long count) {
+    declarations(4, 0);
+    printf("/* %ld statements, each preceded by a comment */\nbegin\n", count);
+
+    for(long i = 0; i < count; i++) {
+        printf("  /* step %ld: add the next value to the running total, the * and / inside\n"
+               "     a comment must not end it early ** / * */\n", i);
+        printf("  qa := qa + %u%s\n", nextRandom() % 1000, i + 1 < count ? ";" : "");
+    }
+
+    printf("end.\n");
+}
+
+// A bit of everything, roughly in the proportions of hand written programs
+void mixed(long count) {
+    declarations(count / 10 + 4, count / 20);
+    printf("begin\n");
+
+    for(long i = 0; i < count; i++) {
+        unsigned int r = nextRandom();
+        long target = r % (count / 10 - count / 20 + 4);
+
+        printf("  ");
+        switch(r % 6) {
+            case 0:
+                printName('q', target);
+                printf(" := (qa + %u) * (qa - 1) / 3", r % 500 + 1);
+                break;
+            case 1:
+                printf("if odd qa then ");
+                printName('q', target);
+                printf(" := qa");
+                break;
+            case 2:
+                printf("while qa > %u do qa := qa - 1", r % 50);
+                break;
+            case 3:
+                printf("/* comment %ld */ write qa", i);
+                break;
+            case 4:
+                printf("begin qa := qa + 1; qb := qb - qa end");
+                break;
+            default:
+                printf("if qa <> %u then qa := -qa", r % 100);
+                break;
+        }
+
+        printf("%s\n", i + 1 < count ? ";" : "");
+    }
+
+    printf("end.\n");
+}
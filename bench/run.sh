@@ -0,0 +1,116 @@
+#!/bin/sh
+# Compiler benchmark: builds parsercodegen with -DSTATS, generates the workloads
+# with plgen and compiles each one several times, keeping the median of every rate
+#
+# Usage: bench/run.sh [--save] [runs]
+#   --save  write the results to bench/baseline.txt instead of comparing against it
+#   runs    compilations per workload, 5 by default
+#
+# Results are "workload metric value" lines; a rate more than BENCH_TOLERANCE
+# percent (10 by default) below the baseline is a regression and the exit status is 1
+# BENCH_SCALE multiplies every workload size, CC picks the compiler
+
+set -e
+
+bench=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$bench")
+baseline=$bench/baseline.txt
+save=0
+runs=5
+
+for arg in "$@"; do
+    case $arg in
+        --save) save=1 ;;
+        *) runs=$arg ;;
+    esac
+done
+
+cc=${CC:-cc}
+scale=${BENCH_SCALE:-1}
+tolerance=${BENCH_TOLERANCE:-10}
+work=$(mktemp -d "${TMPDIR:-/tmp}/pl0bench.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+
+$cc -O2 -DSTATS "$root/parsercodegen.c" -o "$work/parsercodegen" -pthread
+$cc -O2 "$bench/plgen.c" -o "$work/plgen"
+
+# workload:count, sized so each file is tens of megabytes
+workloads="decls:2000000 nested:4000 chains:400000 comments:200000 mixed:600000"
+
+# Value of a numeric "key": in a --stats-json file
+field() {
+    tr '{},' '   ' < "$1" | awk -v key="\"$2\":" '{ for(i = 1; i < NF; i++) if($i == key) { print $(i + 1); exit } }'
+}
+
+# count / seconds / unit, or nothing for small counts
+rate() {
+    awk -v n="$1" -v s="$2" -v unit="$3" 'BEGIN { if(n >= 1000 && s > 0) printf "%.2f\n", n / s / unit }'
+}
+
+# Middle of the numbers on stdin
+median() {
+    sort -g | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+: > "$work/results.txt"
+
+for workload in $workloads; do
+    name=${workload%%:*}
+    count=$(( ${workload#*:} * scale ))
+
+    "$work/plgen" "$name" "$count" > "$work/$name.pl0"
+
+    run=1
+    while [ "$run" -le "$runs" ]; do
+        "$work/parsercodegen" --stats-json "$work/stats.json" "$work/$name.pl0" > /dev/null
+
+        lex=$(field "$work/stats.json" lex)
+        parse=$(field "$work/stats.json" parse)
+        bytes=$(field "$work/stats.json" bytes_read)
+        tokens=$(field "$work/stats.json" token_count)
+        statements=$(field "$work/stats.json" statements)
+        declarations=$(field "$work/stats.json" declarations)
+        instructions=$(field "$work/stats.json" instruction_count)
+
+        # Lexing is timed on its own, the parse time excludes it
+        # Rates over fewer than 1000 items are noise and left out
+        rate "$bytes" "$lex" 1e6 >> "$work/mb_per_s"
+        rate "$tokens" "$lex" 1 >> "$work/tokens_per_s"
+        rate "$statements" "$parse" 1 >> "$work/statements_per_s"
+        rate "$declarations" "$parse" 1 >> "$work/declarations_per_s"
+        rate "$instructions" "$parse" 1 >> "$work/instructions_per_s"
+
+        run=$((run + 1))
+    done
+
+    for metric in mb_per_s tokens_per_s statements_per_s declarations_per_s instructions_per_s; do
+        if [ -s "$work/$metric" ]; then
+            echo "$name $metric $(median < "$work/$metric")" >> "$work/results.txt"
+        fi
+        rm -f "$work/$metric"
+    done
+done
+
+cat "$work/results.txt"
+
+if [ "$save" -eq 1 ]; then
+    cp "$work/results.txt" "$baseline"
+    echo "Saved $baseline"
+    exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+    echo "No baseline, run with --save to create $baseline"
+    exit 0
+fi
+
+# Join on workload and metric, flag rates that dropped past the tolerance
+awk -v tolerance="$tolerance" '
+    NR == FNR { base[$1 " " $2] = $3; next }
+    ($1 " " $2) in base {
+        change = ($3 - base[$1 " " $2]) * 100 / base[$1 " " $2]
+        printf "%-9s %-19s %+7.1f%%%s\n", $1, $2, change, change < -tolerance ? "  REGRESSION" : ""
+        if(change < -tolerance) failed = 1
+    }
+    END { exit failed }
+' "$baseline" "$work/results.txt"
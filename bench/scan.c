@@ -0,0 +1,246 @@
+// Microbenchmark of the lexer's scanning kernels
+// Build: cc -O2 bench/scan.c -o scan -pthread
+// Usage: scan [megabytes] [passes]
+// Every kernel the CPU supports is first checked against the scalar one on random input, then
+// timed on indentation, comment banners and identifiers; the rate is bytes per TSC cycle
+// (bytes per nanosecond where there is no TSC) and the speedup is against the scalar kernel
+
+#define main compilerMain
+#include "../parsercodegen.c"
+#undef main
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICK_UNIT "cycle"
+#else
+#define TICK_UNIT "ns"
+#endif
+
+// Kernels of one workload, scanning the whole buffer the way the lexer would
+typedef unsigned long long (* scanLoop)(const scanKernels * kernels, const char * buffer, size_t length);
+
+unsigned int Seed = 12345;
+
+unsigned int nextRandom();
+unsigned long long ticks();
+char * indentation(size_t length);
+char * banners(size_t length);
+char * identifiers(size_t length);
+unsigned long long skipLoop(const scanKernels * kernels, const char * buffer, size_t length);
+unsigned long long commentLoop(const scanKernels * kernels, const char * buffer, size_t length);
+unsigned long long wordLoop(const scanKernels * kernels, const char * buffer, size_t length);
+int checkKernels(const scanKernels * kernels);
+
+int main(int argc, char *argv[]) {
+    size_t length = (argc > 1 ? atol(argv[1]) : 16) * 1048576;
+    int passes = argc > 2 ? atoi(argv[2]) : 10;
+    const scanKernels * kernels[3];
+    int kernelCount = 0;
+
+    kernels[kernelCount++] = &ScanScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) {
+        kernels[kernelCount++] = &ScanSse2;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        kernels[kernelCount++] = &ScanAvx2;
+    }
+#endif
+
+    for(int k = 1; k < kernelCount; k++) {
+        if(checkKernels(kernels[k]) == -1) {
+            return 1;
+        }
+    }
+
+    const char * names[3] = { "indent", "banner", "words" };
+    char * buffers[3] = { indentation(length), banners(length), identifiers(length) };
+    scanLoop loops[3] = { skipLoop, commentLoop, wordLoop };
+
+    for(int w = 0; w < 3; w++) {
+        double scalarRate = 0;
+        unsigned long long expected = 0;
+
+        for(int k = 0; k < kernelCount; k++) {
+            unsigned long long best = ~0ULL;
+            unsigned long long result = 0;
+
+            for(int pass = 0; pass < passes; pass++) {
+                unsigned long long start = ticks();
+                result = loops[w](kernels[k], buffers[w], length);
+                unsigned long long elapsed = ticks() - start;
+
+                if(elapsed < best) {
+                    best = elapsed;
+                }
+            }
+
+            if(k == 0) {
+                expected = result;
+            } else if(result != expected) {
+                fprintf(stderr, "%s: %s kernel disagrees with scalar\n", names[w], kernels[k]->name);
+                return 1;
+            }
+
+            double rate = (double) length / (best > 0 ? best : 1);
+            if(k == 0) {
+                scalarRate = rate;
+            }
+
+            printf("%-6s %-6s %7.3f bytes/%s %6.2fx\n", names[w], kernels[k]->name, rate, TICK_UNIT, rate / scalarRate);
+        }
+    }
+
+    for(int w = 0; w < 3; w++) {
+        free(buffers[w]);
+    }
+
+    return 0;
+}
+
+unsigned int nextRandom() {
+    Seed = Seed * 1103515245 + 12345;
+
+    return (Seed >> 16) & 0x7fff;
+}
+
+unsigned long long ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+// Lines indented by 0 to 64 spaces and tabs, each holding one short word
+char * indentation(size_t length) {
+    char * buffer = malloc(length);
+
+    for(size_t i = 0; i < length; ) {
+        int indent = nextRandom() % 65;
+
+        for(int j = 0; j < indent && i < length; j++) {
+            buffer[i++] = nextRandom() % 8 == 0 ? '\t' : ' ';
+        }
+        if(i < length) {
+            buffer[i++] = 'x';
+        }
+        if(i < length) {
+            buffer[i++] = '\n';
+        }
+    }
+
+    return buffer;
+}
+
+// Comments of 100 to 2000 bytes of rules, text and lone stars, like generated file banners
+char * banners(size_t length) {
+    static const char filler[] = "=====-----***** generated banner text, do not edit by hand  \n";
+    char * buffer = malloc(length);
+
+    for(size_t i = 0; i < length; ) {
+        int body = 100 + nextRandom() % 1901;
+
+        buffer[i++] = '/';
+        for(int j = 0; j < body && i < length; j++) {
+            buffer[i++] = filler[nextRandom() % (sizeof(filler) - 1)];
+        }
+        // Stars in the filler are never followed by a slash
+        for(int j = 0; j < 3 && i < length; j++) {
+            buffer[i++] = "*/\n"[j];
+        }
+    }
+
+    return buffer;
+}
+
+// Identifiers and numbers of 1 to 11 characters, a few longer invalid words, one separator each
+char * identifiers(size_t length) {
+    static const char separators[] = " \n;,+-*()=<>:";
+    char * buffer = malloc(length);
+
+    for(size_t i = 0; i < length; ) {
+        int word = nextRandom() % 16 == 0 ? 12 + nextRandom() % 29 : 1 + nextRandom() % 11;
+        int digits = nextRandom() % 4 == 0;
+
+        for(int j = 0; j < word && i < length; j++) {
+            buffer[i++] = digits ? '0' + nextRandom() % 10 : 'a' + nextRandom() % 26;
+        }
+        if(i < length) {
+            buffer[i++] = separators[nextRandom() % (sizeof(separators) - 1)];
+        }
+    }
+
+    return buffer;
+}
+
+// The loops fold every position a kernel returns into the result, so kernels can be compared
+unsigned long long skipLoop(const scanKernels * kernels, const char * buffer, size_t length) {
+    unsigned long long result = 0;
+
+    for(size_t i = 0; i < length; i++) {
+        i = kernels->skipSpace(buffer, i, length);
+        result += i;
+    }
+
+    return result;
+}
+
+unsigned long long commentLoop(const scanKernels * kernels, const char * buffer, size_t length) {
+    unsigned long long result = 0;
+
+    for(size_t i = 0; i < length; i += 2) {
+        i = kernels->findCommentEnd(buffer, i, length);
+        result += i;
+    }
+
+    return result;
+}
+
+unsigned long long wordLoop(const scanKernels * kernels, const char * buffer, size_t length) {
+    unsigned long long result = 0;
+
+    for(size_t i = 0; i < length; i++) {
+        int classes = 0;
+
+        i = kernels->scanWord(buffer, i, length, &classes);
+        result += i * 32 + classes;
+    }
+
+    return result;
+}
+
+// Compare a kernel with the scalar one from every offset of random buffers mixing every byte
+// value with whitespace, stars, slashes and word characters
+int checkKernels(const scanKernels * kernels) {
+    static const char common[] = "  \t\n**//azAZ09_;";
+    char buffer[256];
+
+    for(int round = 0; round < 2000; round++) {
+        size_t length = nextRandom() % sizeof(buffer);
+
+        for(size_t i = 0; i < length; i++) {
+            buffer[i] = nextRandom() % 4 == 0 ? (char) nextRandom() : common[nextRandom() % (sizeof(common) - 1)];
+        }
+
+        for(size_t i = 0; i <= length; i++) {
+            int scalarClasses = nextRandom() & (CC_LETTER | CC_DIGIT | CC_OTHER);
+            int classes = scalarClasses;
+
+            if(kernels->skipSpace(buffer, i, length) != skipSpaceScalar(buffer, i, length) ||
+                kernels->findCommentEnd(buffer, i, length) != findCommentEndScalar(buffer, i, length) ||
+                kernels->scanWord(buffer, i, length, &classes) != scanWordScalar(buffer, i, length, &scalarClasses) ||
+                classes != scalarClasses) {
+                fprintf(stderr, "%s kernel disagrees with scalar at offset %zu of a %zu byte buffer\n", kernels->name, i, length);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
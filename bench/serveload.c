@@ -0,0 +1,170 @@
+// Load generator for the compile server (parsercodegen --serve)
+// Build: cc -O2 bench/serveload.c -o serveload -pthread
+// Usage: serveload socket [clients] [requests] [source]
+// Every client keeps one connection and sends its requests one after another, -O with a binary
+// listing; the source is a small built-in program unless a file is given. Prints the throughput and
+// the latencies the clients saw, then the server's own stats
+
+#define main compilerMain
+#include "../parsercodegen.c"
+#undef main
+
+const char * Snippet =
+    "const limit = 10;\n"
+    "var i, sum;\n"
+    "procedure add;\n"
+    "begin\n"
+    "    sum := sum + i * i\n"
+    "end;\n"
+    "begin\n"
+    "    i := 0; sum := 0;\n"
+    "    while i < limit do begin call add; i := i + 1 end;\n"
+    "    write sum\n"
+    "end.\n";
+
+// One client thread, latency holds a time for each of its requests
+typedef struct {
+    pthread_t thread;
+    const char * path;
+    const char * source;
+    size_t length;
+    int requests;
+    double * latency;
+    int failed;
+} loadClient;
+
+void * clientMain(void * arg);
+char * readFile(const char * path, size_t * length);
+
+int main(int argc, char *argv[]) {
+    if(argc < 2) {
+        fprintf(stderr, "Usage: serveload socket [clients] [requests] [source]\n");
+        return 1;
+    }
+
+    const char * path = argv[1];
+    int clients = argc > 2 ? atoi(argv[2]) : 8;
+    int requests = argc > 3 ? atoi(argv[3]) : 10000;
+    const char * source = Snippet;
+    size_t length = strlen(Snippet);
+
+    if(clients < 1) {
+        clients = 1;
+    }
+    if(requests < 1) {
+        requests = 1;
+    }
+
+    if(argc > 4 && (source = readFile(argv[4], &length)) == NULL) {
+        fprintf(stderr, "Could not read %s\n", argv[4]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    loadClient * client = calloc(clients, sizeof(loadClient));
+    double * latency = malloc(sizeof(double) * clients * requests);
+
+    if(client == NULL || latency == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    double start = stopwatch();
+
+    for(int i = 0; i < clients; i++) {
+        client[i] = (loadClient) { 0, path, source, length, requests, latency + (size_t) i * requests, 0 };
+        pthread_create(&client[i].thread, NULL, clientMain, &client[i]);
+    }
+
+    int failed = 0;
+
+    for(int i = 0; i < clients; i++) {
+        pthread_join(client[i].thread, NULL);
+        failed += client[i].failed;
+    }
+
+    double elapsed = stopwatch() - start;
+    size_t total = (size_t) clients * requests;
+
+    qsort(latency, total, sizeof(double), compareLatencies);
+
+    printf("%d clients, %zu requests in %.3f s, %.0f requests/s, %d failed\n", clients, total, elapsed, total / elapsed, failed);
+    printf("client latency (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+        latency[(size_t) (0.5 * (total - 1))] * 1e6, latency[(size_t) (0.9 * (total - 1))] * 1e6,
+        latency[(size_t) (0.99 * (total - 1))] * 1e6, latency[(size_t) (0.999 * (total - 1))] * 1e6, latency[total - 1] * 1e6);
+
+    // The server's view, which leaves out the socket round trip
+    int fd = connectServer(path);
+    int status;
+    char * payload = NULL;
+    size_t payloadLength = 0;
+    size_t capacity = 0;
+
+    if(fd == -1 || sendRequest(fd, SERVE_STATS, 0, NULL, 0) == -1 || readResponse(fd, &status, &payload, &payloadLength, &capacity) == -1) {
+        fprintf(stderr, "No stats from %s\n", path);
+        return 1;
+    }
+
+    fwrite(payload, 1, payloadLength, stdout);
+
+    close(fd);
+    free(payload);
+    free(latency);
+    free(client);
+
+    return failed > 0 ? 1 : 0;
+}
+
+// A request that gets no answer, or is refused, counts as failed and its time as zero
+void * clientMain(void * arg) {
+    loadClient * client = arg;
+    int fd = connectServer(client->path);
+    int flags = SERVE_OPTIMIZE | FORMAT_BINARY << SERVE_FORMAT_SHIFT;
+    char * payload = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+
+    for(int i = 0; i < client->requests; i++) {
+        double start = stopwatch();
+        int status = SERVE_REFUSED;
+
+        if(fd == -1 || sendRequest(fd, SERVE_COMPILE, flags, client->source, client->length) == -1 ||
+            readResponse(fd, &status, &payload, &length, &capacity) == -1 || status == SERVE_REFUSED) {
+            client->latency[i] = 0;
+            client->failed++;
+            continue;
+        }
+
+        client->latency[i] = stopwatch() - start;
+    }
+
+    if(fd != -1) {
+        close(fd);
+    }
+    free(payload);
+
+    return NULL;
+}
+
+char * readFile(const char * path, size_t * length) {
+    FILE * fp = fopen(path, "rb");
+    char * data = NULL;
+    long size;
+
+    if(fp == NULL) {
+        return NULL;
+    }
+
+    if(fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+        (data = malloc(size + 1)) != NULL && fread(data, 1, size, fp) == (size_t) size) {
+        *length = size;
+    } else {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fp);
+
+    return data;
+}
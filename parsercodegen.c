@@ -1,30 +1,290 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "pl0.h"
 
 // Implement a Recursive Descent Parser and Intermediate Code Generator for tiny PL/0.  
 
-#define MAX_SIZE 999999
-#define MAX_LINE_LENGTH 1000
+// Smallest arena chunk and first capacity of every growable table
+#define ARENA_CHUNK_SIZE 65536
+#define TABLE_START_SIZE 1024
+
+// Tokens the lexer runs ahead of the parser, must be a power of two
+#define LOOKAHEAD_SIZE 64
+
+// Deepest nesting of procedures and begin, if and while statements; the parser recurses on them,
+// so past this it reports error 20 instead of running out of stack (the message quotes the number)
+#define NESTING_LIMIT 10000
+
+// Most candidate variables times basic blocks the liveness bitsets of one frame may cover
+// Larger frames still drop unread variables but give every other one its own slot
+#define LIVENESS_BUDGET (1 << 26)
+
+// Parallel lexing gives every thread at least this many bytes of source, smaller files are lexed serially
+#define LEX_CHUNK_MIN (4 << 20)
+
+// How often --watch checks the file for changes
+#define WATCH_INTERVAL_NS 100000000L
+
+// Nanoseconds of a stat modification time
+#ifdef __APPLE__
+#define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+// Compile cache entries, bump CACHE_VERSION whenever the code or the listing for a source changes
+#define CACHE_VERSION 5
+#define CACHE_DEFAULT_MB 256
+
+// Listings are formatted into a buffer of this size and written out a block at a time
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+// Version after the magic of --format binary listings
+#define LISTING_VERSION 1
+
+// Compile server (--serve): largest source a request may carry, how long a client has to send a whole
+// request and to take a whole response, and how many of each worker's latest request latencies the percentiles are taken over
+#define SERVE_MAX_SOURCE (64 << 20)
+#define SERVE_TIMEOUT_SECONDS 5
+#define SERVE_LATENCY_WINDOW 65536
+
+// Stack words the VM preallocates for activation records, plus one per instruction for expressions
+#define VM_STACK_SIZE (1 << 20)
+#define VM_BUFFER_SIZE 65536
+
+// Symbol and local label prefixes of the assembler --emit-asm writes for
+#ifdef __APPLE__
+#define ASM_SYMBOL "_"
+#define ASM_LOCAL "L"
+#else
+#define ASM_SYMBOL ""
+#define ASM_LOCAL ".L"
+#endif
+
+// Build with -DSTATS for --stats; without it every counter compiles away
+#ifdef STATS
+#define STAT_ADD(field, n) (ctx->Stats.field += (n))
+#define STAT_START(start) double start = stopwatch()
+#define STAT_PHASE(field, start) (ctx->Stats.field += stopwatch() - (start))
+#else
+#define STAT_ADD(field, n) ((void) 0)
+#define STAT_START(start) ((void) 0)
+#define STAT_PHASE(field, start) ((void) 0)
+#endif
+
+// Threaded dispatch needs the GNU labels as values extension
+#if defined(__GNUC__)
+#define VM_THREADED 1
+#endif
 
 // Symbol table
 typedef struct  
 { 
     int kind; // const = 1, var = 2, proc = 3
-    char name[10]; // name up to 11 chars
+    char name[12]; // name up to 11 chars
+    int nameId; // interned name
     int val; // number (ASCII value) 
     int level; // L level
     int addr; // M address
     int mark; // to indicate unavailable or deleted
+    int shadow; // index of the declaration this one hides, -1 if none
 } symbol;
 
-// Assembly Code
+// Arena chunk, allocations are bumped out of the space after the header
+typedef struct arenaChunk {
+    struct arenaChunk * next;
+    size_t size;
+    size_t used;
+} arenaChunk;
+
+// Top of the scratch stack when a pass started, scratchRelease() pops back to it
+typedef struct {
+    arenaChunk * chunk;
+    size_t used;
+} scratchMark;
+
+// Symbol table index slot, key is name ID + 1 (0 is empty)
+typedef struct {
+    int key;
+    int symIdx; // innermost live declaration, -1 if none
+} symbolSlot;
+
+// Assembly Code, also the fixed width record of a .pm0 object file
 typedef struct {
-    char op[4];
+    int op; // opCodes value, turned into a mnemonic only when printed
     int l;
     int m;
 } AssemblyCode;
 
+// Object file header, followed by count AssemblyCode records in native byte order
+#define OBJECT_VERSION 1
+typedef struct {
+    char magic[4]; // "PM0" and a NUL
+    unsigned int version;
+    unsigned int count;
+    unsigned int checksum; // FNV-1a of the records
+} objectHeader;
+
+// What the parser knows about the value an expression leaves on the stack
+// With folding on a constant stays pending, its LIT is only emitted when it is needed
+typedef struct {
+    int constant; // value known at compile time
+    int value;
+    int pending; // constant with no code emitted yet
+    int start; // index of the first instruction of its code
+    int derived; // known only through x * 0, so dividing by it is left to the VM like without -O
+} operand;
+
+// What the expression parser keeps on its stack instead of recursing
+typedef enum {
+    EXPR_BINARY, EXPR_NEGATE, EXPR_PAREN
+} exprEntryKinds;
+
+// A binary operator with its left operand waiting for the right one, a leading minus
+// waiting for its term, or an open parenthesis
+typedef struct {
+    operand left;
+    unsigned char kind;
+    unsigned char opr;
+    unsigned char precedence;
+} exprEntry;
+
+// Activation record of one block, recorded while parsing with -O for the frame compaction
+// The body is the INC and the statement code after it, up to the RTN or halt that ends it
+typedef struct {
+    int inc; // index of the INC
+    int end; // index of the RTN or halt
+    int parent; // frame of the enclosing block, -1 for main
+    int firstVar; // symbol table index of the first variable, the others follow it
+    int vars;
+} frameInfo;
+
+// Instructions from the first to the last where a variable is accessed or live
+typedef struct {
+    int first;
+    int last;
+    int var;
+} liveRange;
+
+// Compile cache entry header, followed by count AssemblyCode records, the listing text and the source
+typedef struct {
+    char magic[4]; // "PMC" and a NUL
+    unsigned int version; // CACHE_VERSION
+    unsigned long long key;
+    unsigned long long sourceLength;
+    unsigned long long checksum; // hashSource of the records, then of the listing
+    unsigned int count;
+    unsigned int listingLength;
+    int variableSlots; // -O counters, so a hit reports the same as a compile
+    int slotsRemoved;
+    int peepholeRemoved;
+} cacheHeader;
+
+// Cache entry mapped for use in place
+typedef struct {
+    const cacheHeader * header;
+    const AssemblyCode * code;
+    const char * listing;
+    void * mapping;
+    size_t mappingLength;
+} cacheEntry;
+
+// Cache file for eviction, oldest use first
+typedef struct {
+    time_t used;
+    off_t size;
+    char name[24];
+} cacheFile;
+
+// Start of a top-level statement of the main block, recorded for --watch
+// The last mark is the end that closes the block, its code is where the halt goes
+typedef struct {
+    unsigned int offset; // source offset of the first token
+    int code; // index of the first instruction
+} statementMark;
+
+// What one --watch recompile replaced
+typedef struct {
+    int firstStatement;
+    int oldStatements;
+    int newStatements;
+    int codeStart;
+    int oldLength;
+    int newLength;
+} watchUpdate;
+
+// Pre-decoded VM operations, OPR and SYS are split into one operation each
+typedef enum {
+    VM_LIT, VM_RTN, VM_ADD, VM_SUB, VM_MUL, VM_DIV, VM_EQL, VM_NEQ, VM_LSS, VM_LEQ, VM_GTR, VM_GEQ,
+    VM_ODD, VM_NEG, VM_LOD, VM_STO, VM_CAL, VM_INC, VM_JMP, VM_JPC, VM_WRITE, VM_READ, VM_HALT,
+    VM_LOD_DISPLAY, VM_STO_DISPLAY, VM_CAL_DISPLAY, VM_RTN_DISPLAY
+} vmOps;
+
+// Pre-decoded instruction
+typedef struct {
+#ifdef VM_THREADED
+    const void * handler;
+#endif
+    int op;
+    int l;
+    int m;
+} vmInstruction;
+
+// Object file mapped for use in place
+typedef struct {
+    const AssemblyCode * code;
+    int count;
+    void * mapping;
+    size_t mappingLength;
+} objectFile;
+
+// One reported error, code is the error() number and offset where its token starts
+typedef struct {
+    int code;
+    unsigned int offset;
+} diagnostic;
+
+// Listing output collected in one large buffer, flushed to fp or kept whole in memory when fp is NULL
+typedef struct {
+    FILE * fp;
+    char * data;
+    size_t used;
+    size_t capacity;
+    int failed; // a write or an allocation failed, the output is incomplete
+} outputBuffer;
+
+// Listing formats for --format, indexes of Emitters
+typedef enum {
+    FORMAT_TEXT, FORMAT_JSON, FORMAT_BINARY, FORMAT_COUNT
+} listingFormats;
+
+// One listing format, each function writes a whole section
+typedef struct {
+    const char * name;
+    void (* begin)(outputBuffer * out);
+    void (* lexemes)(outputBuffer * out, const char * list);
+    void (* code)(outputBuffer * out, const AssemblyCode * code, int count);
+    void (* symbols)(outputBuffer * out, const symbol * table, int count);
+} listingEmitter;
+
 // Enum for token values
 typedef enum {
     skipsym = 1, identsym = 2, numbersym = 3, plussym = 4, minussym = 5,  
@@ -43,888 +303,6412 @@ typedef enum {
 
 // Enum for OPR
 typedef enum {
-    ADD = 1, SUB = 2, MUL = 3, DIV = 4, EQL = 5, NEQ = 6, LSS = 7, LEQ = 8, GTR = 9, GEQ = 10, ODD = 11, NEG = 12
+    RTN = 0, ADD = 1, SUB = 2, MUL = 3, DIV = 4, EQL = 5, NEQ = 6, LSS = 7, LEQ = 8, GTR = 9, GEQ = 10, ODD = 11, NEG = 12
 } oprCodes;
 
 // OP Table
-char * op_code[] = { "", "LIT", "OPR", "LOD", "STO", "", "INC", "JMP", "JPC", "SYS"};
+char * op_code[] = { "", "LIT", "OPR", "LOD", "STO", "CAL", "INC", "JMP", "JPC", "SYS"};
 
-// Token
-char token[MAX_SIZE][11];
-int value[MAX_SIZE];
-int tokenIndex = 0;
+#ifdef STATS
+// Token names for --stats
+char * token_name[] = { "", "skipsym", "identsym", "numbersym", "plussym", "minussym", "multsym", "slashsym",
+    "oddsym", "eqlsym", "neqsym", "lessym", "leqsym", "gtrsym", "geqsym", "lparentsym", "rparentsym", "commasym",
+    "semicolonsym", "periodsym", "becomessym", "beginsym", "endsym", "ifsym", "thensym", "whilesym", "dosym",
+    "callsym", "constsym", "varsym", "procsym", "writesym", "readsym", "elsesym" };
 
-// Lexeme list
-char LexemeList[MAX_SIZE];
-int LexemeListIndex = 0;
+// Per-phase times and counters for --stats
+typedef struct {
+    double lexSeconds;
+    double parseSeconds;
+    double optimizeSeconds;
+    double outputSeconds;
+    long long bytesRead;
+    long long tokens[elsesym + 1];
+    long long symbolChecks;
+    long long symbolCompares;
+    long long emitted[SYS + 1];
+    long long statements;
+    long long declarations;
+    long long backpatches;
+} compileStats;
+#endif
+
+// Character classes, as bit flags so a word can collect the classes it contains
+typedef enum {
+    CC_OTHER = 1, CC_LETTER = 2, CC_DIGIT = 4, CC_SPACE = 8, CC_SYMBOL = 16
+} charClasses;
+
+// Class of every byte, shared by the whole lexer
+// Symbols end a word; everything not listed is a word character no token may contain
+static const unsigned char CharClass[256] = {
+    [0 ... 8] = CC_OTHER, ['\t' ... '\r'] = CC_SPACE, [14 ... 31] = CC_OTHER, [' '] = CC_SPACE,
+    ['!' ... '/'] = CC_SYMBOL, // ! " # $ % & ' ( ) * + , - . /
+    ['0' ... '9'] = CC_DIGIT,
+    [':' ... '@'] = CC_SYMBOL, // : ; < = > ? @
+    ['A' ... 'Z'] = CC_OTHER,
+    ['[' ... '`'] = CC_SYMBOL, // [ \ ] ^ _ `
+    ['a' ... 'z'] = CC_LETTER,
+    ['{' ... '~'] = CC_SYMBOL, // { | } ~
+    [127 ... 255] = CC_OTHER
+};
+
+// Token value of every one character symbol, 0 if it is not a token on its own
+static const unsigned char SymbolValue[256] = {
+    ['+'] = plussym, ['-'] = minussym, ['*'] = multsym, ['/'] = slashsym, ['='] = eqlsym, ['<'] = lessym,
+    ['>'] = gtrsym, ['('] = lparentsym, [')'] = rparentsym, [','] = commasym, [';'] = semicolonsym, ['.'] = periodsym
+};
+
+// Precedence of the binary operators, higher binds tighter
+typedef enum {
+    PREC_NONE, PREC_RELATIONAL, PREC_ADDITIVE, PREC_MULTIPLICATIVE
+} precedences;
+
+// Binary operators by token, with the OPR they emit
+// A relational operator is only taken once, at the top level of a condition
+static const struct {
+    unsigned char opr;
+    unsigned char precedence;
+} BinaryOperators[elsesym + 1] = {
+    [plussym] = { ADD, PREC_ADDITIVE }, [minussym] = { SUB, PREC_ADDITIVE },
+    [multsym] = { MUL, PREC_MULTIPLICATIVE }, [slashsym] = { DIV, PREC_MULTIPLICATIVE },
+    [eqlsym] = { EQL, PREC_RELATIONAL }, [neqsym] = { NEQ, PREC_RELATIONAL }, [lessym] = { LSS, PREC_RELATIONAL },
+    [leqsym] = { LEQ, PREC_RELATIONAL }, [gtrsym] = { GTR, PREC_RELATIONAL }, [geqsym] = { GEQ, PREC_RELATIONAL }
+};
+
+// Runtime errors native code reports through pl0_fail(), the same numbers as in pl0rt.c
+typedef enum {
+    PL0_DIVISION_BY_ZERO = 1, PL0_STACK_OVERFLOW
+} runtimeErrors;
 
-// Symbol table
-symbol SymbolTable[MAX_SIZE];
-int SymbolTableIndex = 0;
+// Lexer states
+typedef enum {
+    LEX_START, LEX_SLASH, LEX_COMMENT, LEX_COLON, LEX_LESS, LEX_GREATER, LEX_BANG
+} lexStates;
+
+// Scanning kernels of the lexer, each crosses a whole run of bytes in one call
+typedef struct {
+    const char * name;
+    size_t (* skipSpace)(const char * src, size_t i, size_t length);
+    size_t (* findCommentEnd)(const char * src, size_t i, size_t length);
+    size_t (* scanWord)(const char * src, size_t i, size_t length, int * classes);
+} scanKernels;
+
+// Buffered VM input and output, the library has no VM
+#ifndef PL0_LIBRARY
+char VmInput[VM_BUFFER_SIZE];
+int VmInputIndex = 0;
+int VmInputLength = 0;
+char VmOutput[VM_BUFFER_SIZE];
+int VmOutputIndex = 0;
+#endif
+
+// Everything one compilation needs, so several can run at once; pl0.h calls it pl0_context
+typedef struct pl0_context {
+    // Source buffer (mapped or read whole, or the caller's with pl0_compile())
+    char * Source;
+    size_t SourceLength;
+    int SourceMapped;
+    int SourceBorrowed;
+
+    // Arena all compiler tables live in, released in one go at the end
+    arenaChunk * Arena;
+    // Scratch stack of the -O passes, oldest chunk first; the chunks outlive resetContext()
+    arenaChunk * Scratch;
+    arenaChunk * ScratchTop;
+
+    // Lookahead ring the lexer fills and getToken drains, one entry per token in each array
+    // Payload is the name ID of an identifier or the value of a number
+    unsigned char TokenKind[LOOKAHEAD_SIZE];
+    int TokenPayload[LOOKAHEAD_SIZE];
+    unsigned int TokenOffset[LOOKAHEAD_SIZE];
+    int TokenHead;
+    int TokenCount;
+    // Tokens lexed so far
+    int tokenIndex;
+
+    // Lexer position, kept between calls so it can stop whenever the ring is full
+    lexStates LexState;
+    size_t LexPosition;
+
+    // Threads to lex the source on before parsing (--lex-threads), 0 or 1 lexes it as the parser goes
+    // The tokens of a parallel lex are kept whole and getToken reads them in order
+    int LexThreads;
+    unsigned char * LexedKind;
+    int * LexedPayload;
+    unsigned int * LexedOffset;
+    size_t LexedCount;
+    size_t LexedNext;
+
+    // Interned identifier names, indexed by name ID
+    char (* NameList)[12];
+    int NameListIndex;
+    int NameListCapacity;
+    // Open addressing index over NameList, holds name ID + 1 (0 is empty)
+    int * NameHash;
+    int NameHashSize;
+
+    // Lexeme list, only built with --lexemes
+    int BuildLexemeList;
+    char * LexemeList;
+    int LexemeListIndex;
+    int LexemeListCapacity;
+
+    // Symbol table
+    symbol * SymbolTable;
+    int SymbolTableIndex;
+    int SymbolTableCapacity;
+
+    // Open addressing index over SymbolTable keyed on name ID
+    symbolSlot * SymbolHash;
+    int SymbolHashSize;
+    int SymbolHashCount;
+
+    // Lexical level of the block being parsed, and the begin, if and while statements around the
+    // statement being parsed
+    int CurrentLevel;
+    int Nesting;
+
+    // Fold constants and simplify expressions while parsing (-O)
+    int Optimize;
+
+    // Listing format (--format) and whether it ends with the symbol table (not with --no-symbols)
+    int ListingFormat;
+    int ListSymbols;
+
+    // Assembly Code
+    AssemblyCode * AssemblyCodeList;
+    int AssemblyCodeListIndex;
+    int AssemblyCodeListCapacity;
+
+    // Current token
+    int CurrentTokenValue;
+    int CurrentTokenPayload;
+    unsigned int CurrentTokenOffset;
+
+    // Pending operators and open parentheses of the expression being parsed
+    exprEntry * ExprStack;
+    int ExprDepth;
+    int ExprCapacity;
+#ifdef STATS
+
+    compileStats Stats;
+#endif
+
+    // Errors in the order they were found
+    diagnostic * Diagnostics;
+    int DiagnosticCount;
+    int DiagnosticCapacity;
+    // Set by a syntax error until recover() skips to a synchronizing token
+    int Panicking;
+    // Token recover() stopped at, errors there would only echo the first one
+    unsigned int RecoveredAt;
+    int Recovered;
+
+    // Where fail() unwinds to on fatal errors, and the message it left
+    jmp_buf Bail;
+    const char * Diagnostic;
+    // Instructions the peephole optimizer removed
+    int PeepholeRemoved;
+
+    // Frames of the blocks parsed so far (-O only) and the one being parsed, -1 outside any
+    frameInfo * Frames;
+    int FrameCount;
+    int FrameCapacity;
+    int CurrentFrame;
+    // Variable slots before frame compaction and how many it removed
+    int VariableSlots;
+    int SlotsRemoved;
+
+    // Statement marks of the main block (--watch), TopLevel is set while its statement is parsed
+    int RecordStatements;
+    int TopLevel;
+    statementMark * Statements;
+    int StatementCount;
+    int StatementCapacity;
+} compileContext;
+
+// Compile server requests and responses start with this header, all numbers little-endian
+// A request is 'P' 'L', its type and flags, then the length of the source that follows
+// A response is 'P' 'L', its status and a zero byte, then the length of the payload that follows
+#define SERVE_HEADER_SIZE 8
+
+// Request types
+typedef enum {
+    SERVE_COMPILE = 'C', SERVE_STATS = 'S'
+} serveRequests;
+
+// Request flags, the format is a listingFormats value
+#define SERVE_OPTIMIZE 1
+#define SERVE_LEXEMES 2
+#define SERVE_NO_SYMBOLS 4
+#define SERVE_FORMAT_SHIFT 3
+
+// Response statuses: the listing or the stats, the errors as a compile prints them, or why the
+// request was refused (the connection is closed after it)
+typedef enum {
+    SERVE_OK, SERVE_ERRORS, SERVE_REFUSED
+} serveStatuses;
+
+// A client connection, the polling thread reads a request into it without blocking and queues it
+// once the request is whole; the worker that answers it hands it back through the wake pipe
+typedef struct {
+    int fd;
+    unsigned char header[SERVE_HEADER_SIZE];
+    size_t headerUsed;
+    char * source;
+    size_t sourceCapacity;
+    size_t sourceUsed;
+    size_t length;
+    const char * refusal; // why the request is refused instead of answered
+    double started; // first byte of the request, for its deadline
+    double ready; // last byte of the request, for its latency
+} serveConnection;
+
+// What the polling thread watches: the listener, the wake pipe, then the idle and half-read connections
+typedef struct {
+    struct pollfd * fds;
+    serveConnection ** connections;
+    int count;
+    int capacity;
+} servePollSet;
 
-// Assembly Code
-AssemblyCode AssemblyCodeList[MAX_SIZE];
-int AssemblyCodeListIndex = 0;
+struct serveServer;
 
-// Current token
-char CurrentToken[15];
-int CurrentTokenValue = 0;
-int CurrentIndex = 0;
+// One compile thread of the server, its context and listing buffer are reused from request to request
+typedef struct {
+    pthread_t thread;
+    struct serveServer * server;
+    compileContext * ctx;
+    outputBuffer out;
+    // Latencies of the latest requests (seconds, SERVE_LATENCY_WINDOW of them at most) and counts since the start
+    pthread_mutex_t lock;
+    double * latency;
+    long long requests;
+    long long failed;
+} serveWorker;
+
+// Whole requests waiting for a worker, and the pipe workers hand connections back through
+typedef struct serveServer {
+    pthread_mutex_t lock;
+    pthread_cond_t waiting;
+    serveConnection ** jobs;
+    int jobHead;
+    int jobCount;
+    int jobCapacity;
+    int stopping;
+    int wake[2];
+    serveWorker * workers;
+    int workerCount;
+    double started;
+} serveServer;
+
+// Files a batch worker still owns, it takes from the front and thieves take from the back
+typedef struct {
+    pthread_mutex_t lock;
+    int next;
+    int end;
+} batchQueue;
 
+// One thread of --jobs, every worker sees all the queues so it can steal
+typedef struct {
+    pthread_t thread;
+    int id;
+    int workerCount;
+    batchQueue * queues;
+    char ** files;
+    int optimize;
+    int buildLexemeList;
+    int format;
+    int listSymbols;
+    const char * cacheDir;
+    long long cacheLimit;
+    int failed;
+} batchWorker;
+
+// Tokens of one stretch of a lexChunk, lexed in a context of its own
+// Identifier payloads are name IDs of that context until map turns them into the compile's
+typedef struct {
+    compileContext * ctx;
+    unsigned char * kind;
+    int * payload;
+    unsigned int * offset;
+    int count;
+    int capacity;
+    lexStates state; // lexer state at the end of the stretch
+    int * map;
+} lexPiece;
+
+// Slice of the source one thread lexes, from whitespace to whitespace
+// Whether it starts inside a comment is only known once the slice before it is done, so
+// [start, sync) is lexed both ways; sync is the first whitespace after the first "*/", where
+// the two usually agree and [sync, end) is lexed once
+typedef struct {
+    pthread_t thread;
+    compileContext * parent;
+    size_t start;
+    size_t sync;
+    size_t end;
+    lexPiece outside; // [start, sync) starting outside a comment
+    lexPiece inside; // [start, sync) starting inside one
+    lexPiece rest; // [sync, end) after outside
+    lexPiece insideRest; // [sync, end) after inside, only when it stopped in another state
+    int useInside;
+    size_t first; // index of the chunk's first token in the whole source
+    int failed;
+} lexChunk;
+
+// Context functions
+compileContext * createContext(int optimize, int buildLexemeList);
+void destroyContext(compileContext * ctx);
+void resetContext(compileContext * ctx);
+int compileSource(compileContext * ctx);
+void printListing(compileContext * ctx, outputBuffer * out);
+int writeListing(compileContext * ctx, FILE * fp);
+// Library functions, the rest are in pl0.h
+void collectResult(compileContext * ctx, pl0_result * result);
+// Batch functions
+int compileBatch(char ** files, int fileCount, int workerCount, int optimize, int buildLexemeList, int format, int listSymbols, const char * cacheDir, long long cacheLimit);
+void * batchWorkerMain(void * arg);
+int takeBatchFile(batchWorker * worker);
+int compileToFile(char * file_input, int optimize, int buildLexemeList, int format, int listSymbols, const char * cacheDir, long long cacheLimit);
+// Server functions
+int serveSocket(const char * path, int workerCount);
+void stopServer(serveServer * server, int started);
+int acceptConnections(int listener, servePollSet * set);
+int watchConnection(servePollSet * set, int fd, serveConnection * connection);
+void dropConnection(servePollSet * set, int index);
+void closeConnection(serveConnection * connection);
+int pollTimeout(servePollSet * set, double now);
+int readRequest(serveConnection * connection, double now);
+void checkRequest(serveConnection * connection);
+void queueJob(serveServer * server, serveConnection * connection);
+void * serveWorkerMain(void * arg);
+int serveRequest(serveWorker * worker, serveConnection * connection);
+int writeUntil(int fd, const void * buffer, size_t length, double deadline);
+void serveStats(serveServer * server, outputBuffer * out);
+int compareLatencies(const void * a, const void * b);
+void stopServing(int signal);
+int connectServer(const char * path);
+int sendRequest(int fd, int type, int flags, const char * payload, size_t length);
+int readResponse(int fd, int * status, char ** payload, size_t * length, size_t * capacity);
+int readFull(int fd, void * buffer, size_t length);
+int writeFull(int fd, const void * buffer, size_t length);
+void putHeader(unsigned char * header, int kind, int flags, size_t length);
+int connectSource(const char * path, char * file_input, int flags, FILE * listing);
+// Source functions
+int readSource(compileContext * ctx, char * file_input);
+void releaseSource(compileContext * ctx);
+// Watch functions
+int watchSource(char * file_input, int optimize, char * object_output);
+int readSourceCopy(compileContext * ctx, char * file_input);
+int recompileChange(compileContext * ctx, compileContext * next, watchUpdate * update);
+int reparseStatements(compileContext * ctx, int firstStatement, long long newEnd, long long byteDelta, statementMark ** added, int * addedCount);
+void spliceStatements(compileContext * ctx, int first, int replaced, statementMark * marks, int count, long long byteDelta, int codeDelta);
+void setMainScope(compileContext * ctx, int open);
+void addStatementMark(compileContext * ctx);
+size_t commonPrefix(const char * a, const char * b, size_t length);
+size_t commonSuffix(const char * aEnd, const char * bEnd, size_t length);
+// Object file functions
+int writeObject(char * file_output, const AssemblyCode * code, int count);
+int loadObject(char * file_input, objectFile * object);
+void unloadObject(objectFile * object);
+// Output functions
+int outputOpen(outputBuffer * out, FILE * fp);
+int outputClose(outputBuffer * out);
+void outputFlush(outputBuffer * out);
+void outputMakeRoom(outputBuffer * out, size_t length);
+static inline char * outputReserve(outputBuffer * out, size_t length);
+void outputBytes(outputBuffer * out, const char * bytes, size_t length);
+static inline char * putInt(char * at, int value, int width);
+static inline char * putField(char * at, const char * text, size_t length, int width);
+static inline char * putWord(char * at, int value);
+void textBegin(outputBuffer * out);
+void textLexemes(outputBuffer * out, const char * list);
+void textCode(outputBuffer * out, const AssemblyCode * code, int count);
+void textCodeRows(outputBuffer * out, const AssemblyCode * code, int first, int last);
+void textSymbols(outputBuffer * out, const symbol * table, int count);
+void jsonLexemes(outputBuffer * out, const char * list);
+void jsonCode(outputBuffer * out, const AssemblyCode * code, int count);
+void jsonSymbols(outputBuffer * out, const symbol * table, int count);
+void binaryBegin(outputBuffer * out);
+void binaryLexemes(outputBuffer * out, const char * list);
+void binaryCode(outputBuffer * out, const AssemblyCode * code, int count);
+void binarySymbols(outputBuffer * out, const symbol * table, int count);
+// Compile cache functions
+unsigned long long cacheKey(compileContext * ctx);
+unsigned long long hashSource(const char * bytes, size_t length, unsigned long long seed);
+int cacheLoad(const char * cacheDir, unsigned long long key, const char * source, size_t sourceLength, cacheEntry * entry);
+void cacheRelease(cacheEntry * entry);
+int cacheStore(const char * cacheDir, long long cacheLimit, unsigned long long key, compileContext * ctx);
+void cacheEvict(const char * cacheDir, long long cacheLimit);
+int compareCacheFiles(const void * a, const void * b);
+// Native code functions
+int writeAssembly(char * file_output, const AssemblyCode * code, int count);
+const char * asmBase(FILE * out, int l);
+void asmCall(FILE * out, const char * function);
+// VM functions
+int runProgram(const AssemblyCode * code, int count, int display);
+int decodeInstruction(AssemblyCode instruction, int count, int display);
+#ifndef PL0_LIBRARY
+static inline int vmBase(const int * stack, int bp, int l, int stackLimit);
+#endif
+int vmReadInt(int * number);
+void vmWriteInt(int number);
+void vmFlush();
+double stopwatch();
+// Statistics functions
+#ifdef STATS
+long peakMemoryKB();
+void printStats(compileContext * ctx, FILE * out);
+int writeStatsJson(compileContext * ctx, char * file_output);
+#endif
+// Arena functions
+void * arenaAlloc(compileContext * ctx, size_t size);
+void * arenaGrow(compileContext * ctx, void * table, int count, size_t elementSize, int capacity);
+void arenaRelease(compileContext * ctx);
+void arenaReset(compileContext * ctx);
+void * scratchAlloc(compileContext * ctx, size_t size);
+scratchMark scratchSave(compileContext * ctx);
+void scratchRelease(compileContext * ctx, scratchMark mark);
+void growNames(compileContext * ctx);
+void growNameHash(compileContext * ctx);
+void growSymbols(compileContext * ctx);
+void growSymbolHash(compileContext * ctx);
+// Lexer functions
+void lexTokens(compileContext * ctx, const char * src, size_t length);
+void selectScanKernels();
+size_t skipSpaceScalar(const char * src, size_t i, size_t length);
+size_t findCommentEndScalar(const char * src, size_t i, size_t length);
+size_t scanWordScalar(const char * src, size_t i, size_t length, int * classes);
+#if defined(__x86_64__) || defined(__i386__)
+size_t skipSpaceSse2(const char * src, size_t i, size_t length);
+size_t findCommentEndSse2(const char * src, size_t i, size_t length);
+size_t scanWordSse2(const char * src, size_t i, size_t length, int * classes);
+size_t skipSpaceAvx2(const char * src, size_t i, size_t length);
+size_t findCommentEndAvx2(const char * src, size_t i, size_t length);
+#endif
+int lexParallel(compileContext * ctx, int threads);
+void runLexChunks(lexChunk * chunks, int count, void * (* work)(void *));
+void * lexChunkMain(void * arg);
+void * copyChunkMain(void * arg);
+int lexPieceRange(lexPiece * piece, compileContext * parent, size_t from, size_t to, lexStates state);
+int lexChunkPieces(lexChunk * chunk, lexPiece ** pieces);
+void releasePiece(lexPiece * piece);
+size_t findLexSync(const char * src, size_t start, size_t end);
+void addWord(compileContext * ctx, const char * word, size_t length, int classes);
+void addSymbol(compileContext * ctx, int tokenValue, size_t offset);
+void storeToken(compileContext * ctx, int tokenValue, int payload, size_t offset);
+int internName(compileContext * ctx, const char * name, size_t length);
+unsigned int hashBytes(const char * bytes, size_t length);
+unsigned int findNameSlot(compileContext * ctx, const char * name, size_t length);
 // Lexeme list functions
-int findTokenValue(char * token);
-int isNumber(char * token);
-int isIdentifier(char * token);
-int checkInvalidSymbols(char * token);
-int isSymbol(char token);
-void addToken(char * tokenize, int tokenValue);
+int findTokenValue(const char * word, size_t length, int classes);
+int findReservedWord(const char * word, size_t length);
+void addToken(compileContext * ctx, const char * tokenize, size_t length, int tokenValue);
 
 //start parser program
-void program();
+void program(compileContext * ctx);
 // Assembly Code/ Symbol Table functions
-int symbolTableCheck(char * name);
-void program();
+int symbolTableCheck(compileContext * ctx, int nameId);
+unsigned int findSymbolSlot(compileContext * ctx, int nameId);
+void markScope(compileContext * ctx, int level);
+void program(compileContext * ctx);
 // creates assembly code
-void emit(int op, int l, int m);
+void emit(compileContext * ctx, int op, int l, int m);
+void insertInstruction(compileContext * ctx, int index, int op, int l, int m);
+// compile-time expression values
+operand constantOperand(compileContext * ctx, int value);
+void materialize(compileContext * ctx, operand * x);
+operand negateOperand(compileContext * ctx, operand x);
+operand combine(compileContext * ctx, operand left, int opr, operand right);
+// peephole optimization of the assembly code
+int optimizeCode(compileContext * ctx);
+int peepholePass(compileContext * ctx, int * isTarget, int * newIndex, char * outTarget, char * kept);
+int threadJump(const AssemblyCode * code, int count, int target);
+int foldOperation(int opr, int left, int right, int * result);
+// variable slot compaction of the activation records
+int addFrame(compileContext * ctx, int firstVar, int vars);
+int compactFrames(compileContext * ctx);
+int frameVariable(compileContext * ctx, int frame, int * varOffset, AssemblyCode instruction);
+int frameLiveRanges(compileContext * ctx, int frame, int offset, int * candidate, int candidates, liveRange * ranges);
+void blockLiveOut(const AssemblyCode * code, int inc, int block, int blocks, int * blockOf, int * blockStart,
+                  unsigned long long * in, int words, unsigned long long * live);
+int assignSlots(compileContext * ctx, liveRange * ranges, int count, int * slots);
+int compareLiveRanges(const void * a, const void * b);
 // get token function
-void getToken();
+void getToken(compileContext * ctx);
 //verify constant is properly declared
-void constDeclaration();
+void constDeclaration(compileContext * ctx);
 //verify variable declaration is properly declared
-int varDeclaration();
+int varDeclaration(compileContext * ctx);
 //  ident assignment, expression, begin statment end, if condition-then statement, while condition do statement, read ident, write expression
-void statement();
+void statement(compileContext * ctx);
 // odd expression or (expression, rel-op, expression
-void condition();
-//[+ | -] term {(+|-)term}
-void expression();
+void condition(compileContext * ctx);
+//[+ | -] term {(+|-)term}, term = factor {(*|/) factor}, factor = ident | number | ( expression )
+operand expression(compileContext * ctx);
+operand parseExpression(compileContext * ctx, int * relational);
+static inline void pushExpr(compileContext * ctx, int kind, int opr, int precedence, operand left);
+static inline operand reduceExpr(compileContext * ctx, operand x, int base, int precedence);
+static inline operand parseFactor(compileContext * ctx);
 //will output all errors, checking for syntax error
-void error(int err);
-void term();
-void factor();
-void block();
-void addSymbolTable(int kind, char * name, int val, int level, int addr, int mark);
-
-
+void error(compileContext * ctx, int err);
+void syntaxError(compileContext * ctx, int err);
+void nestedTooDeep(compileContext * ctx);
+void recover(compileContext * ctx);
+const char * errorMessage(int err);
+void printDiagnostics(compileContext * ctx, FILE * out);
+void writeDiagnostics(compileContext * ctx, outputBuffer * out);
+void locateOffset(compileContext * ctx, unsigned int offset, unsigned int * position, int * line, int * column);
+void fail(compileContext * ctx, const char * message);
+void block(compileContext * ctx, int procIdx);
+void procDeclaration(compileContext * ctx);
+void addSymbolTable(compileContext * ctx, int kind, int nameId, int val, int level, int addr, int mark);
+
+// Scanning kernels for every instruction set, selectScanKernels() points Scan at the widest one
+const scanKernels ScanScalar = { "scalar", skipSpaceScalar, findCommentEndScalar, scanWordScalar };
+#if defined(__x86_64__) || defined(__i386__)
+const scanKernels ScanSse2 = { "sse2", skipSpaceSse2, findCommentEndSse2, scanWordSse2 };
+// Words are at most 11 characters, wider blocks than SSE2's 16 bytes only cost time there
+const scanKernels ScanAvx2 = { "avx2", skipSpaceAvx2, findCommentEndAvx2, scanWordSse2 };
+#endif
+const scanKernels * Scan = &ScanScalar;
+pthread_once_t ScanSelected = PTHREAD_ONCE_INIT;
+#ifndef PL0_LIBRARY
+// Set by SIGINT or SIGTERM in --serve mode, which also write to the wake pipe so poll() returns
+volatile sig_atomic_t ServeStopping = 0;
+int ServeWake = -1;
+#endif
+
+// Listing formats, JSON lines have nothing to write before the first section
+const listingEmitter Emitters[FORMAT_COUNT] = {
+    { "text", textBegin, textLexemes, textCode, textSymbols },
+    { "json", textBegin, jsonLexemes, jsonCode, jsonSymbols },
+    { "binary", binaryBegin, binaryLexemes, binaryCode, binarySymbols }
+};
+
+
+#ifndef PL0_LIBRARY
 int main(int argc, char *argv[]) {
 
     // Accept file name as command line argument
-    char * file_input = argv[1];
-    FILE *fp = fopen(file_input, "r"); // Change back to soft file from hard file
+    // -o file writes the code as a .pm0 object file, --load file prints one back
+    // --run executes the code instead of printing it, -O folds constants and runs the peephole optimizer
+    // --display makes --run reach non-local variables through a display instead of static links
+    // --lexemes builds the lexeme list and prints it before the code
+    // --stats prints phase times and counters to stderr, --stats-json file writes them as JSON
+    // --jobs N compiles every file given on N threads, each to its own .out file
+    // --emit-asm file writes the code as x86-64 assembly to link with pl0rt.c
+    // --cache dir reuses the results of earlier compiles of the same source, --cache-size MB caps it
+    // --watch keeps running and recompiles only the statements each change of the file touches
+    // --lex-threads N lexes large files on N threads (one per core by default)
+    // --format text|json|binary picks the listing format, --output file writes the listing there
+    // --no-symbols leaves the symbol table out of the listing
+    // --serve socket runs a compile server on --jobs N workers, --connect socket file compiles through one
+    // and --connect socket --server-stats prints its request counts and latencies
+    char * file_input = NULL;
+    char * listing_output = NULL;
+    char * object_output = NULL;
+    char * object_input = NULL;
+    char * stats_output = NULL;
+    char * asm_output = NULL;
+    char * cache_dir = NULL;
+    char * serve_path = NULL;
+    char * connect_path = NULL;
+    int server_stats = 0;
+    long long cache_limit = CACHE_DEFAULT_MB * 1048576LL;
+    char ** files = malloc(sizeof(char *) * argc);
+    int fileCount = 0;
+    int run_program = 0;
+    int display = 0;
+    int print_stats = 0;
+    int optimize = 0;
+    int lexemes = 0;
+    int jobs = 0;
+    int watch = 0;
+    int lexThreads = 0;
+    int format = FORMAT_TEXT;
+    int listSymbols = 1;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            object_output = argv[++i];
+        } else if(strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            object_input = argv[++i];
+        } else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            listing_output = argv[++i];
+        } else if(strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            for(format = 0; format < FORMAT_COUNT && strcmp(argv[i], Emitters[format].name) != 0; format++) {
+            }
+            if(format == FORMAT_COUNT) {
+                printf("Error: unknown format %s\n", argv[i]);
+                exit(1);
+            }
+        } else if(strcmp(argv[i], "--no-symbols") == 0) {
+            listSymbols = 0;
+        } else if(strcmp(argv[i], "--emit-asm") == 0 && i + 1 < argc) {
+            asm_output = argv[++i];
+        } else if(strcmp(argv[i], "--run") == 0) {
+            run_program = 1;
+        } else if(strcmp(argv[i], "--display") == 0) {
+            display = 1;
+        } else if(strcmp(argv[i], "-O") == 0) {
+            optimize = 1;
+        } else if(strcmp(argv[i], "--watch") == 0) {
+            watch = 1;
+        } else if(strcmp(argv[i], "--lexemes") == 0) {
+            lexemes = 1;
+        } else if(strcmp(argv[i], "--stats") == 0) {
+            print_stats = 1;
+        } else if(strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_output = argv[++i];
+        } else if(strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if(strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache_limit = atoll(argv[++i]) * 1048576LL;
+        } else if(strcmp(argv[i], "--lex-threads") == 0 && i + 1 < argc) {
+            lexThreads = atoi(argv[++i]);
+            if(lexThreads < 1) {
+                lexThreads = 1;
+            }
+        } else if(strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if(strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+            connect_path = argv[++i];
+        } else if(strcmp(argv[i], "--server-stats") == 0) {
+            server_stats = 1;
+        } else if(strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if(jobs < 1) {
+                jobs = 1;
+            }
+        } else {
+            file_input = argv[i];
+            if(files != NULL) {
+                files[fileCount++] = argv[i];
+            }
+        }
+    }
+
+    if(serve_path != NULL) {
+        free(files);
+
+        return serveSocket(serve_path, jobs > 0 ? jobs : (int) sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    if(jobs > 0) {
+        if(files == NULL) {
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+
+        int failed = compileBatch(files, fileCount, jobs, optimize, lexemes, format, listSymbols, cache_dir, cache_limit);
+
+        free(files);
+
+        return failed > 0 ? 1 : 0;
+    }
+
+    free(files);
+
+    FILE * listing = stdout;
+
+    if(listing_output != NULL && !watch && !run_program && (listing = fopen(listing_output, "wb")) == NULL) {
+        printf("Error: could not write %s\n", listing_output);
+        exit(1);
+    }
+
+    if(connect_path != NULL) {
+        if(file_input == NULL && !server_stats) {
+            printf("Error opening file");
+            exit(0);
+        }
+
+        int flags = optimize * SERVE_OPTIMIZE | lexemes * SERVE_LEXEMES | !listSymbols * SERVE_NO_SYMBOLS | format << SERVE_FORMAT_SHIFT;
+        int status = connectSource(connect_path, server_stats ? NULL : file_input, flags, listing);
+
+        if(fflush(listing) != 0 || (listing != stdout && fclose(listing) != 0)) {
+            status = 1;
+        }
+
+        return status;
+    }
+
+    if(object_input != NULL) {
+        objectFile object;
+
+        if(loadObject(object_input, &object) == -1) {
+            printf("Error: %s is not a valid object file\n", object_input);
+            exit(1);
+        }
+
+        int status = 0;
+
+        if(asm_output != NULL && writeAssembly(asm_output, object.code, object.count) == -1) {
+            printf("Error: could not write %s\n", asm_output);
+            unloadObject(&object);
+            exit(1);
+        }
+
+        if(run_program) {
+            status = runProgram(object.code, object.count, display);
+        } else {
+            outputBuffer out;
+
+            if(outputOpen(&out, listing) == -1) {
+                printf("Error: out of memory\n");
+                exit(1);
+            }
+
+            Emitters[format].begin(&out);
+            Emitters[format].code(&out, object.code, object.count);
+
+            if(outputClose(&out) == -1 || fflush(listing) != 0) {
+                fprintf(stderr, "Error: could not write the listing\n");
+                status = 1;
+            }
+        }
+
+        unloadObject(&object);
+
+        if(listing != stdout && fclose(listing) != 0) {
+            status = 1;
+        }
+
+        return status;
+    }
+
+#ifndef STATS
+    if(print_stats || stats_output != NULL) {
+        fprintf(stderr, "Warning: statistics are not compiled in, rebuild with -DSTATS\n");
+    }
+#endif
+
+    if(watch) {
+        if(file_input == NULL) {
+            printf("Error opening file");
+            exit(0);
+        }
+
+        return watchSource(file_input, optimize, object_output);
+    }
+
+    compileContext * ctx = createContext(optimize, lexemes);
+
+    if(ctx == NULL) {
+        printf("Error: out of memory\n");
+        exit(1);
+    }
+
+    ctx->LexThreads = lexThreads > 0 ? lexThreads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    ctx->ListingFormat = format;
+    ctx->ListSymbols = listSymbols;
 
     // Check if file exists
-    if (fp == NULL) {
+    if (file_input == NULL || readSource(ctx, file_input) == -1) {
         printf("Error opening file");
         exit(0);
     }
 
-    char buffer[MAX_LINE_LENGTH];
-    int isComment = 0;
+    // A cache hit stands in for the whole compile, lexing and parsing included
+    cacheEntry cached = { 0 };
+    unsigned long long key = 0;
+    int hit = 0;
 
-    // Read file into tokenize array
-    while(fgets(buffer, 1000, fp) != NULL) {
-        // fprintf(stdout, "Current Line: %s\n", buffer);
+    if(cache_dir != NULL) {
+        key = cacheKey(ctx);
+        hit = cacheLoad(cache_dir, key, ctx->Source, ctx->SourceLength, &cached) == 0;
+    }
 
-        int bufferLength = strlen(buffer);
-        int commentStartIndex = -1;
-        int commentEndIndex = -1;
+    if(hit) {
+        ctx->VariableSlots = cached.header->variableSlots;
+        ctx->SlotsRemoved = cached.header->slotsRemoved;
+        ctx->PeepholeRemoved = cached.header->peepholeRemoved;
+    } else {
+        if(compileSource(ctx) == -1) {
+            printDiagnostics(ctx, stdout);
+            destroyContext(ctx);
 
-        if(strstr(buffer, "/*") != NULL || isComment == 1) {
-            // Find where the comment starts
-            if(isComment == 0) {
-                commentStartIndex = 0;
-                while(buffer[commentStartIndex] != '/' && buffer[commentStartIndex + 1] != '*') {
-                    commentStartIndex++;
-                }
-            }
+            return 1;
+        }
 
-            isComment = 1;
+        if(cache_dir != NULL && cacheStore(cache_dir, cache_limit, key, ctx) == -1) {
+            fprintf(stderr, "Warning: could not add to the cache in %s\n", cache_dir);
+        }
+    }
 
-            if(strstr(buffer, "*/") != NULL) {
-                isComment = 0;
+    const AssemblyCode * code = hit ? cached.code : ctx->AssemblyCodeList;
+    int count = hit ? (int) cached.header->count : ctx->AssemblyCodeListIndex;
 
-                // Find where the comment ends
-                if(commentStartIndex == -1) {
-                    commentEndIndex = 0;
-                } else {
-                    commentEndIndex = commentStartIndex + 2;
-                }
+    if(optimize) {
+        fprintf(stderr, "Frames: removed %d of %d variable slots\n", ctx->SlotsRemoved, ctx->VariableSlots);
+        fprintf(stderr, "Peephole: removed %d of %d instructions\n", ctx->PeepholeRemoved, count + ctx->PeepholeRemoved);
+    }
+
+    if(object_output != NULL && writeObject(object_output, code, count) == -1) {
+        printf("Error: could not write %s\n", object_output);
+        exit(1);
+    }
+
+    if(asm_output != NULL && writeAssembly(asm_output, code, count) == -1) {
+        printf("Error: could not write %s\n", asm_output);
+        exit(1);
+    }
+
+    if(run_program) {
+#ifdef STATS
+        if(print_stats) {
+            printStats(ctx, stderr);
+        }
+
+        if(stats_output != NULL && writeStatsJson(ctx, stats_output) == -1) {
+            fprintf(stderr, "Error: could not write %s\n", stats_output);
+        }
+#endif
+
+        int status = runProgram(code, count, display);
+
+        cacheRelease(&cached);
+        destroyContext(ctx);
+
+        return status;
+    }
+
+    STAT_START(outputStart);
+    int written;
+    if(hit) {
+        written = fwrite(cached.listing, 1, cached.header->listingLength, listing) == cached.header->listingLength ? 0 : -1;
+    } else {
+        written = writeListing(ctx, listing);
+    }
+    if(fflush(listing) != 0 || (listing != stdout && fclose(listing) != 0)) {
+        written = -1;
+    }
+    STAT_PHASE(outputSeconds, outputStart);
+
+    if(written == -1) {
+        fprintf(stderr, "Error: could not write the listing\n");
+    }
+
+#ifdef STATS
+    if(print_stats) {
+        printStats(ctx, stderr);
+    }
+
+    if(stats_output != NULL && writeStatsJson(ctx, stats_output) == -1) {
+        fprintf(stderr, "Error: could not write %s\n", stats_output);
+    }
+#endif
+
+    cacheRelease(&cached);
+    destroyContext(ctx);
+
+    return written == -1 ? 1 : 0;
+}
+#endif
+
+// A fresh context owns no memory until the source is read and the tables grow
+compileContext * createContext(int optimize, int buildLexemeList) {
+    compileContext * ctx = calloc(1, sizeof(compileContext));
+
+    pthread_once(&ScanSelected, selectScanKernels);
+
+    if(ctx != NULL) {
+        ctx->Optimize = optimize;
+        ctx->BuildLexemeList = buildLexemeList;
+        ctx->ListSymbols = 1;
+        ctx->CurrentFrame = -1;
+    }
+
+    return ctx;
+}
+
+void destroyContext(compileContext * ctx) {
+    releaseSource(ctx);
+    arenaRelease(ctx);
+
+    while(ctx->Scratch != NULL) {
+        arenaChunk * next = ctx->Scratch->next;
+        free(ctx->Scratch);
+        ctx->Scratch = next;
+    }
+
+    free(ctx);
+}
+
+// Forget the last compile but keep its options and its memory for the next one
+void resetContext(compileContext * ctx) {
+    arenaChunk * arena = ctx->Arena;
+    arenaChunk * scratch = ctx->Scratch;
+    int optimize = ctx->Optimize;
+    int buildLexemeList = ctx->BuildLexemeList;
+    int lexThreads = ctx->LexThreads;
+    int listingFormat = ctx->ListingFormat;
+    int listSymbols = ctx->ListSymbols;
+
+    releaseSource(ctx);
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->Arena = arena;
+    arenaReset(ctx);
+    ctx->Scratch = scratch;
+    ctx->ScratchTop = scratch;
+
+    ctx->Optimize = optimize;
+    ctx->BuildLexemeList = buildLexemeList;
+    ctx->LexThreads = lexThreads;
+    ctx->ListingFormat = listingFormat;
+    ctx->ListSymbols = listSymbols;
+    ctx->CurrentFrame = -1;
+}
+
+// Compile the source already read into the context
+// Returns 0, or -1 when there are diagnostics or fail() left a fatal message
+int compileSource(compileContext * ctx) {
+    if(setjmp(ctx->Bail) != 0) {
+        return -1;
+    }
+
+    addSymbolTable(ctx, 3, internName(ctx, "main", 4), 0, 0, 0, 0);
+
+    // The parser pulls tokens from the lexer as it goes, unless a large source is lexed up front on
+    // several threads; the lexeme list is built by the serial lexer only
+    STAT_START(parseStart);
+    if(ctx->LexThreads > 1 && !ctx->BuildLexemeList) {
+        STAT_START(lexStart);
+        lexParallel(ctx, ctx->LexThreads);
+        STAT_PHASE(lexSeconds, lexStart);
+    }
+    program(ctx);
+    STAT_PHASE(parseSeconds, parseStart);
+#ifdef STATS
+    ctx->Stats.parseSeconds -= ctx->Stats.lexSeconds;
+#endif
+
+    // The lexeme list covers the whole input, including anything after the period
+    if(ctx->BuildLexemeList) {
+        do {
+            ctx->TokenHead = 0;
+            ctx->TokenCount = 0;
+            lexTokens(ctx, ctx->Source, ctx->SourceLength);
+        } while(ctx->TokenCount > 0);
+
+        if(ctx->LexemeListIndex > 0) {
+            ctx->LexemeList[ctx->LexemeListIndex-1] = '\0';
+        }
+    }
+
+    if(ctx->DiagnosticCount > 0) {
+        return -1;
+    }
+
+    // Watched code is spliced statement by statement, the passes over the whole program would undo that
+    if(ctx->Optimize && !ctx->RecordStatements) {
+        STAT_START(optimizeStart);
+        // Stores to variables that are never read become pops, the peephole pass cleans them up
+        ctx->SlotsRemoved = compactFrames(ctx);
+        ctx->PeepholeRemoved = optimizeCode(ctx);
+        STAT_PHASE(optimizeSeconds, optimizeStart);
+    }
+
+    return 0;
+}
+
+// Lexeme list (with --lexemes), assembly code and symbol table (without --no-symbols) in the context's format
+void printListing(compileContext * ctx, outputBuffer * out) {
+    const listingEmitter * emitter = &Emitters[ctx->ListingFormat];
+
+    emitter->begin(out);
+
+    if(ctx->BuildLexemeList) {
+        emitter->lexemes(out, ctx->LexemeList != NULL ? ctx->LexemeList : "");
+    }
+
+    emitter->code(out, ctx->AssemblyCodeList, ctx->AssemblyCodeListIndex);
+
+    if(ctx->ListSymbols) {
+        emitter->symbols(out, ctx->SymbolTable, ctx->SymbolTableIndex);
+    }
+}
+
+#ifndef PL0_LIBRARY
+// The listing written to fp through an output buffer
+// Returns -1 when it could not be written whole
+int writeListing(compileContext * ctx, FILE * fp) {
+    outputBuffer out;
+
+    if(outputOpen(&out, fp) == -1) {
+        return -1;
+    }
+
+    printListing(ctx, &out);
+
+    return outputClose(&out);
+}
+#endif
+
+pl0_context * pl0_context_new(void) {
+    return createContext(0, 0);
+}
+
+void pl0_context_free(pl0_context * ctx) {
+    if(ctx != NULL) {
+        destroyContext(ctx);
+    }
+}
+
+// Compile from the caller's memory in a reset context, then lay the tables out for pl0.h
+int pl0_compile(pl0_context * ctx, const char * source, size_t length, const pl0_options * options, pl0_result * result) {
+    static const pl0_diagnostic outOfMemory = { 0, 0, 0, "Error: out of memory\n" };
+
+    resetContext(ctx);
+
+    ctx->Optimize = options != NULL && options->optimize;
+    ctx->BuildLexemeList = options != NULL && options->lexemes;
+    ctx->LexThreads = options != NULL ? options->lex_threads : 0;
+    ctx->Source = (char *) source;
+    ctx->SourceLength = length;
+    ctx->SourceBorrowed = 1;
+
+    int status = compileSource(ctx);
+
+    memset(result, 0, sizeof(*result));
+
+    // No memory for the result, only the fatal error is left
+    if(setjmp(ctx->Bail) != 0) {
+        memset(result, 0, sizeof(*result));
+        result->diagnostics = &outOfMemory;
+        result->diagnostic_count = 1;
+        return -1;
+    }
+
+    collectResult(ctx, result);
+
+    return status;
+}
+
+// The result's arrays come from the arena like every other table of the compile
+void collectResult(compileContext * ctx, pl0_result * result) {
+    pl0_instruction * code = arenaAlloc(ctx, sizeof(pl0_instruction) * (ctx->AssemblyCodeListIndex + 1));
+    pl0_symbol * symbols = arenaAlloc(ctx, sizeof(pl0_symbol) * (ctx->SymbolTableIndex + 1));
+    int diagnosticCount = ctx->DiagnosticCount + (ctx->Diagnostic != NULL);
+    pl0_diagnostic * diagnostics = arenaAlloc(ctx, sizeof(pl0_diagnostic) * (diagnosticCount + 1));
+
+    for(int i = 0; i < ctx->AssemblyCodeListIndex; i++) {
+        code[i].op = ctx->AssemblyCodeList[i].op;
+        code[i].l = ctx->AssemblyCodeList[i].l;
+        code[i].m = ctx->AssemblyCodeList[i].m;
+    }
+
+    for(int i = 0; i < ctx->SymbolTableIndex; i++) {
+        symbols[i].kind = ctx->SymbolTable[i].kind;
+        symbols[i].name = ctx->SymbolTable[i].name;
+        symbols[i].value = ctx->SymbolTable[i].val;
+        symbols[i].level = ctx->SymbolTable[i].level;
+        symbols[i].address = ctx->SymbolTable[i].addr;
+        symbols[i].mark = ctx->SymbolTable[i].mark;
+    }
+
+    unsigned int position = 0;
+    int line = 1;
+    int column = 1;
+
+    for(int i = 0; i < ctx->DiagnosticCount; i++) {
+        locateOffset(ctx, ctx->Diagnostics[i].offset, &position, &line, &column);
+
+        diagnostics[i].code = ctx->Diagnostics[i].code;
+        diagnostics[i].line = line;
+        diagnostics[i].column = column;
+        diagnostics[i].message = errorMessage(ctx->Diagnostics[i].code);
+    }
+
+    if(ctx->Diagnostic != NULL) {
+        diagnostics[ctx->DiagnosticCount].code = 0;
+        diagnostics[ctx->DiagnosticCount].line = 0;
+        diagnostics[ctx->DiagnosticCount].column = 0;
+        diagnostics[ctx->DiagnosticCount].message = ctx->Diagnostic;
+    }
+
+    result->code = code;
+    result->code_count = ctx->AssemblyCodeListIndex;
+    result->symbols = symbols;
+    result->symbol_count = ctx->SymbolTableIndex;
+    result->diagnostics = diagnostics;
+    result->diagnostic_count = diagnosticCount;
+    // The lexeme list is only finished when the compile did not fail()
+    if(ctx->BuildLexemeList && ctx->Diagnostic == NULL) {
+        result->lexemes = ctx->LexemeList != NULL ? ctx->LexemeList : "";
+    }
+}
+
+#ifndef PL0_LIBRARY
+// Compile files on a pool of threads, each file to <file>.out with what stdout would show
+// Every worker starts with an equal slice of the files and steals half of another
+// worker's remaining slice when its own runs out
+// Returns the number of files that could not be read, compiled or written
+int compileBatch(char ** files, int fileCount, int workerCount, int optimize, int buildLexemeList, int format, int listSymbols, const char * cacheDir, long long cacheLimit) {
+    if(workerCount > fileCount) {
+        workerCount = fileCount > 0 ? fileCount : 1;
+    }
+
+    batchQueue * queues = malloc(sizeof(batchQueue) * workerCount);
+    batchWorker * workers = malloc(sizeof(batchWorker) * workerCount);
+
+    if(queues == NULL || workers == NULL) {
+        free(queues);
+        free(workers);
+        fprintf(stderr, "Error: out of memory\n");
+        return fileCount;
+    }
+
+    for(int i = 0; i < workerCount; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        queues[i].next = (int) ((long long) fileCount * i / workerCount);
+        queues[i].end = (int) ((long long) fileCount * (i + 1) / workerCount);
+
+        workers[i].id = i;
+        workers[i].workerCount = workerCount;
+        workers[i].queues = queues;
+        workers[i].files = files;
+        workers[i].optimize = optimize;
+        workers[i].buildLexemeList = buildLexemeList;
+        workers[i].format = format;
+        workers[i].listSymbols = listSymbols;
+        workers[i].cacheDir = cacheDir;
+        workers[i].cacheLimit = cacheLimit;
+        workers[i].failed = 0;
+    }
+
+    // Worker 0 is this thread, the queues of threads that fail to start are stolen like any other
+    int started = 1;
+    for(int i = 1; i < workerCount; i++) {
+        if(pthread_create(&workers[i].thread, NULL, batchWorkerMain, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    batchWorkerMain(&workers[0]);
+
+    int failed = workers[0].failed;
+    for(int i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        failed += workers[i].failed;
+    }
+
+    for(int i = 0; i < workerCount; i++) {
+        pthread_mutex_destroy(&queues[i].lock);
+    }
+
+    fprintf(stderr, "Compiled %d files on %d threads, %d failed\n", fileCount, started, failed);
+
+    free(queues);
+    free(workers);
+
+    return failed;
+}
+
+void * batchWorkerMain(void * arg) {
+    batchWorker * worker = arg;
+    int file;
+
+    while((file = takeBatchFile(worker)) != -1) {
+        if(compileToFile(worker->files[file], worker->optimize, worker->buildLexemeList, worker->format, worker->listSymbols, worker->cacheDir, worker->cacheLimit) != 0) {
+            worker->failed++;
+        }
+    }
+
+    return NULL;
+}
+
+// Next file from the worker's own queue, or the first of half a victim's queue
+// The rest of a stolen half becomes the worker's own queue; -1 when nothing is left
+int takeBatchFile(batchWorker * worker) {
+    batchQueue * own = &worker->queues[worker->id];
+    int file = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if(own->next < own->end) {
+        file = own->next++;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for(int i = 1; file == -1 && i < worker->workerCount; i++) {
+        batchQueue * victim = &worker->queues[(worker->id + i) % worker->workerCount];
+        int start = 0;
+        int end = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        if(victim->next < victim->end) {
+            end = victim->end;
+            start = end - (end - victim->next + 1) / 2;
+            victim->end = start;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if(start < end) {
+            file = start;
+
+            pthread_mutex_lock(&own->lock);
+            own->next = start + 1;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+        }
+    }
+
+    return file;
+}
+
+// Compile one file in a context of its own and write the listing or the error to <file>.out
+// With a cache directory a stored listing is copied out instead of compiling
+int compileToFile(char * file_input, int optimize, int buildLexemeList, int format, int listSymbols, const char * cacheDir, long long cacheLimit) {
+    size_t length = strlen(file_input);
+    char * file_output = malloc(length + sizeof(".out"));
+    compileContext * ctx = createContext(optimize, buildLexemeList);
+
+    if(file_output == NULL || ctx == NULL) {
+        free(file_output);
+        free(ctx);
+        fprintf(stderr, "Error: out of memory compiling %s\n", file_input);
+        return -1;
+    }
+
+    memcpy(file_output, file_input, length);
+    memcpy(file_output + length, ".out", sizeof(".out"));
+
+    ctx->ListingFormat = format;
+    ctx->ListSymbols = listSymbols;
+
+    int status = -1;
+
+    if(readSource(ctx, file_input) == -1) {
+        fprintf(stderr, "Error opening file %s\n", file_input);
+    } else {
+        cacheEntry cached = { 0 };
+        unsigned long long key = cacheDir != NULL ? cacheKey(ctx) : 0;
+        int hit = cacheDir != NULL && cacheLoad(cacheDir, key, ctx->Source, ctx->SourceLength, &cached) == 0;
+        int compiled = hit ? 0 : compileSource(ctx);
+
+        if(!hit && compiled == 0 && cacheDir != NULL && cacheStore(cacheDir, cacheLimit, key, ctx) == -1) {
+            fprintf(stderr, "Warning: could not add %s to the cache in %s\n", file_input, cacheDir);
+        }
+
+        FILE * fp = fopen(file_output, "wb");
+
+        if(fp == NULL) {
+            fprintf(stderr, "Error: could not write %s\n", file_output);
+        } else {
+            int written = 0;
+
+            if(hit) {
+                fwrite(cached.listing, 1, cached.header->listingLength, fp);
+            } else if(compiled == 0) {
+                written = writeListing(ctx, fp);
+            } else {
+                printDiagnostics(ctx, fp);
+            }
+
+            status = fclose(fp) == 0 && written == 0 && compiled == 0 ? 0 : -1;
+        }
+
+        cacheRelease(&cached);
+    }
+
+    destroyContext(ctx);
+    free(file_output);
+
+    return status;
+}
+
+// Compile server: this thread polls the listening socket and every connection not being answered,
+// reading requests as their bytes arrive; a whole request goes to the job queue, and a worker
+// compiles it in a context it keeps for every request, answers and hands the connection back
+// Runs until SIGINT or SIGTERM; returns 1 when the server cannot be started
+int serveSocket(const char * path, int workerCount) {
+    struct sockaddr_un address;
+    struct stat st;
+
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path %s is too long\n", path);
+        return 1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path, strlen(path) + 1);
+
+    // A socket left behind by an earlier server is replaced, any other file is not
+    if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(listener == -1 || bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(listener, SOMAXCONN) == -1) {
+        fprintf(stderr, "Error: could not listen on %s\n", path);
+        if(listener != -1) {
+            close(listener);
+        }
+        return 1;
+    }
+
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    serveServer server;
+
+    memset(&server, 0, sizeof(server));
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.waiting, NULL);
+    server.wake[0] = -1;
+    server.wake[1] = -1;
+    server.workerCount = workerCount;
+    server.workers = calloc(workerCount, sizeof(serveWorker));
+
+    int ready = server.workers != NULL && pipe(server.wake) == 0;
+
+    // Workers and the signal handler must never block on a full pipe
+    if(ready) {
+        fcntl(server.wake[1], F_SETFL, fcntl(server.wake[1], F_GETFL) | O_NONBLOCK);
+    }
+
+    for(int i = 0; ready && i < workerCount; i++) {
+        serveWorker * worker = &server.workers[i];
+
+        worker->server = &server;
+        worker->ctx = createContext(0, 0);
+        worker->latency = malloc(sizeof(double) * SERVE_LATENCY_WINDOW);
+        pthread_mutex_init(&worker->lock, NULL);
+
+        ready = worker->ctx != NULL && worker->latency != NULL && outputOpen(&worker->out, NULL) == 0;
+    }
+
+    int started = 0;
+
+    while(ready && started < workerCount && pthread_create(&server.workers[started].thread, NULL, serveWorkerMain, &server.workers[started]) == 0) {
+        started++;
+    }
+
+    servePollSet set = { NULL, NULL, 0, 0 };
+
+    if(!ready || started < workerCount || watchConnection(&set, listener, NULL) == -1 || watchConnection(&set, server.wake[0], NULL) == -1) {
+        fprintf(stderr, "Error: could not start the server\n");
+        stopServer(&server, started);
+        free(set.fds);
+        free(set.connections);
+        close(listener);
+        unlink(path);
+        return 1;
+    }
+
+    struct sigaction stop;
+
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = stopServing;
+    sigemptyset(&stop.sa_mask);
+    ServeWake = server.wake[1];
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    server.started = stopwatch();
+    fprintf(stderr, "Serving on %s with %d workers\n", path, workerCount);
+
+    while(!ServeStopping) {
+        if(poll(set.fds, set.count, pollTimeout(&set, stopwatch())) == -1) {
+            continue;
+        }
+
+        double now = stopwatch();
+
+        // A whole request takes its connection out of the poll set until a worker is done with it,
+        // one that is not whole by its deadline is dropped
+        for(int i = set.count - 1; i >= 2; i--) {
+            serveConnection * connection = set.connections[i];
+            int status = 0;
+
+            if(set.fds[i].revents != 0) {
+                status = readRequest(connection, now);
+            } else if(connection->headerUsed > 0 && now - connection->started >= SERVE_TIMEOUT_SECONDS) {
+                status = -1;
+            }
+
+            if(status != 0) {
+                dropConnection(&set, i);
+            }
+            if(status == 1) {
+                queueJob(&server, connection);
+            } else if(status == -1) {
+                closeConnection(connection);
+            }
+        }
+
+        if(set.fds[1].revents & POLLIN) {
+            serveConnection * idle[256];
+            ssize_t got = read(server.wake[0], idle, sizeof(idle));
+
+            // The signal handler's records are NULL
+            for(int i = 0; i < got / (ssize_t) sizeof(idle[0]); i++) {
+                if(idle[i] != NULL) {
+                    watchConnection(&set, idle[i]->fd, idle[i]);
+                }
+            }
+        }
+
+        if(set.fds[0].revents & POLLIN) {
+            acceptConnections(listener, &set);
+        }
+    }
+
+    // Requests being compiled are answered, the rest are dropped
+    stopServer(&server, workerCount);
+
+    for(int i = 2; i < set.count; i++) {
+        closeConnection(set.connections[i]);
+    }
+    free(set.fds);
+    free(set.connections);
+    close(listener);
+    unlink(path);
+    fprintf(stderr, "Stopped serving on %s\n", path);
+
+    return 0;
+}
+
+// Stop the first started workers once they are done with the request in hand, close the connections
+// still queued or handed back, and free the workers
+void stopServer(serveServer * server, int started) {
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+    pthread_cond_broadcast(&server->waiting);
+    pthread_mutex_unlock(&server->lock);
+
+    for(int i = 0; i < started; i++) {
+        pthread_join(server->workers[i].thread, NULL);
+    }
+
+    for(int i = 0; i < server->jobCount; i++) {
+        closeConnection(server->jobs[(server->jobHead + i) % server->jobCapacity]);
+    }
+    free(server->jobs);
+
+    if(server->wake[0] != -1) {
+        serveConnection * idle[256];
+        ssize_t got;
+
+        fcntl(server->wake[0], F_SETFL, fcntl(server->wake[0], F_GETFL) | O_NONBLOCK);
+        while((got = read(server->wake[0], idle, sizeof(idle))) > 0) {
+            for(int i = 0; i < got / (ssize_t) sizeof(idle[0]); i++) {
+                if(idle[i] != NULL) {
+                    closeConnection(idle[i]);
+                }
+            }
+        }
+
+        ServeWake = -1;
+        close(server->wake[0]);
+        close(server->wake[1]);
+    }
+
+    for(int i = 0; server->workers != NULL && i < server->workerCount; i++) {
+        if(server->workers[i].ctx != NULL) {
+            destroyContext(server->workers[i].ctx);
+        }
+        outputClose(&server->workers[i].out);
+        free(server->workers[i].latency);
+    }
+    free(server->workers);
+}
+
+// Take every pending connection, they stay non-blocking so no client can hold up a thread
+int acceptConnections(int listener, servePollSet * set) {
+    int accepted = 0;
+    int fd;
+
+    while((fd = accept(listener, NULL, NULL)) != -1) {
+        serveConnection * connection = calloc(1, sizeof(serveConnection));
+
+        if(connection == NULL) {
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        connection->fd = fd;
+
+        if(watchConnection(set, fd, connection) == 0) {
+            accepted++;
+        }
+    }
+
+    return accepted;
+}
+
+// Watch fd for reading; without memory for it the connection is closed
+int watchConnection(servePollSet * set, int fd, serveConnection * connection) {
+    if(set->count == set->capacity) {
+        int grown = set->capacity == 0 ? 64 : set->capacity * 2;
+        struct pollfd * fds = realloc(set->fds, sizeof(struct pollfd) * grown);
+
+        if(fds != NULL) {
+            set->fds = fds;
+        }
+
+        serveConnection ** connections = fds == NULL ? NULL : realloc(set->connections, sizeof(serveConnection *) * grown);
+
+        if(connections == NULL) {
+            if(connection != NULL) {
+                closeConnection(connection);
+            }
+            return -1;
+        }
+
+        set->connections = connections;
+        set->capacity = grown;
+    }
+
+    set->fds[set->count].fd = fd;
+    set->fds[set->count].events = POLLIN;
+    set->fds[set->count].revents = 0;
+    set->connections[set->count] = connection;
+    set->count++;
+
+    return 0;
+}
+
+void dropConnection(servePollSet * set, int index) {
+    set->count--;
+    set->fds[index] = set->fds[set->count];
+    set->connections[index] = set->connections[set->count];
+}
+
+void closeConnection(serveConnection * connection) {
+    close(connection->fd);
+    free(connection->source);
+    free(connection);
+}
+
+// Milliseconds until the earliest half-read request runs out of time, -1 with none
+int pollTimeout(servePollSet * set, double now) {
+    double earliest = -1;
+
+    for(int i = 2; i < set->count; i++) {
+        if(set->connections[i]->headerUsed > 0 && (earliest < 0 || set->connections[i]->started < earliest)) {
+            earliest = set->connections[i]->started;
+        }
+    }
+
+    if(earliest < 0) {
+        return -1;
+    }
+
+    double left = earliest + SERVE_TIMEOUT_SECONDS - now;
+
+    return left > 0 ? (int) (left * 1000) + 1 : 0;
+}
+
+// Read what has arrived of a request without blocking
+// Returns 1 when the request is whole (or refused), 0 when more is to come, -1 when the client has gone
+int readRequest(serveConnection * connection, double now) {
+    for(;;) {
+        char * at;
+        size_t want;
+
+        if(connection->headerUsed < SERVE_HEADER_SIZE) {
+            at = (char *) connection->header + connection->headerUsed;
+            want = SERVE_HEADER_SIZE - connection->headerUsed;
+        } else if(connection->refusal == NULL && connection->sourceUsed < connection->length) {
+            at = connection->source + connection->sourceUsed;
+            want = connection->length - connection->sourceUsed;
+        } else {
+            connection->ready = now;
+            return 1;
+        }
+
+        ssize_t got = read(connection->fd, at, want);
+
+        if(got == 0) {
+            return -1;
+        }
+        if(got == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+
+        if(connection->headerUsed == 0) {
+            connection->started = now;
+        }
+
+        if(connection->headerUsed < SERVE_HEADER_SIZE) {
+            connection->headerUsed += got;
+            if(connection->headerUsed == SERVE_HEADER_SIZE) {
+                checkRequest(connection);
+            }
+        } else {
+            connection->sourceUsed += got;
+        }
+    }
+}
+
+// Refuse a malformed header, otherwise make room for the source it announces
+void checkRequest(serveConnection * connection) {
+    const unsigned char * header = connection->header;
+    size_t length = header[4] | header[5] << 8 | header[6] << 16 | (size_t) header[7] << 24;
+
+    connection->length = length;
+    connection->sourceUsed = 0;
+
+    if(header[0] != 'P' || header[1] != 'L' || (header[2] != SERVE_COMPILE && header[2] != SERVE_STATS)) {
+        connection->refusal = "Error: not a compile server request\n";
+    } else if(length > SERVE_MAX_SOURCE) {
+        connection->refusal = "Error: source too large\n";
+    } else if((header[3] >> SERVE_FORMAT_SHIFT) >= FORMAT_COUNT) {
+        connection->refusal = "Error: unknown listing format\n";
+    } else if(length > connection->sourceCapacity) {
+        char * source = realloc(connection->source, length);
+
+        if(source == NULL) {
+            connection->refusal = "Error: out of memory\n";
+        } else {
+            connection->source = source;
+            connection->sourceCapacity = length;
+        }
+    }
+}
+
+// Append to the ring of whole requests and wake one worker
+void queueJob(serveServer * server, serveConnection * connection) {
+    pthread_mutex_lock(&server->lock);
+
+    if(server->jobCount == server->jobCapacity) {
+        int capacity = server->jobCapacity == 0 ? 64 : server->jobCapacity * 2;
+        serveConnection ** jobs = malloc(sizeof(serveConnection *) * capacity);
+
+        if(jobs == NULL) {
+            pthread_mutex_unlock(&server->lock);
+            closeConnection(connection);
+            return;
+        }
+
+        for(int i = 0; i < server->jobCount; i++) {
+            jobs[i] = server->jobs[(server->jobHead + i) % server->jobCapacity];
+        }
+
+        free(server->jobs);
+        server->jobs = jobs;
+        server->jobHead = 0;
+        server->jobCapacity = capacity;
+    }
+
+    server->jobs[(server->jobHead + server->jobCount) % server->jobCapacity] = connection;
+    server->jobCount++;
+
+    pthread_cond_signal(&server->waiting);
+    pthread_mutex_unlock(&server->lock);
+}
+
+void * serveWorkerMain(void * arg) {
+    serveWorker * worker = arg;
+    serveServer * server = worker->server;
+
+    for(;;) {
+        pthread_mutex_lock(&server->lock);
+        while(server->jobCount == 0 && !server->stopping) {
+            pthread_cond_wait(&server->waiting, &server->lock);
+        }
+
+        if(server->stopping) {
+            pthread_mutex_unlock(&server->lock);
+            return NULL;
+        }
+
+        serveConnection * connection = server->jobs[server->jobHead];
+
+        server->jobHead = (server->jobHead + 1) % server->jobCapacity;
+        server->jobCount--;
+        pthread_mutex_unlock(&server->lock);
+
+        int answered = serveRequest(worker, connection);
+
+        connection->headerUsed = 0;
+        connection->sourceUsed = 0;
+        connection->refusal = NULL;
+
+        if(answered == -1 || write(server->wake[1], &connection, sizeof(connection)) != sizeof(connection)) {
+            closeConnection(connection);
+        }
+    }
+}
+
+// Answer a whole request; returns -1 when the connection is to be closed
+int serveRequest(serveWorker * worker, serveConnection * connection) {
+    unsigned char header[SERVE_HEADER_SIZE];
+    outputBuffer * out = &worker->out;
+    int type = connection->header[2];
+    int flags = connection->header[3];
+    int status = SERVE_OK;
+
+    out->used = 0;
+    out->failed = 0;
+
+    if(connection->refusal == NULL && type == SERVE_STATS) {
+        serveStats(worker->server, out);
+    } else if(connection->refusal == NULL) {
+        compileContext * ctx = worker->ctx;
+
+        resetContext(ctx);
+        ctx->Optimize = (flags & SERVE_OPTIMIZE) != 0;
+        ctx->BuildLexemeList = (flags & SERVE_LEXEMES) != 0;
+        ctx->ListSymbols = (flags & SERVE_NO_SYMBOLS) == 0;
+        ctx->ListingFormat = flags >> SERVE_FORMAT_SHIFT;
+        ctx->LexThreads = 1;
+        ctx->Source = connection->source;
+        ctx->SourceLength = connection->length;
+        ctx->SourceBorrowed = 1;
+
+        if(compileSource(ctx) == 0) {
+            printListing(ctx, out);
+        } else {
+            writeDiagnostics(ctx, out);
+            status = SERVE_ERRORS;
+        }
+    }
+
+    if(connection->refusal == NULL && out->failed) {
+        connection->refusal = "Error: out of memory\n";
+    }
+
+    // The client has as long to take the answer as it had to send the request
+    double deadline = stopwatch() + SERVE_TIMEOUT_SECONDS;
+
+    if(connection->refusal != NULL) {
+        putHeader(header, SERVE_REFUSED, 0, strlen(connection->refusal));
+        if(writeUntil(connection->fd, header, sizeof(header), deadline) == 0) {
+            writeUntil(connection->fd, connection->refusal, strlen(connection->refusal), deadline);
+        }
+        return -1;
+    }
+
+    putHeader(header, status, 0, out->used);
+    if(writeUntil(connection->fd, header, sizeof(header), deadline) == -1 || writeUntil(connection->fd, out->data, out->used, deadline) == -1) {
+        return -1;
+    }
+
+    // Stats requests are left out of the latencies they report
+    if(type == SERVE_COMPILE) {
+        pthread_mutex_lock(&worker->lock);
+        worker->latency[worker->requests % SERVE_LATENCY_WINDOW] = stopwatch() - connection->ready;
+        worker->requests++;
+        worker->failed += status == SERVE_ERRORS;
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    return 0;
+}
+
+// Write all of buffer to a non-blocking socket; returns -1 when the client does not take it by the deadline
+int writeUntil(int fd, const void * buffer, size_t length, double deadline) {
+    const char * at = buffer;
+
+    while(length > 0) {
+        ssize_t put = write(fd, at, length);
+
+        if(put > 0) {
+            at += put;
+            length -= put;
+            continue;
+        }
+
+        if(put == -1 && errno == EINTR) {
+            continue;
+        }
+        if(put == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return -1;
+        }
+
+        struct pollfd writable = { fd, POLLOUT, 0 };
+        int left = (int) ((deadline - stopwatch()) * 1000);
+
+        if(left <= 0 || (poll(&writable, 1, left) == 0)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Counts since the start and percentiles over every worker's latest latencies, from the request
+// being seen to its answer being written
+void serveStats(serveServer * server, outputBuffer * out) {
+    long long requests = 0;
+    long long failed = 0;
+    size_t samples = 0;
+    size_t sampleCapacity = (size_t) server->workerCount * SERVE_LATENCY_WINDOW;
+    double * latency = malloc(sizeof(double) * sampleCapacity);
+    char line[256];
+
+    for(int i = 0; i < server->workerCount; i++) {
+        serveWorker * worker = &server->workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+        requests += worker->requests;
+        failed += worker->failed;
+
+        size_t kept = worker->requests < SERVE_LATENCY_WINDOW ? (size_t) worker->requests : SERVE_LATENCY_WINDOW;
+
+        if(latency != NULL) {
+            memcpy(latency + samples, worker->latency, sizeof(double) * kept);
+            samples += kept;
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    int length = snprintf(line, sizeof(line), "requests %lld\nerrors %lld\nworkers %d\nuptime %.3f s\n",
+        requests, failed, server->workerCount, stopwatch() - server->started);
+    outputBytes(out, line, length);
+
+    if(samples > 0) {
+        static const double percentiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+        static const char * names[4] = { "p50", "p90", "p99", "p99.9" };
+
+        qsort(latency, samples, sizeof(double), compareLatencies);
+
+        length = snprintf(line, sizeof(line), "latency over the last %zu requests (us):", samples);
+        outputBytes(out, line, length);
+
+        for(int i = 0; i < 4; i++) {
+            length = snprintf(line, sizeof(line), " %s %.1f", names[i], latency[(size_t) (percentiles[i] * (samples - 1))] * 1e6);
+            outputBytes(out, line, length);
+        }
+
+        length = snprintf(line, sizeof(line), " max %.1f\n", latency[samples - 1] * 1e6);
+        outputBytes(out, line, length);
+    }
+
+    free(latency);
+}
+
+int compareLatencies(const void * a, const void * b) {
+    double left = *(const double *) a;
+    double right = *(const double *) b;
+
+    return (left > right) - (left < right);
+}
+
+void stopServing(int signal) {
+    serveConnection * none = NULL;
+    int saved = errno;
+
+    (void) signal;
+    ServeStopping = 1;
+
+    if(ServeWake != -1 && write(ServeWake, &none, sizeof(none)) != sizeof(none)) {
+        // A full pipe wakes the polling thread anyway
+    }
+    errno = saved;
+}
+
+// Client side, also used by bench/serveload.c
+// Returns the connected socket or -1
+int connectServer(const char * path) {
+    struct sockaddr_un address;
+
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path, strlen(path) + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(fd != -1 && connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int sendRequest(int fd, int type, int flags, const char * payload, size_t length) {
+    unsigned char header[SERVE_HEADER_SIZE];
+
+    putHeader(header, type, flags, length);
+
+    if(writeFull(fd, header, sizeof(header)) == -1 || writeFull(fd, payload, length) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Read a response into *payload, which grows as needed and is the caller's to free
+int readResponse(int fd, int * status, char ** payload, size_t * length, size_t * capacity) {
+    unsigned char header[SERVE_HEADER_SIZE];
+
+    if(readFull(fd, header, sizeof(header)) == -1 || header[0] != 'P' || header[1] != 'L') {
+        return -1;
+    }
+
+    *status = header[2];
+    *length = header[4] | header[5] << 8 | header[6] << 16 | (size_t) header[7] << 24;
+
+    if(*length > *capacity || *payload == NULL) {
+        char * grown = realloc(*payload, *length + 1);
+
+        if(grown == NULL) {
+            return -1;
+        }
+
+        *payload = grown;
+        *capacity = *length + 1;
+    }
+
+    return readFull(fd, *payload, *length);
+}
+
+// Returns -1 on an error, a timeout or the end of the stream before length bytes
+int readFull(int fd, void * buffer, size_t length) {
+    char * at = buffer;
+
+    while(length > 0) {
+        ssize_t got = read(fd, at, length);
+
+        if(got <= 0) {
+            if(got == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        at += got;
+        length -= got;
+    }
+
+    return 0;
+}
+
+int writeFull(int fd, const void * buffer, size_t length) {
+    const char * at = buffer;
+
+    while(length > 0) {
+        ssize_t put = write(fd, at, length);
+
+        if(put <= 0) {
+            if(put == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        at += put;
+        length -= put;
+    }
+
+    return 0;
+}
+
+void putHeader(unsigned char * header, int kind, int flags, size_t length) {
+    header[0] = 'P';
+    header[1] = 'L';
+    header[2] = kind;
+    header[3] = flags;
+    header[4] = length;
+    header[5] = length >> 8;
+    header[6] = length >> 16;
+    header[7] = length >> 24;
+}
+
+// --connect: have the server compile a file (or with no file, report its stats) and print the
+// answer as a local compile would; returns the exit status
+int connectSource(const char * path, char * file_input, int flags, FILE * listing) {
+    compileContext * ctx = NULL;
+    char * payload = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    int status = SERVE_REFUSED;
+
+    if(file_input != NULL) {
+        ctx = createContext(0, 0);
+
+        if(ctx == NULL || readSource(ctx, file_input) == -1) {
+            printf("Error opening file");
+            if(ctx != NULL) {
+                destroyContext(ctx);
+            }
+            return 1;
+        }
+    }
+
+    // A refused request is closed before all of it is sent, the refusal is still there to read
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = connectServer(path);
+
+    if(fd == -1) {
+        printf("Error: could not connect to %s\n", path);
+    } else {
+        if(ctx != NULL) {
+            sendRequest(fd, SERVE_COMPILE, flags, ctx->Source, ctx->SourceLength);
+        } else {
+            sendRequest(fd, SERVE_STATS, 0, NULL, 0);
+        }
+
+        if(readResponse(fd, &status, &payload, &length, &capacity) == -1) {
+            printf("Error: no answer from %s\n", path);
+            status = SERVE_REFUSED;
+        } else {
+            fwrite(payload, 1, length, status == SERVE_OK ? listing : stdout);
+        }
+    }
+
+    if(fd != -1) {
+        close(fd);
+    }
+    if(ctx != NULL) {
+        destroyContext(ctx);
+    }
+    free(payload);
+
+    return status == SERVE_OK ? 0 : 1;
+}
+
+// Map the whole input file into memory, falling back to a single read
+// for inputs that cannot be mapped (pipes, empty files)
+int readSource(compileContext * ctx, char * file_input) {
+    int fd = open(file_input, O_RDONLY);
+
+    if(fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if(S_ISREG(st.st_mode) && st.st_size > 0) {
+        void * mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if(mapped != MAP_FAILED) {
+            madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+            ctx->Source = mapped;
+            ctx->SourceLength = st.st_size;
+            ctx->SourceMapped = 1;
+            close(fd);
+            return 0;
+        }
+    }
+
+    // Not mappable, read it all into one growing buffer
+    size_t capacity = 65536;
+    ctx->Source = malloc(capacity);
+    ctx->SourceLength = 0;
+
+    while(ctx->Source != NULL) {
+        if(ctx->SourceLength == capacity) {
+            capacity *= 2;
+            char * grown = realloc(ctx->Source, capacity);
+            if(grown == NULL) {
+                free(ctx->Source);
+                ctx->Source = NULL;
+                break;
+            }
+            ctx->Source = grown;
+        }
+
+        ssize_t n = read(fd, ctx->Source + ctx->SourceLength, capacity - ctx->SourceLength);
+        if(n <= 0) {
+            break;
+        }
+        ctx->SourceLength += n;
+    }
+
+    close(fd);
+    return ctx->Source == NULL ? -1 : 0;
+}
+#endif
+
+void releaseSource(compileContext * ctx) {
+    if(ctx->SourceMapped) {
+        munmap(ctx->Source, ctx->SourceLength);
+    } else if(!ctx->SourceBorrowed) {
+        free(ctx->Source);
+    }
+
+    ctx->Source = NULL;
+    ctx->SourceLength = 0;
+    ctx->SourceMapped = 0;
+    ctx->SourceBorrowed = 0;
+}
+
+#ifndef PL0_LIBRARY
+// Compile a file, then keep polling it and recompile after every change
+// Each compile prints the listing or the errors; when only statements of the main block changed,
+// just those are parsed again and the lines that replaced them are printed instead
+// With -o the object file is rewritten after every compile without errors
+int watchSource(char * file_input, int optimize, char * object_output) {
+    // Last compile without errors, the one later changes are spliced into
+    compileContext * ctx = NULL;
+    struct stat seen;
+    int first = 1;
+    struct timespec interval = { 0, WATCH_INTERVAL_NS };
+
+    memset(&seen, 0, sizeof(seen));
+
+    for(;; nanosleep(&interval, NULL)) {
+        struct stat st;
+
+        if(stat(file_input, &st) == -1) {
+            continue;
+        }
+
+        if(!first && st.st_ino == seen.st_ino && st.st_size == seen.st_size && st.st_mtime == seen.st_mtime && MTIME_NSEC(st) == MTIME_NSEC(seen)) {
+            continue;
+        }
+
+        first = 0;
+        seen = st;
+
+        compileContext * next = createContext(optimize, 0);
+
+        if(next == NULL || readSourceCopy(next, file_input) == -1) {
+            fprintf(stderr, "Error opening file %s\n", file_input);
+            if(next != NULL) {
+                destroyContext(next);
+            }
+            continue;
+        }
+
+        double start = stopwatch();
+        watchUpdate update;
+
+        if(ctx != NULL && recompileChange(ctx, next, &update) == 0) {
+            destroyContext(next);
+
+            if(update.oldStatements == 0 && update.newStatements == 0) {
+                continue;
+            }
+
+            fprintf(stderr, "Reparsed %d statements of the main block from statement %d (%d before) in %.6f s\n",
+                update.newStatements, update.firstStatement + 1, update.oldStatements, stopwatch() - start);
+            printf("Changed Assembly Code: lines %d-%d replaced %d lines, later lines moved by %d\n", update.codeStart,
+                update.codeStart + update.newLength - 1, update.oldLength, update.newLength - update.oldLength);
+            outputBuffer out;
+
+            if(outputOpen(&out, stdout) == 0) {
+                textCodeRows(&out, ctx->AssemblyCodeList, update.codeStart, update.codeStart + update.newLength);
+                outputClose(&out);
+            }
+        } else {
+            if(ctx != NULL) {
+                destroyContext(ctx);
+            }
+
+            ctx = next;
+            next->RecordStatements = 1;
+
+            if(compileSource(ctx) == -1) {
+                printDiagnostics(ctx, stdout);
+                fflush(stdout);
+                destroyContext(ctx);
+                ctx = NULL;
+                continue;
+            }
+
+            fprintf(stderr, "Compiled %s in %.6f s\n", file_input, stopwatch() - start);
+            writeListing(ctx, stdout);
+        }
+
+        fflush(stdout);
+
+        if(object_output != NULL && writeObject(object_output, ctx->AssemblyCodeList, ctx->AssemblyCodeListIndex) == -1) {
+            fprintf(stderr, "Error: could not write %s\n", object_output);
+        }
+    }
+
+    return 0;
+}
+
+// Read the whole file into memory of the context's own
+// A mapping would change under the compiler when the file is edited in place
+int readSourceCopy(compileContext * ctx, char * file_input) {
+    if(readSource(ctx, file_input) == -1) {
+        return -1;
+    }
+
+    if(ctx->SourceMapped) {
+        char * copy = malloc(ctx->SourceLength);
+
+        if(copy == NULL) {
+            releaseSource(ctx);
+            return -1;
+        }
+
+        memcpy(copy, ctx->Source, ctx->SourceLength);
+        munmap(ctx->Source, ctx->SourceLength);
+        ctx->Source = copy;
+        ctx->SourceMapped = 0;
+    }
+
+    return 0;
+}
+
+// Move the edited source of next into ctx and parse again only the top-level statements of the
+// main block the edit touched. Lexing restarts at the first of them and parsing stops at the first
+// statement boundary after the edit that was also one before it, from where the tokens are the same
+// The new code replaces the old lines in place and the jumps after it move with it
+// Returns -1 when the edit reaches past those statements or does not parse, ctx must then be
+// compiled from scratch; next keeps its source in that case
+int recompileChange(compileContext * ctx, compileContext * next, watchUpdate * update) {
+    statementMark * marks = ctx->Statements;
+    int count = ctx->StatementCount - 1;
+    size_t shorter = ctx->SourceLength < next->SourceLength ? ctx->SourceLength : next->SourceLength;
+    size_t prefix = commonPrefix(ctx->Source, next->Source, shorter);
+    size_t suffix = commonSuffix(ctx->Source + ctx->SourceLength, next->Source + next->SourceLength, shorter - prefix);
+    long long byteDelta = (long long) next->SourceLength - (long long) ctx->SourceLength;
+    // The edit is [prefix, oldEnd) of the old source and [prefix, newEnd) of the new one
+    long long oldEnd = ctx->SourceLength - suffix;
+    long long newEnd = next->SourceLength - suffix;
+
+    memset(update, 0, sizeof(watchUpdate));
+
+    if(ctx->SourceLength == next->SourceLength && prefix == shorter) {
+        return 0;
+    }
+
+    if(count < 1 || prefix < marks[0].offset || oldEnd > marks[count].offset) {
+        return -1;
+    }
+
+    // First statement whose span, up to the next statement's first token, reaches the edit
+    int lo = 0;
+    int hi = count - 1;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if(marks[mid + 1].offset >= prefix) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    int firstStatement = lo;
+    int base = ctx->AssemblyCodeListIndex;
+    int codeStart = marks[firstStatement].code;
+    statementMark * added = NULL;
+    int addedCount = 0;
+    char * oldSource = ctx->Source;
+    size_t oldLength = ctx->SourceLength;
+
+    // The sources trade places, so next frees the old one; they trade back on failure
+    ctx->Source = next->Source;
+    ctx->SourceLength = next->SourceLength;
+    next->Source = oldSource;
+    next->SourceLength = oldLength;
+
+    setMainScope(ctx, 1);
+    int resync = reparseStatements(ctx, firstStatement, newEnd, byteDelta, &added, &addedCount);
+    setMainScope(ctx, 0);
+
+    if(resync == -1) {
+        goto failed;
+    }
+
+    // Rebase the jumps of the new code, calls go to procedures and keep their targets
+    AssemblyCode * code = ctx->AssemblyCodeList;
+    int codeEnd = marks[resync].code;
+    int newLength = ctx->AssemblyCodeListIndex - base;
+    int codeDelta = newLength - (codeEnd - codeStart);
+
+    for(int i = base; i < base + newLength; i++) {
+        if(code[i].op == JMP || code[i].op == JPC) {
+            code[i].m += codeStart - base;
+        }
+    }
+
+    AssemblyCode * replacement = malloc(sizeof(AssemblyCode) * (newLength + 1));
+
+    if(replacement == NULL) {
+        goto failed;
+    }
+
+    memcpy(replacement, &code[base], sizeof(AssemblyCode) * newLength);
+
+    // Everything after the old lines moves, only jumps inside it target lines that moved
+    memmove(&code[codeStart + newLength], &code[codeEnd], sizeof(AssemblyCode) * (base - codeEnd));
+    for(int i = codeStart + newLength; i < base + codeDelta; i++) {
+        if(code[i].op == JMP || code[i].op == JPC) {
+            code[i].m += codeDelta;
+        }
+    }
+
+    memcpy(&code[codeStart], replacement, sizeof(AssemblyCode) * newLength);
+    ctx->AssemblyCodeListIndex = base + codeDelta;
+    free(replacement);
+
+    spliceStatements(ctx, firstStatement, resync - firstStatement, added, addedCount, byteDelta, codeDelta);
+    free(added);
+
+    update->firstStatement = firstStatement;
+    update->oldStatements = resync - firstStatement;
+    update->newStatements = addedCount;
+    update->codeStart = codeStart;
+    update->oldLength = codeEnd - codeStart;
+    update->newLength = newLength;
+
+    return 0;
+
+failed:
+    free(added);
+    next->Source = ctx->Source;
+    next->SourceLength = ctx->SourceLength;
+    ctx->Source = oldSource;
+    ctx->SourceLength = oldLength;
+
+    return -1;
+}
+
+// Parse statements from the start of the given one until a boundary at or after newEnd is the
+// boundary of an old statement, or the end of the block; the marks of the new statements go to added
+// Returns the old statement (the end mark for the end) the tokens agree from again, -1 if there is none
+int reparseStatements(compileContext * ctx, int firstStatement, long long newEnd, long long byteDelta, statementMark ** added, int * addedCount) {
+    if(setjmp(ctx->Bail) != 0) {
+        return -1;
+    }
+
+    statementMark * marks = ctx->Statements;
+    int count = ctx->StatementCount - 1;
+    int base = ctx->AssemblyCodeListIndex;
+    int capacity = 0;
+
+    ctx->LexState = LEX_START;
+    ctx->LexPosition = marks[firstStatement].offset;
+    ctx->TokenHead = 0;
+    ctx->TokenCount = 0;
+    ctx->Panicking = 0;
+    ctx->Recovered = 0;
+    ctx->DiagnosticCount = 0;
+    ctx->CurrentLevel = 0;
+    getToken(ctx);
+
+    // Old mark the next statement boundary is compared against
+    int old = firstStatement;
+
+    for(;;) {
+        if(*addedCount == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            statementMark * grown = realloc(*added, sizeof(statementMark) * capacity);
+            if(grown == NULL) {
+                return -1;
+            }
+            *added = grown;
+        }
+
+        (*added)[*addedCount].offset = ctx->CurrentTokenOffset;
+        (*added)[*addedCount].code = ctx->AssemblyCodeListIndex - base + marks[firstStatement].code;
+        (*addedCount)++;
+
+        statement(ctx);
+
+        if(ctx->Panicking || ctx->DiagnosticCount > 0) {
+            return -1;
+        }
+
+        if(ctx->CurrentTokenValue == semicolonsym) {
+            getToken(ctx);
+
+            long long offset = ctx->CurrentTokenOffset;
+
+            if(offset >= newEnd) {
+                while(old < count && marks[old].offset < offset - byteDelta) {
+                    old++;
+                }
+
+                if(old < count && marks[old].offset == offset - byteDelta) {
+                    return old;
+                }
+            }
+        } else if(ctx->CurrentTokenValue == endsym) {
+            if(ctx->CurrentTokenOffset >= newEnd && marks[count].offset == ctx->CurrentTokenOffset - byteDelta) {
+                return count;
+            }
+            return -1;
+        } else {
+            return -1;
+        }
+    }
+}
+
+// Replace the marks of replaced statements from first with count new ones
+// The marks after them move by the change in source and code length
+void spliceStatements(compileContext * ctx, int first, int replaced, statementMark * marks, int count, long long byteDelta, int codeDelta) {
+    int total = ctx->StatementCount - replaced + count;
+
+    if(total > ctx->StatementCapacity) {
+        int capacity = ctx->StatementCapacity;
+
+        while(capacity < total) {
+            capacity *= 2;
+        }
+
+        ctx->Statements = arenaGrow(ctx, ctx->Statements, ctx->StatementCount, sizeof(statementMark), capacity);
+        ctx->StatementCapacity = capacity;
+    }
+
+    memmove(&ctx->Statements[first + count], &ctx->Statements[first + replaced], sizeof(statementMark) * (ctx->StatementCount - first - replaced));
+
+    for(int i = first + count; i < total; i++) {
+        ctx->Statements[i].offset += byteDelta;
+        ctx->Statements[i].code += codeDelta;
+    }
+
+    memcpy(&ctx->Statements[first], marks, sizeof(statementMark) * count);
+    ctx->StatementCount = total;
+}
+
+// Open the main block's declarations again for statements parsed after the compile, or close them
+// Its names are the outermost, so closing uncovers nothing
+void setMainScope(compileContext * ctx, int open) {
+    for(int i = 0; i < ctx->SymbolTableIndex; i++) {
+        if(ctx->SymbolTable[i].level == 0) {
+            ctx->SymbolHash[findSymbolSlot(ctx, ctx->SymbolTable[i].nameId)].symIdx = open ? i : ctx->SymbolTable[i].shadow;
+        }
+    }
+}
+#endif
+
+// The parser records where every statement of the main block starts, --watch re-parses from there
+void addStatementMark(compileContext * ctx) {
+    if(ctx->StatementCount == ctx->StatementCapacity) {
+        int capacity = ctx->StatementCapacity == 0 ? TABLE_START_SIZE : ctx->StatementCapacity * 2;
+
+        ctx->Statements = arenaGrow(ctx, ctx->Statements, ctx->StatementCount, sizeof(statementMark), capacity);
+        ctx->StatementCapacity = capacity;
+    }
+
+    ctx->Statements[ctx->StatementCount].offset = ctx->CurrentTokenOffset;
+    ctx->Statements[ctx->StatementCount].code = ctx->AssemblyCodeListIndex;
+    ctx->StatementCount++;
+}
+
+#ifndef PL0_LIBRARY
+// Length of the common start of two buffers, a word at a time until they differ
+size_t commonPrefix(const char * a, const char * b, size_t length) {
+    size_t i = 0;
+
+    while(i + 8 <= length && memcmp(a + i, b + i, 8) == 0) {
+        i += 8;
+    }
+
+    while(i < length && a[i] == b[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+// Length of the common end of two buffers given by their ends, at most length bytes
+size_t commonSuffix(const char * aEnd, const char * bEnd, size_t length) {
+    size_t i = 0;
+
+    while(i + 8 <= length && memcmp(aEnd - i - 8, bEnd - i - 8, 8) == 0) {
+        i += 8;
+    }
+
+    while(i < length && *(aEnd - i - 1) == *(bEnd - i - 1)) {
+        i++;
+    }
+
+    return i;
+}
+
+// Write the header and the records in one file
+int writeObject(char * file_output, const AssemblyCode * code, int count) {
+    objectHeader header = { {'P', 'M', '0', '\0'}, OBJECT_VERSION, count, hashBytes((const char *) code, sizeof(AssemblyCode) * count) };
+    FILE * fp = fopen(file_output, "wb");
+
+    if(fp == NULL) {
+        return -1;
+    }
+
+    int failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+
+    if(count > 0 && fwrite(code, sizeof(AssemblyCode), count, fp) != (size_t) count) {
+        failed = 1;
+    }
+
+    if(fclose(fp) != 0 || failed) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Map an object file and point straight at its records after checking
+// the magic, version, size and checksum
+int loadObject(char * file_input, objectFile * object) {
+    int fd = open(file_input, O_RDONLY);
+
+    if(fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(objectHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    void * mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(mapped == MAP_FAILED) {
+        return -1;
+    }
+
+    const objectHeader * header = mapped;
+    const AssemblyCode * code = (const AssemblyCode *) (header + 1);
+
+    if(memcmp(header->magic, "PM0", 4) != 0 || header->version != OBJECT_VERSION ||
+    (size_t) st.st_size != sizeof(objectHeader) + sizeof(AssemblyCode) * (size_t) header->count ||
+    hashBytes((const char *) code, sizeof(AssemblyCode) * header->count) != header->checksum) {
+        munmap(mapped, st.st_size);
+        return -1;
+    }
+
+    object->code = code;
+    object->count = header->count;
+    object->mapping = mapped;
+    object->mappingLength = st.st_size;
+
+    return 0;
+}
+
+void unloadObject(objectFile * object) {
+    munmap(object->mapping, object->mappingLength);
+    object->code = NULL;
+    object->count = 0;
+}
+
+// Cache key of the source read into a context, for this compiler version and these flags
+unsigned long long cacheKey(compileContext * ctx) {
+    unsigned long long seed = ((unsigned long long) CACHE_VERSION << 8) | (ctx->ListingFormat << 3) | (!ctx->ListSymbols << 2) |
+        (ctx->Optimize << 1) | ctx->BuildLexemeList;
+
+    return hashSource(ctx->Source, ctx->SourceLength, seed);
+}
+
+// 64-bit hash of a whole buffer for cache keys, eight bytes at a time
+// Each word is mixed in with a multiply and a shift, the end is MurmurHash3's finalizer
+unsigned long long hashSource(const char * bytes, size_t length, unsigned long long seed) {
+    unsigned long long hash = seed ^ (length * 0x9e3779b97f4a7c15ULL);
+    unsigned long long word;
+    size_t i = 0;
+
+    for(; i + 8 <= length; i += 8) {
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+
+    word = 0;
+    memcpy(&word, bytes + i, length - i);
+    hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+// Map the entry for a key and check it is whole and was compiled from exactly this source, since
+// different sources can share a key; a hit marks the entry as used now for the eviction
+// Returns -1 on a miss
+int cacheLoad(const char * cacheDir, unsigned long long key, const char * source, size_t sourceLength, cacheEntry * entry) {
+    char path[PATH_MAX];
+
+    if(snprintf(path, sizeof(path), "%s/%016llx.pmc", cacheDir, key) >= (int) sizeof(path)) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+
+    if(fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(cacheHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    void * mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(mapped != MAP_FAILED) {
+        futimens(fd, NULL);
+    }
+    close(fd);
+
+    if(mapped == MAP_FAILED) {
+        return -1;
+    }
+
+    const cacheHeader * header = mapped;
+    const AssemblyCode * code = (const AssemblyCode *) (header + 1);
+    size_t codeBytes = sizeof(AssemblyCode) * (size_t) header->count;
+
+    if(memcmp(header->magic, "PMC", 4) != 0 || header->version != CACHE_VERSION || header->key != key ||
+    header->sourceLength != sourceLength ||
+    (size_t) st.st_size != sizeof(cacheHeader) + codeBytes + header->listingLength + sourceLength ||
+    memcmp((const char *) code + codeBytes + header->listingLength, source, sourceLength) != 0 ||
+    hashSource((const char *) code + codeBytes, header->listingLength, hashSource((const char *) code, codeBytes, 0)) != header->checksum) {
+        munmap(mapped, st.st_size);
+        return -1;
+    }
+
+    entry->header = header;
+    entry->code = code;
+    entry->listing = (const char *) code + codeBytes;
+    entry->mapping = mapped;
+    entry->mappingLength = st.st_size;
+
+    return 0;
+}
+
+void cacheRelease(cacheEntry * entry) {
+    if(entry->mapping != NULL) {
+        munmap(entry->mapping, entry->mappingLength);
+    }
+
+    entry->mapping = NULL;
+}
+
+// Add a compiled context to the cache and evict down to the limit
+// The entry is written to a temporary file and renamed into place, so compilers sharing
+// the directory see a whole entry or none; the last of several writers of a key wins
+int cacheStore(const char * cacheDir, long long cacheLimit, unsigned long long key, compileContext * ctx) {
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+
+    if(snprintf(path, sizeof(path), "%s/%016llx.pmc", cacheDir, key) >= (int) sizeof(path) ||
+    snprintf(temp, sizeof(temp), "%s/.tmpXXXXXX", cacheDir) >= (int) sizeof(temp)) {
+        return -1;
+    }
+
+    outputBuffer memory;
+
+    if(outputOpen(&memory, NULL) == -1) {
+        return -1;
+    }
+
+    printListing(ctx, &memory);
+
+    char * listing = memory.data;
+    size_t listingLength = memory.used;
+
+    if(memory.failed || listingLength > UINT_MAX) {
+        outputClose(&memory);
+        return -1;
+    }
+
+    size_t codeBytes = sizeof(AssemblyCode) * ctx->AssemblyCodeListIndex;
+    cacheHeader header = { {'P', 'M', 'C', '\0'}, CACHE_VERSION, key, ctx->SourceLength,
+        hashSource(listing, listingLength, hashSource((const char *) ctx->AssemblyCodeList, codeBytes, 0)),
+        ctx->AssemblyCodeListIndex, listingLength, ctx->VariableSlots, ctx->SlotsRemoved, ctx->PeepholeRemoved };
+
+    int fd = mkstemp(temp);
+    FILE * fp = fd == -1 ? NULL : fdopen(fd, "wb");
+
+    if(fp == NULL) {
+        if(fd != -1) {
+            close(fd);
+            unlink(temp);
+        }
+        outputClose(&memory);
+        return -1;
+    }
+
+    int failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+
+    if(codeBytes > 0 && fwrite(ctx->AssemblyCodeList, 1, codeBytes, fp) != codeBytes) {
+        failed = 1;
+    }
+
+    if(listingLength > 0 && fwrite(listing, 1, listingLength, fp) != listingLength) {
+        failed = 1;
+    }
+
+    if(ctx->SourceLength > 0 && fwrite(ctx->Source, 1, ctx->SourceLength, fp) != ctx->SourceLength) {
+        failed = 1;
+    }
+
+    outputClose(&memory);
+
+    if(fclose(fp) != 0 || failed || rename(temp, path) != 0) {
+        unlink(temp);
+        return -1;
+    }
+
+    cacheEvict(cacheDir, cacheLimit);
+
+    return 0;
+}
+
+// Remove the least recently used entries until the cache is within its limit
+// A compiler still reading a removed entry keeps its mapping
+void cacheEvict(const char * cacheDir, long long cacheLimit) {
+    DIR * dir = opendir(cacheDir);
+
+    if(dir == NULL) {
+        return;
+    }
+
+    cacheFile * files = NULL;
+    int count = 0;
+    int capacity = 0;
+    long long total = 0;
+    char path[PATH_MAX];
+    struct dirent * item;
+
+    while((item = readdir(dir)) != NULL) {
+        // Only finished entries, not the temporary files of writers
+        if(strlen(item->d_name) != 20 || strcmp(item->d_name + 16, ".pmc") != 0) {
+            continue;
+        }
+
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cacheDir, item->d_name);
+        if(stat(path, &st) == -1) {
+            continue;
+        }
+
+        if(count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            cacheFile * grown = realloc(files, sizeof(cacheFile) * capacity);
+            if(grown == NULL) {
+                break;
+            }
+            files = grown;
+        }
+
+        files[count].used = st.st_mtime;
+        files[count].size = st.st_size;
+        memcpy(files[count].name, item->d_name, 21);
+        total += st.st_size;
+        count++;
+    }
+
+    closedir(dir);
+
+    if(total > cacheLimit) {
+        qsort(files, count, sizeof(cacheFile), compareCacheFiles);
+
+        for(int i = 0; i < count && total > cacheLimit; i++) {
+            snprintf(path, sizeof(path), "%s/%s", cacheDir, files[i].name);
+            // Another compiler may have removed it already, it is gone either way
+            unlink(path);
+            total -= files[i].size;
+        }
+    }
+
+    free(files);
+}
+
+int compareCacheFiles(const void * a, const void * b) {
+    const cacheFile * x = a;
+    const cacheFile * y = b;
+
+    return (x->used > y->used) - (x->used < y->used);
+}
+#endif
+
+// Start an output buffer for fp, or for memory when fp is NULL
+// Returns -1 when the buffer cannot be allocated
+int outputOpen(outputBuffer * out, FILE * fp) {
+    out->fp = fp;
+    out->used = 0;
+    out->capacity = OUTPUT_BUFFER_SIZE;
+    out->failed = 0;
+    out->data = malloc(out->capacity);
+
+    return out->data != NULL ? 0 : -1;
+}
+
+// Write out what is left and free the buffer, memory output must be taken before
+// Returns -1 when any of the output was lost
+int outputClose(outputBuffer * out) {
+    outputFlush(out);
+    free(out->data);
+    out->data = NULL;
+
+    return out->failed ? -1 : 0;
+}
+
+void outputFlush(outputBuffer * out) {
+    if(out->fp != NULL && out->used > 0) {
+        if(fwrite(out->data, 1, out->used, out->fp) != out->used) {
+            out->failed = 1;
+        }
+        out->used = 0;
+    }
+}
+
+// File output is flushed, memory output doubles until length more bytes fit
+// When memory runs out the output is marked failed and starts over, so writers stay in bounds
+void outputMakeRoom(outputBuffer * out, size_t length) {
+    if(out->fp != NULL) {
+        outputFlush(out);
+        return;
+    }
+
+    size_t capacity = out->capacity;
+
+    while(capacity - out->used < length) {
+        capacity *= 2;
+    }
+
+    char * data = realloc(out->data, capacity);
+
+    if(data == NULL) {
+        out->failed = 1;
+        out->used = 0;
+        return;
+    }
+
+    out->data = data;
+    out->capacity = capacity;
+}
+
+// Space for up to length bytes, at most OUTPUT_BUFFER_SIZE; the writer moves used past what it wrote
+static inline char * outputReserve(outputBuffer * out, size_t length) {
+    if(out->capacity - out->used < length) {
+        outputMakeRoom(out, length);
+    }
+
+    return out->data + out->used;
+}
+
+void outputBytes(outputBuffer * out, const char * bytes, size_t length) {
+    // Blocks larger than the buffer go straight to the file
+    if(out->fp != NULL && length > out->capacity) {
+        outputFlush(out);
+        if(fwrite(bytes, 1, length, out->fp) != length) {
+            out->failed = 1;
+        }
+        return;
+    }
+
+    outputReserve(out, length);
+
+    if(out->capacity - out->used >= length) {
+        memcpy(out->data + out->used, bytes, length);
+        out->used += length;
+    }
+}
+
+// value in decimal, padded with spaces to width like printf: before it (%*d) for a positive
+// width and after it (%-*d) for a negative one; at must have room for 11 bytes or the width
+static inline char * putInt(char * at, int value, int width) {
+    char digits[11];
+    char * start = digits + sizeof(digits);
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int) value : (unsigned int) value;
+
+    do {
+        *--start = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while(magnitude > 0);
+
+    if(value < 0) {
+        *--start = '-';
+    }
+
+    return putField(at, start, digits + sizeof(digits) - start, width);
+}
+
+// text padded like putInt()
+static inline char * putField(char * at, const char * text, size_t length, int width) {
+    size_t field = width < 0 ? (size_t) -width : (size_t) width;
+    size_t pad = field > length ? field - length : 0;
+
+    if(width > 0) {
+        memset(at, ' ', pad);
+        at += pad;
+    }
+
+    memcpy(at, text, length);
+    at += length;
+
+    if(width < 0) {
+        memset(at, ' ', pad);
+        at += pad;
+    }
+
+    return at;
+}
+
+// Little-endian 32-bit value for the binary format
+static inline char * putWord(char * at, int value) {
+    unsigned int bits = (unsigned int) value;
+
+    at[0] = (char) bits;
+    at[1] = (char) (bits >> 8);
+    at[2] = (char) (bits >> 16);
+    at[3] = (char) (bits >> 24);
+
+    return at + 4;
+}
+
+// Text format, the tables the compiler has always printed
+void textBegin(outputBuffer * out) {
+    (void) out;
+}
+
+void textLexemes(outputBuffer * out, const char * list) {
+    outputBytes(out, "Lexeme List:\n", 13);
+    outputBytes(out, list, strlen(list));
+    outputBytes(out, "\n\n", 2);
+}
+
+void textCode(outputBuffer * out, const AssemblyCode * code, int count) {
+    static const char header[] = "Assembly Code: \nLINE OP   L    M   \n";
+
+    outputBytes(out, header, sizeof(header) - 1);
+    textCodeRows(out, code, 0, count);
+}
+
+// Rows of the lines from first up to last, the OP column is the mnemonic padded to 4
+void textCodeRows(outputBuffer * out, const AssemblyCode * code, int first, int last) {
+    static const char opField[][4] = { "    ", "LIT ", "OPR ", "LOD ", "STO ", "CAL ", "INC ", "JMP ", "JPC ", "SYS " };
+
+    for(int i = first; i < last; i++) {
+        char * at = outputReserve(out, 64);
+
+        at = putInt(at, i, -4);
+        *at++ = ' ';
+        memcpy(at, opField[code[i].op > 0 && code[i].op <= SYS ? code[i].op : 0], 4);
+        at += 4;
+        *at++ = ' ';
+        at = putInt(at, code[i].l, -4);
+        *at++ = ' ';
+        at = putInt(at, code[i].m, -4);
+        *at++ = '\n';
+
+        out->used = at - out->data;
+    }
+}
+
+void textSymbols(outputBuffer * out, const symbol * table, int count) {
+    static const char header[] = "\nSymbol Table: \nKIND | NAME        | VALUE | LEVEL | ADDRESS | MARK\n"
+        "----------------------------------------------------\n";
+
+    outputBytes(out, header, sizeof(header) - 1);
+
+    for(int i = 0; i < count; i++) {
+        char * at = outputReserve(out, 128);
+
+        at = putInt(at, table[i].kind, 4);
+        at = putField(at, " | ", 3, 0);
+        at = putField(at, table[i].name, strlen(table[i].name), 11);
+        at = putField(at, " | ", 3, 0);
+        at = putInt(at, table[i].val, 5);
+        at = putField(at, " | ", 3, 0);
+        at = putInt(at, table[i].level, 5);
+        at = putField(at, " | ", 3, 0);
+        at = putInt(at, table[i].addr, 7);
+        at = putField(at, " | ", 3, 0);
+        at = putInt(at, table[i].mark, 4);
+        *at++ = '\n';
+
+        out->used = at - out->data;
+    }
+}
+
+// JSON lines format, one object per line: the lexeme list, then an object per instruction
+// and one per symbol
+void jsonLexemes(outputBuffer * out, const char * list) {
+    outputBytes(out, "{\"lexemes\":\"", 12);
+
+    // Only names, numbers and spaces are in the list, but anything else is escaped anyway
+    for(const char * run = list; *list != '\0'; run = list) {
+        while(*list != '\0' && *list != '"' && *list != '\\' && (unsigned char) *list >= 0x20) {
+            list++;
+        }
+
+        outputBytes(out, run, list - run);
+
+        if(*list != '\0') {
+            char * at = outputReserve(out, 8);
+
+            at = putField(at, "\\u00", 4, 0);
+            *at++ = "0123456789abcdef"[(unsigned char) *list >> 4];
+            *at++ = "0123456789abcdef"[*list & 15];
+            out->used = at - out->data;
+            list++;
+        }
+    }
+
+    outputBytes(out, "\"}\n", 3);
+}
+
+void jsonCode(outputBuffer * out, const AssemblyCode * code, int count) {
+    for(int i = 0; i < count; i++) {
+        const char * op = code[i].op > 0 && code[i].op <= SYS ? op_code[code[i].op] : "";
+        char * at = outputReserve(out, 96);
+
+        at = putField(at, "{\"line\":", 8, 0);
+        at = putInt(at, i, 0);
+        at = putField(at, ",\"op\":\"", 7, 0);
+        at = putField(at, op, strlen(op), 0);
+        at = putField(at, "\",\"l\":", 6, 0);
+        at = putInt(at, code[i].l, 0);
+        at = putField(at, ",\"m\":", 5, 0);
+        at = putInt(at, code[i].m, 0);
+        at = putField(at, "}\n", 2, 0);
+
+        out->used = at - out->data;
+    }
+}
+
+void jsonSymbols(outputBuffer * out, const symbol * table, int count) {
+    for(int i = 0; i < count; i++) {
+        char * at = outputReserve(out, 160);
+
+        // Names are letters and digits, nothing to escape
+        at = putField(at, "{\"kind\":", 8, 0);
+        at = putInt(at, table[i].kind, 0);
+        at = putField(at, ",\"name\":\"", 9, 0);
+        at = putField(at, table[i].name, strlen(table[i].name), 0);
+        at = putField(at, "\",\"value\":", 10, 0);
+        at = putInt(at, table[i].val, 0);
+        at = putField(at, ",\"level\":", 9, 0);
+        at = putInt(at, table[i].level, 0);
+        at = putField(at, ",\"address\":", 11, 0);
+        at = putInt(at, table[i].addr, 0);
+        at = putField(at, ",\"mark\":", 8, 0);
+        at = putInt(at, table[i].mark, 0);
+        at = putField(at, "}\n", 2, 0);
+
+        out->used = at - out->data;
+    }
+}
+
+// Binary format: "PML" and a NUL, LISTING_VERSION, then a section per part of the listing, each a
+// tag byte and a count. Numbers are little-endian 32-bit
+// 'L' count bytes of lexeme list
+// 'C' count instructions of an op byte, L and M
+// 'S' count symbols of a kind byte, a name length byte, the name, value, level, address and mark
+void binaryBegin(outputBuffer * out) {
+    char * at = outputReserve(out, 8);
+
+    at = putField(at, "PML", 4, 0);
+    at = putWord(at, LISTING_VERSION);
+    out->used = at - out->data;
+}
+
+void binaryLexemes(outputBuffer * out, const char * list) {
+    size_t length = strlen(list);
+    char * at = outputReserve(out, 5);
+
+    *at++ = 'L';
+    at = putWord(at, (int) length);
+    out->used = at - out->data;
+    outputBytes(out, list, length);
+}
+
+void binaryCode(outputBuffer * out, const AssemblyCode * code, int count) {
+    char * at = outputReserve(out, 5);
+
+    *at++ = 'C';
+    at = putWord(at, count);
+    out->used = at - out->data;
+
+    for(int i = 0; i < count; i++) {
+        at = outputReserve(out, 9);
+        *at++ = (char) code[i].op;
+        at = putWord(at, code[i].l);
+        at = putWord(at, code[i].m);
+        out->used = at - out->data;
+    }
+}
+
+void binarySymbols(outputBuffer * out, const symbol * table, int count) {
+    char * at = outputReserve(out, 5);
+
+    *at++ = 'S';
+    at = putWord(at, count);
+    out->used = at - out->data;
+
+    for(int i = 0; i < count; i++) {
+        size_t length = strlen(table[i].name);
+
+        at = outputReserve(out, 64);
+        *at++ = (char) table[i].kind;
+        *at++ = (char) length;
+        at = putField(at, table[i].name, length, 0);
+        at = putWord(at, table[i].val);
+        at = putWord(at, table[i].level);
+        at = putWord(at, table[i].addr);
+        at = putWord(at, table[i].mark);
+        out->used = at - out->data;
+    }
+}
+
+#ifndef PL0_LIBRARY
+// Write the code as x86-64 GNU assembler source for pl0rt.c to link against
+// The PM/0 stack keeps its exact layout in memory: %r14 is its base, %r12 the bp index and
+// %r13 the sp index. The top of stack is also cached in %eax, so an operation reads its right
+// operand from the register, and every value pushed is stored as well, so locals left over
+// from earlier calls read the same as in the VM. CAL and RTN are native call and ret
+// Each JMP / JPC / CAL target starts a basic block with a label, where nothing is cached
+// Returns -1 if the code is not valid or the file cannot be written
+int writeAssembly(char * file_output, const AssemblyCode * code, int count) {
+    char * isTarget = calloc(count + 1, 1);
+
+    if(isTarget == NULL) {
+        return -1;
+    }
+
+    // Line 0 is the entry point
+    isTarget[0] = 1;
+
+    for(int i = 0; i < count; i++) {
+        if(decodeInstruction(code[i], count, 0) == -1) {
+            fprintf(stderr, "Error: invalid instruction at line %d\n", i);
+            free(isTarget);
+            return -1;
+        }
+
+        if(code[i].op == JMP || code[i].op == JPC || code[i].op == CAL) {
+            isTarget[code[i].m] = 1;
+        }
+    }
+
+    FILE * out = fopen(file_output, "w");
+
+    if(out == NULL) {
+        free(isTarget);
+        return -1;
+    }
+
+    fprintf(out, "# PM/0 code, link with pl0rt.c\n");
+    fprintf(out, "\t.data\n\t.globl %spl0_stack_words\n", ASM_SYMBOL);
+    fprintf(out, "%spl0_stack_words:\n\t.long %d\n", ASM_SYMBOL, VM_STACK_SIZE + count + 3);
+    fprintf(out, "\t.text\n\t.globl %spl0_main\n", ASM_SYMBOL);
+    fprintf(out, "%spl0_main:\n", ASM_SYMBOL);
+    fprintf(out, "\tpushq %%r12\n\tpushq %%r13\n\tpushq %%r14\n\tpushq %%r15\n");
+    fprintf(out, "\tmovq %%rdi, %%r14\n\txorl %%r12d, %%r12d\n\tmovq $-1, %%r13\n");
+    // A return from main, only possible in a bad object file, halts
+    fprintf(out, "\tcall %spm0\n\tjmp %spm%d\n", ASM_LOCAL, ASM_LOCAL, count);
+
+    static const char * setCondition[] = { [EQL] = "e", [NEQ] = "ne", [LSS] = "l", [LEQ] = "le", [GTR] = "g", [GEQ] = "ge" };
+    static const char * jumpUnless[] = { [EQL] = "ne", [NEQ] = "e", [LSS] = "ge", [LEQ] = "g", [GTR] = "le", [GEQ] = "l" };
+    int cached = 0;
+
+    for(int i = 0; i < count; i++) {
+        int l = code[i].l;
+        int m = code[i].m;
+        const char * base;
+
+        if(isTarget[i]) {
+            fprintf(out, "%spm%d:\n", ASM_LOCAL, i);
+            cached = 0;
+        }
+
+        // Operations on the top of stack load it first when it is not cached
+        if(!cached && ((code[i].op == OPR && m != RTN) || code[i].op == STO || (code[i].op == SYS && m == 1))) {
+            fprintf(out, "\tmovl (%%r14,%%r13,4), %%eax\n");
+            cached = 1;
+        }
+
+        switch(code[i].op) {
+            case LIT:
+                fprintf(out, "\tincq %%r13\n\tmovl $%d, %%eax\n\tmovl %%eax, (%%r14,%%r13,4)\n", m);
+                cached = 1;
+                break;
+            case LOD:
+                base = asmBase(out, l);
+                fprintf(out, "\tmovl %lld(%%r14,%s,4), %%eax\n", 4LL * m, base);
+                fprintf(out, "\tincq %%r13\n\tmovl %%eax, (%%r14,%%r13,4)\n");
+                cached = 1;
+                break;
+            case STO:
+                base = asmBase(out, l);
+                fprintf(out, "\tmovl %%eax, %lld(%%r14,%s,4)\n", 4LL * m, base);
+                fprintf(out, "\tdecq %%r13\n");
+                cached = 0;
+                break;
+            case CAL:
+                fprintf(out, "\tcmpq $%d, %%r13\n\tjge %soverflow%d\n", VM_STACK_SIZE - 3, ASM_LOCAL, i);
+                asmBase(out, l);
+                fprintf(out, "\tmovl %s, 4(%%r14,%%r13,4)\n", l == 0 ? "%r12d" : "%edx");
+                fprintf(out, "\tmovl %%r12d, 8(%%r14,%%r13,4)\n\tmovl $%d, 12(%%r14,%%r13,4)\n", i + 1);
+                fprintf(out, "\tleaq 1(%%r13), %%r12\n\tcall %spm%d\n", ASM_LOCAL, m);
+                cached = 0;
+                break;
+            case INC:
+                fprintf(out, "\taddq $%d, %%r13\n\tcmpq $%d, %%r13\n\tjge %soverflow%d\n", m, VM_STACK_SIZE, ASM_LOCAL, i);
+                if(m < 0) {
+                    fprintf(out, "\tcmpq $-1, %%r13\n\tjl %soverflow%d\n", ASM_LOCAL, i);
+                }
+                cached = 0;
+                break;
+            case JMP:
+                fprintf(out, "\tjmp %spm%d\n", ASM_LOCAL, m);
+                cached = 0;
+                break;
+            case JPC:
+                fprintf(out, cached ? "\ttestl %%eax, %%eax\n" : "\tcmpl $0, (%%r14,%%r13,4)\n");
+                fprintf(out, "\tleaq -1(%%r13), %%r13\n\tje %spm%d\n", ASM_LOCAL, m);
+                cached = 0;
+                break;
+            case SYS:
+                if(m == 1) {
+                    fprintf(out, "\tdecq %%r13\n\tmovl %%eax, %%edi\n");
+                    asmCall(out, "pl0_write");
+                    cached = 0;
+                } else if(m == 2) {
+                    fprintf(out, "\tmovl $%d, %%edi\n", i);
+                    asmCall(out, "pl0_read");
+                    fprintf(out, "\tincq %%r13\n\tmovl %%eax, (%%r14,%%r13,4)\n");
+                    cached = 1;
+                } else {
+                    fprintf(out, "\tjmp %spm%d\n", ASM_LOCAL, count);
+                    cached = 0;
+                }
+                break;
+            case OPR:
+                switch(m) {
+                    case RTN:
+                        fprintf(out, "\tleaq -1(%%r12), %%r13\n\tmovslq 8(%%r14,%%r13,4), %%r12\n\tret\n");
+                        cached = 0;
+                        continue;
+                    case ODD:
+                        fprintf(out, "\tandl $1, %%eax\n");
+                        break;
+                    case NEG:
+                        fprintf(out, "\tnegl %%eax\n");
+                        break;
+                    case ADD:
+                        fprintf(out, "\tdecq %%r13\n\taddl (%%r14,%%r13,4), %%eax\n");
+                        break;
+                    case MUL:
+                        fprintf(out, "\tdecq %%r13\n\timull (%%r14,%%r13,4), %%eax\n");
+                        break;
+                    case SUB:
+                        fprintf(out, "\tdecq %%r13\n\tmovl %%eax, %%ecx\n\tmovl (%%r14,%%r13,4), %%eax\n\tsubl %%ecx, %%eax\n");
+                        break;
+                    case DIV:
+                        // Dividing by -1 negates, so the most negative number wraps instead of trapping
+                        fprintf(out, "\ttestl %%eax, %%eax\n\tje %sdivide%d\n", ASM_LOCAL, i);
+                        fprintf(out, "\tdecq %%r13\n\tmovl %%eax, %%ecx\n\tmovl (%%r14,%%r13,4), %%eax\n");
+                        fprintf(out, "\tcmpl $-1, %%ecx\n\tjne 1f\n\tnegl %%eax\n\tjmp 2f\n1:\n\tcltd\n\tidivl %%ecx\n2:\n");
+                        break;
+                    default:
+                        fprintf(out, "\tdecq %%r13\n\tcmpl %%eax, (%%r14,%%r13,4)\n\tset%s %%al\n\tmovzbl %%al, %%eax\n", setCondition[m]);
+
+                        // A comparison the next JPC pops branches on the flags, the result is still stored
+                        if(i + 1 < count && code[i + 1].op == JPC && !isTarget[i + 1]) {
+                            fprintf(out, "\tmovl %%eax, (%%r14,%%r13,4)\n\tleaq -1(%%r13), %%r13\n");
+                            fprintf(out, "\tj%s %spm%d\n", jumpUnless[m], ASM_LOCAL, code[i + 1].m);
+                            cached = 0;
+                            i++;
+                            continue;
+                        }
+                        break;
+                }
+                fprintf(out, "\tmovl %%eax, (%%r14,%%r13,4)\n");
+                cached = 1;
+                break;
+        }
+    }
+
+    // Running off the end halts, errors are out of line so the code above falls through
+    fprintf(out, "%spm%d:\n\tandq $-16, %%rsp\n\tcall %spl0_halt\n", ASM_LOCAL, count, ASM_SYMBOL);
+
+    for(int i = 0; i < count; i++) {
+        if(code[i].op == OPR && code[i].m == DIV) {
+            fprintf(out, "%sdivide%d:\n\tmovl $%d, %%edi\n\tmovl $%d, %%esi\n", ASM_LOCAL, i, PL0_DIVISION_BY_ZERO, i);
+        } else if(code[i].op == CAL || code[i].op == INC) {
+            fprintf(out, "%soverflow%d:\n\tmovl $%d, %%edi\n\tmovl $%d, %%esi\n", ASM_LOCAL, i, PL0_STACK_OVERFLOW, i);
+        } else {
+            continue;
+        }
+        fprintf(out, "\tandq $-16, %%rsp\n\tcall %spl0_fail\n", ASM_SYMBOL);
+    }
+
+#ifndef __APPLE__
+    fprintf(out, "\t.section .note.GNU-stack,\"\",@progbits\n");
+#endif
+
+    free(isTarget);
+
+    if(fclose(out) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Put the base of the activation record L static links down in a register and name it
+// Level 0 is bp itself
+const char * asmBase(FILE * out, int l) {
+    if(l == 0) {
+        return "%r12";
+    }
+
+    fprintf(out, "\tmovq %%r12, %%rdx\n");
+    while(l-- > 0) {
+        fprintf(out, "\tmovslq (%%r14,%%rdx,4), %%rdx\n");
+    }
+
+    return "%rdx";
+}
+
+// Call into the runtime with the stack aligned for the C ABI, %r15 keeps the native stack pointer
+void asmCall(FILE * out, const char * function) {
+    fprintf(out, "\tmovq %%rsp, %%r15\n\tandq $-16, %%rsp\n\tcall %s%s\n\tmovq %%r15, %%rsp\n", ASM_SYMBOL, function);
+}
+
+// Execute PM/0 code on a preallocated stack and report the throughput on stderr
+// The code is decoded once so every operation, OPR and SYS included, has its own handler
+// Activation records are static link, dynamic link, return address, then locals
+// With display set, display[n] is the base of the active record at static level n, kept up to
+// date by CAL and RTN, so non-local LOD / STO take one lookup instead of a static link walk
+int runProgram(const AssemblyCode * code, int count, int display) {
+    vmInstruction * program = malloc(sizeof(vmInstruction) * (count + 1));
+    int stackLimit = VM_STACK_SIZE;
+    int * stack = calloc(stackLimit + count + 3, sizeof(int));
+    // Every call takes at least 3 stack words, INC aside, so this bounds the call depth
+    int callLimit = stackLimit / 3 + 1;
+    int * levels = display ? calloc(callLimit + 1, sizeof(int)) : NULL;
+    // Level and display entry each call replaced, restored by its RTN
+    int * saved = display ? malloc(sizeof(int) * 2 * callLimit) : NULL;
+    int status = 0;
+
+    if(program == NULL || stack == NULL || (display && (levels == NULL || saved == NULL))) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(program);
+        free(stack);
+        free(levels);
+        free(saved);
+        return 1;
+    }
+
+#ifdef VM_THREADED
+    static const void * handlers[] = {
+        [VM_LIT] = &&VM_LIT_HANDLER, [VM_RTN] = &&VM_RTN_HANDLER, [VM_ADD] = &&VM_ADD_HANDLER,
+        [VM_SUB] = &&VM_SUB_HANDLER, [VM_MUL] = &&VM_MUL_HANDLER, [VM_DIV] = &&VM_DIV_HANDLER,
+        [VM_EQL] = &&VM_EQL_HANDLER, [VM_NEQ] = &&VM_NEQ_HANDLER, [VM_LSS] = &&VM_LSS_HANDLER,
+        [VM_LEQ] = &&VM_LEQ_HANDLER, [VM_GTR] = &&VM_GTR_HANDLER, [VM_GEQ] = &&VM_GEQ_HANDLER,
+        [VM_ODD] = &&VM_ODD_HANDLER, [VM_NEG] = &&VM_NEG_HANDLER, [VM_LOD] = &&VM_LOD_HANDLER,
+        [VM_STO] = &&VM_STO_HANDLER, [VM_CAL] = &&VM_CAL_HANDLER, [VM_INC] = &&VM_INC_HANDLER,
+        [VM_JMP] = &&VM_JMP_HANDLER, [VM_JPC] = &&VM_JPC_HANDLER, [VM_WRITE] = &&VM_WRITE_HANDLER,
+        [VM_READ] = &&VM_READ_HANDLER, [VM_HALT] = &&VM_HALT_HANDLER,
+        [VM_LOD_DISPLAY] = &&VM_LOD_DISPLAY_HANDLER, [VM_STO_DISPLAY] = &&VM_STO_DISPLAY_HANDLER,
+        [VM_CAL_DISPLAY] = &&VM_CAL_DISPLAY_HANDLER, [VM_RTN_DISPLAY] = &&VM_RTN_DISPLAY_HANDLER
+    };
+#endif
+
+    // Decode, checking every operand; addresses, links, pops and return addresses are checked as
+    // they are used, so a bad object file cannot run off the code or the stack
+    for(int i = 0; i <= count; i++) {
+        program[i].op = i == count ? VM_HALT : decodeInstruction(code[i], count, display);
+        program[i].l = i == count ? 0 : code[i].l;
+        program[i].m = i == count ? 0 : code[i].m;
+
+        if(program[i].op == -1) {
+            fprintf(stderr, "Error: invalid instruction at line %d\n", i);
+            free(program);
+            free(stack);
+            free(levels);
+            free(saved);
+            return 1;
+        }
+
+#ifdef VM_THREADED
+        program[i].handler = handlers[program[i].op];
+#endif
+    }
+
+    int pc = 0;
+    int bp = 0;
+    int sp = -1;
+    int level = 0;
+    int depth = 0;
+    int address;
+    long long executed = 0;
+    const vmInstruction * ip;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+// Binary operations pop the right operand into the left one, both must be above the frame's base
+#define VM_BINARY(expr) { if(sp <= bp) goto fault; int right = stack[sp--]; int left = stack[sp]; stack[sp] = (expr); }
+// Operands are never below bp; a frame's variables, and every base, are below stackLimit
+#define VM_POP_CHECK() if(sp < bp) goto fault
+// M is never negative after decode and no base is negative, so one unsigned compare bounds both
+#define VM_ADDRESS(base) { address = (int) ((unsigned int) (base) + (unsigned int) ip->m); if((unsigned int) address >= (unsigned int) stackLimit) goto fault; }
+// A straight run of code pushes at most count words, so checking sp at every jump keeps
+// pushes inside the count words of headroom above stackLimit
+#define VM_JUMP_CHECK() if(sp >= stackLimit) goto overflow
+
+#ifdef VM_THREADED
+#define VM_CASE(op) op##_HANDLER:
+#define VM_NEXT() { ip = &program[pc++]; executed++; goto *ip->handler; }
+    VM_NEXT();
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT() continue
+    for(;;) {
+        ip = &program[pc++];
+        executed++;
+
+        switch(ip->op) {
+#endif
+
+    VM_CASE(VM_LIT) stack[++sp] = ip->m; VM_NEXT();
+    VM_CASE(VM_RTN)
+        sp = bp - 1;
+        bp = stack[sp + 2];
+        pc = stack[sp + 3];
+        if(bp < 0 || bp >= stackLimit || pc < 0 || pc > count) {
+            goto badReturn;
+        }
+        VM_NEXT();
+    VM_CASE(VM_ADD) VM_BINARY((int) ((unsigned int) left + (unsigned int) right)); VM_NEXT();
+    VM_CASE(VM_SUB) VM_BINARY((int) ((unsigned int) left - (unsigned int) right)); VM_NEXT();
+    VM_CASE(VM_MUL) VM_BINARY((int) ((unsigned int) left * (unsigned int) right)); VM_NEXT();
+    VM_CASE(VM_DIV)
+        if(sp <= bp) {
+            goto fault;
+        }
+        if(stack[sp] == 0) {
+            fprintf(stderr, "Error: division by zero at line %d\n", (int) (ip - program));
+            status = 1;
+            goto halt;
+        }
+        VM_BINARY(right == -1 ? (int) (0u - (unsigned int) left) : left / right);
+        VM_NEXT();
+    VM_CASE(VM_EQL) VM_BINARY(left == right); VM_NEXT();
+    VM_CASE(VM_NEQ) VM_BINARY(left != right); VM_NEXT();
+    VM_CASE(VM_LSS) VM_BINARY(left < right); VM_NEXT();
+    VM_CASE(VM_LEQ) VM_BINARY(left <= right); VM_NEXT();
+    VM_CASE(VM_GTR) VM_BINARY(left > right); VM_NEXT();
+    VM_CASE(VM_GEQ) VM_BINARY(left >= right); VM_NEXT();
+    VM_CASE(VM_ODD) VM_POP_CHECK(); stack[sp] = stack[sp] % 2 != 0; VM_NEXT();
+    VM_CASE(VM_NEG) VM_POP_CHECK(); stack[sp] = (int) (0u - (unsigned int) stack[sp]); VM_NEXT();
+    VM_CASE(VM_LOD) VM_ADDRESS(vmBase(stack, bp, ip->l, stackLimit)); stack[sp + 1] = stack[address]; sp++; VM_NEXT();
+    VM_CASE(VM_STO) VM_POP_CHECK(); VM_ADDRESS(vmBase(stack, bp, ip->l, stackLimit)); stack[address] = stack[sp]; sp--; VM_NEXT();
+    VM_CASE(VM_CAL)
+        if(sp + 3 >= stackLimit) {
+            goto overflow;
+        }
+        stack[sp + 1] = vmBase(stack, bp, ip->l, stackLimit);
+        if(stack[sp + 1] == stackLimit) {
+            goto fault;
+        }
+        stack[sp + 2] = bp;
+        stack[sp + 3] = pc;
+        bp = sp + 1;
+        pc = ip->m;
+        VM_NEXT();
+    VM_CASE(VM_INC)
+        if(sp + ip->m >= stackLimit || sp + ip->m < -1) {
+            goto overflow;
+        }
+        sp += ip->m;
+        VM_NEXT();
+    VM_CASE(VM_JMP) VM_JUMP_CHECK(); pc = ip->m; VM_NEXT();
+    VM_CASE(VM_JPC) VM_POP_CHECK(); VM_JUMP_CHECK(); if(stack[sp--] == 0) { pc = ip->m; } VM_NEXT();
+    VM_CASE(VM_WRITE) VM_POP_CHECK(); vmWriteInt(stack[sp--]); VM_NEXT();
+    VM_CASE(VM_READ)
+        if(vmReadInt(&stack[sp + 1]) == -1) {
+            fprintf(stderr, "Error: expected an integer on input at line %d\n", (int) (ip - program));
+            status = 1;
+            goto halt;
+        }
+        sp++;
+        VM_NEXT();
+    VM_CASE(VM_HALT) goto halt;
+    // A level difference past main, only possible in a bad object file, ends at main like vmBase
+    VM_CASE(VM_LOD_DISPLAY) VM_ADDRESS(levels[ip->l > level ? 0 : level - ip->l]); stack[sp + 1] = stack[address]; sp++; VM_NEXT();
+    VM_CASE(VM_STO_DISPLAY) VM_POP_CHECK(); VM_ADDRESS(levels[ip->l > level ? 0 : level - ip->l]); stack[address] = stack[sp]; sp--; VM_NEXT();
+    VM_CASE(VM_CAL_DISPLAY)
+        if(sp + 3 >= stackLimit || depth == callLimit) {
+            goto overflow;
+        }
+        {
+            int parent = ip->l > level ? 0 : level - ip->l;
+
+            stack[sp + 1] = levels[parent];
+            stack[sp + 2] = bp;
+            stack[sp + 3] = pc;
+            bp = sp + 1;
+            pc = ip->m;
+
+            saved[2 * depth] = level;
+            saved[2 * depth + 1] = levels[parent + 1];
+            depth++;
+            level = parent + 1;
+            levels[level] = bp;
+        }
+        VM_NEXT();
+    VM_CASE(VM_RTN_DISPLAY)
+        if(depth > 0) {
+            depth--;
+            levels[level] = saved[2 * depth + 1];
+            level = saved[2 * depth];
+        }
+        sp = bp - 1;
+        bp = stack[sp + 2];
+        pc = stack[sp + 3];
+        if(bp < 0 || bp >= stackLimit || pc < 0 || pc > count) {
+            goto badReturn;
+        }
+        VM_NEXT();
+
+#ifndef VM_THREADED
+        }
+    }
+#endif
+
+overflow:
+    fprintf(stderr, "Error: stack overflow at line %d\n", (int) (ip - program));
+    status = 1;
+    goto halt;
+
+fault:
+    fprintf(stderr, "Error: stack access out of bounds at line %d\n", (int) (ip - program));
+    status = 1;
+    goto halt;
+
+badReturn:
+    fprintf(stderr, "Error: invalid return address at line %d\n", (int) (ip - program));
+    status = 1;
+
+halt:
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    vmFlush();
+
+#undef VM_BINARY
+#undef VM_POP_CHECK
+#undef VM_ADDRESS
+#undef VM_JUMP_CHECK
+#undef VM_CASE
+#undef VM_NEXT
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%lld instructions in %.6f s (%.0f instructions/sec)\n", executed, seconds, seconds > 0 ? executed / seconds : 0.0);
+
+    free(program);
+    free(stack);
+    free(levels);
+    free(saved);
+
+    return status;
+}
+
+// Base of the activation record L static links down, stackLimit if a link leaves the stack
+static inline int vmBase(const int * stack, int bp, int l, int stackLimit) {
+    for(; l > 0; l--) {
+        bp = stack[bp];
+        if((unsigned int) bp >= (unsigned int) stackLimit) {
+            return stackLimit;
+        }
+    }
+
+    return bp;
+}
+
+// Map an instruction to its VM operation, -1 if it is not valid
+// Jumps and calls may only target lines 0 to count, line count halts
+// With display set, calls, returns and non-local LOD / STO get the display versions
+int decodeInstruction(AssemblyCode instruction, int count, int display) {
+    static const int oprOps[] = {
+        VM_RTN, VM_ADD, VM_SUB, VM_MUL, VM_DIV, VM_EQL, VM_NEQ, VM_LSS, VM_LEQ, VM_GTR, VM_GEQ, VM_ODD, VM_NEG
+    };
+
+    if(instruction.l < 0) {
+        return -1;
+    }
+
+    if(display) {
+        switch(instruction.op) {
+            case OPR: if(instruction.m == RTN) return VM_RTN_DISPLAY; break;
+            case LOD: if(instruction.l > 0 && instruction.m >= 0) return VM_LOD_DISPLAY; break;
+            case STO: if(instruction.l > 0 && instruction.m >= 0) return VM_STO_DISPLAY; break;
+            case CAL: if(instruction.m >= 0 && instruction.m <= count) return VM_CAL_DISPLAY; break;
+        }
+    }
+
+    switch(instruction.op) {
+        case LIT: return VM_LIT;
+        case OPR: return instruction.m >= 0 && instruction.m <= NEG ? oprOps[instruction.m] : -1;
+        case LOD: return instruction.m >= 0 ? VM_LOD : -1;
+        case STO: return instruction.m >= 0 ? VM_STO : -1;
+        case CAL: return instruction.m >= 0 && instruction.m <= count ? VM_CAL : -1;
+        case INC: return VM_INC;
+        case JMP: return instruction.m >= 0 && instruction.m <= count ? VM_JMP : -1;
+        case JPC: return instruction.m >= 0 && instruction.m <= count ? VM_JPC : -1;
+        case SYS:
+            switch(instruction.m) {
+                case 1: return VM_WRITE;
+                case 2: return VM_READ;
+                case 3: return VM_HALT;
+            }
+            return -1;
+    }
+
+    return -1;
+}
+
+// Read the next integer from the buffered input, refilling it with one read() at a time
+// Returns -1 at the end of the input or on anything that is not an integer
+int vmReadInt(int * number) {
+    int sign = 1;
+    int digits = 0;
+    unsigned int result = 0;
+
+    for(;;) {
+        if(VmInputIndex == VmInputLength) {
+            // Prompt output has to be visible before blocking on input
+            vmFlush();
+
+            ssize_t n = read(0, VmInput, VM_BUFFER_SIZE);
+            if(n <= 0) {
+                break;
+            }
+
+            VmInputIndex = 0;
+            VmInputLength = n;
+        }
+
+        char c = VmInput[VmInputIndex];
+
+        if(CharClass[(unsigned char) c] == CC_DIGIT) {
+            result = result * 10 + (c - '0');
+            digits++;
+        } else if(digits > 0) {
+            break;
+        } else if(c == '-' && sign == 1) {
+            sign = -1;
+        } else if(CharClass[(unsigned char) c] != CC_SPACE || sign == -1) {
+            return -1;
+        }
+
+        VmInputIndex++;
+    }
+
+    if(digits == 0) {
+        return -1;
+    }
+
+    *number = (int) (sign == 1 ? result : 0u - result);
+
+    return 0;
+}
+
+// Format an integer straight into the output buffer, one per line
+void vmWriteInt(int number) {
+    char digits[12];
+    int length = 0;
+    unsigned int magnitude = number < 0 ? 0u - (unsigned int) number : (unsigned int) number;
+
+    if(VmOutputIndex + 13 > VM_BUFFER_SIZE) {
+        vmFlush();
+    }
+
+    do {
+        digits[length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while(magnitude > 0);
+
+    if(number < 0) {
+        VmOutput[VmOutputIndex++] = '-';
+    }
+
+    while(length > 0) {
+        VmOutput[VmOutputIndex++] = digits[--length];
+    }
+
+    VmOutput[VmOutputIndex++] = '\n';
+}
+
+void vmFlush() {
+    fflush(stdout);
+
+    for(int written = 0; written < VmOutputIndex; ) {
+        ssize_t n = write(1, VmOutput + written, VmOutputIndex - written);
+        if(n <= 0) {
+            break;
+        }
+        written += n;
+    }
+
+    VmOutputIndex = 0;
+}
+#endif
+
+double stopwatch() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+#if defined(STATS) && !defined(PL0_LIBRARY)
+// Peak resident set size, ru_maxrss is in bytes on macOS and kilobytes elsewhere
+long peakMemoryKB() {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+void printStats(compileContext * ctx, FILE * out) {
+    fprintf(out, "Statistics:\n");
+    fprintf(out, "  lex       %10.6f s  %lld bytes\n", ctx->Stats.lexSeconds, ctx->Stats.bytesRead);
+    fprintf(out, "  parse     %10.6f s\n", ctx->Stats.parseSeconds);
+    fprintf(out, "  optimize  %10.6f s\n", ctx->Stats.optimizeSeconds);
+    fprintf(out, "  output    %10.6f s\n", ctx->Stats.outputSeconds);
+    fprintf(out, "  tokens    %10d\n", ctx->tokenIndex);
+    for(int i = 1; i <= elsesym; i++) {
+        if(ctx->Stats.tokens[i] > 0) {
+            fprintf(out, "    %-12s %10lld\n", token_name[i], ctx->Stats.tokens[i]);
+        }
+    }
+    fprintf(out, "  symbol table checks %lld, compares %lld\n", ctx->Stats.symbolChecks, ctx->Stats.symbolCompares);
+    fprintf(out, "  instructions emitted\n");
+    for(int i = 1; i <= SYS; i++) {
+        if(ctx->Stats.emitted[i] > 0) {
+            fprintf(out, "    %-4s %10lld\n", op_code[i], ctx->Stats.emitted[i]);
+        }
+    }
+    fprintf(out, "  statements %lld, declarations %lld, backpatches %lld\n", ctx->Stats.statements, ctx->Stats.declarations, ctx->Stats.backpatches);
+    fprintf(out, "  peak memory %ld KB\n", peakMemoryKB());
+}
+
+int writeStatsJson(compileContext * ctx, char * file_output) {
+    FILE * fp = fopen(file_output, "w");
+
+    if(fp == NULL) {
+        return -1;
+    }
+
+    fprintf(fp, "{\n  \"seconds\": {\"lex\": %.9f, \"parse\": %.9f, \"optimize\": %.9f, \"output\": %.9f},\n",
+        ctx->Stats.lexSeconds, ctx->Stats.parseSeconds, ctx->Stats.optimizeSeconds, ctx->Stats.outputSeconds);
+    fprintf(fp, "  \"bytes_read\": %lld,\n  \"token_count\": %d,\n", ctx->Stats.bytesRead, ctx->tokenIndex);
+    fprintf(fp, "  \"tokens\": {");
+    for(int i = 1; i <= elsesym; i++) {
+        fprintf(fp, "%s\"%s\": %lld", i > 1 ? ", " : "", token_name[i], ctx->Stats.tokens[i]);
+    }
+    fprintf(fp, "},\n");
+    fprintf(fp, "  \"symbol_table_checks\": %lld,\n  \"symbol_table_compares\": %lld,\n", ctx->Stats.symbolChecks, ctx->Stats.symbolCompares);
+    fprintf(fp, "  \"instructions\": {");
+    for(int i = 1; i <= SYS; i++) {
+        fprintf(fp, "%s\"%s\": %lld", i > 1 ? ", " : "", op_code[i], ctx->Stats.emitted[i]);
+    }
+    fprintf(fp, "},\n");
+    fprintf(fp, "  \"instruction_count\": %d,\n  \"statements\": %lld,\n  \"declarations\": %lld,\n",
+        ctx->AssemblyCodeListIndex + ctx->PeepholeRemoved, ctx->Stats.statements, ctx->Stats.declarations);
+    fprintf(fp, "  \"backpatches\": %lld,\n  \"peak_memory_kb\": %ld\n}\n", ctx->Stats.backpatches, peakMemoryKB());
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+#endif
+
+// Bump allocate from the newest arena chunk, adding a chunk at least
+// twice the size of the last one when it is full
+void * arenaAlloc(compileContext * ctx, size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+
+    if(ctx->Arena == NULL || ctx->Arena->size - ctx->Arena->used < size) {
+        size_t chunkSize = ctx->Arena == NULL ? ARENA_CHUNK_SIZE : ctx->Arena->size * 2;
+
+        if(chunkSize < size) {
+            chunkSize = size;
+        }
+
+        arenaChunk * chunk = malloc(sizeof(arenaChunk) + chunkSize);
+        if(chunk == NULL) {
+            fail(ctx, "Error: out of memory\n");
+        }
+
+        chunk->next = ctx->Arena;
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        ctx->Arena = chunk;
+    }
+
+    void * memory = (char *) (ctx->Arena + 1) + ctx->Arena->used;
+    ctx->Arena->used += size;
+
+    return memory;
+}
+
+// Copy a table into a new arena block with room for capacity entries
+// The old block stays in the arena until it is released
+void * arenaGrow(compileContext * ctx, void * table, int count, size_t elementSize, int capacity) {
+    void * grown = arenaAlloc(ctx, elementSize * capacity);
+
+    if(count > 0) {
+        memcpy(grown, table, elementSize * count);
+    }
+
+    return grown;
+}
+
+void arenaRelease(compileContext * ctx) {
+    while(ctx->Arena != NULL) {
+        arenaChunk * next = ctx->Arena->next;
+        free(ctx->Arena);
+        ctx->Arena = next;
+    }
+}
+
+// Empty the arena for the next compile of a reused context
+// Its chunks become one chunk as large as all of them, so a compile that needs no more
+// memory than the last one allocates nothing
+void arenaReset(compileContext * ctx) {
+    if(ctx->Arena != NULL && ctx->Arena->next != NULL) {
+        size_t total = 0;
+
+        for(arenaChunk * chunk = ctx->Arena; chunk != NULL; chunk = chunk->next) {
+            total += chunk->size;
+        }
+
+        arenaRelease(ctx);
+
+        // Without the memory for one chunk the arena starts over from the smallest one
+        ctx->Arena = malloc(sizeof(arenaChunk) + total);
+        if(ctx->Arena != NULL) {
+            ctx->Arena->next = NULL;
+            ctx->Arena->size = total;
+        }
+    }
+
+    if(ctx->Arena != NULL) {
+        ctx->Arena->used = 0;
+    }
+}
+
+// Scratch block of the -O passes, taken and given back in stack order
+// A block that does not fit the top chunk goes in the next one, or a new one at least twice as large;
+// chunks stay for later passes and compiles. NULL when memory runs out, the passes then skip their work
+void * scratchAlloc(compileContext * ctx, size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+
+    arenaChunk * top = ctx->ScratchTop;
+
+    while(top != NULL && top->size - top->used < size) {
+        if(top->next == NULL) {
+            size_t chunkSize = top->size * 2 > size ? top->size * 2 : size;
+            arenaChunk * chunk = malloc(sizeof(arenaChunk) + chunkSize);
+
+            if(chunk == NULL) {
+                return NULL;
+            }
+
+            chunk->next = NULL;
+            chunk->size = chunkSize;
+            chunk->used = 0;
+            top->next = chunk;
+        }
+
+        top = top->next;
+    }
+
+    if(top == NULL) {
+        size_t chunkSize = ARENA_CHUNK_SIZE > size ? ARENA_CHUNK_SIZE : size;
+
+        top = malloc(sizeof(arenaChunk) + chunkSize);
+
+        if(top == NULL) {
+            return NULL;
+        }
+
+        top->next = NULL;
+        top->size = chunkSize;
+        top->used = 0;
+        ctx->Scratch = top;
+    }
+
+    ctx->ScratchTop = top;
+
+    void * memory = (char *) (top + 1) + top->used;
+    top->used += size;
+
+    return memory;
+}
+
+scratchMark scratchSave(compileContext * ctx) {
+    scratchMark mark = { ctx->ScratchTop, ctx->ScratchTop != NULL ? ctx->ScratchTop->used : 0 };
+
+    return mark;
+}
+
+// Give back every scratch block taken since the mark
+void scratchRelease(compileContext * ctx, scratchMark mark) {
+    arenaChunk * chunk = mark.chunk != NULL ? mark.chunk : ctx->Scratch;
+
+    if(chunk == NULL) {
+        return;
+    }
+
+    chunk->used = mark.used;
+
+    for(chunk = chunk->next; chunk != NULL; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+
+    ctx->ScratchTop = mark.chunk != NULL ? mark.chunk : ctx->Scratch;
+}
+
+void growNames(compileContext * ctx) {
+    int capacity = ctx->NameListCapacity == 0 ? TABLE_START_SIZE : ctx->NameListCapacity * 2;
+
+    ctx->NameList = arenaGrow(ctx, ctx->NameList, ctx->NameListIndex, sizeof(ctx->NameList[0]), capacity);
+    ctx->NameListCapacity = capacity;
+}
+
+// Double the name index and insert every name again
+void growNameHash(compileContext * ctx) {
+    ctx->NameHashSize = ctx->NameHashSize == 0 ? TABLE_START_SIZE * 2 : ctx->NameHashSize * 2;
+    ctx->NameHash = arenaAlloc(ctx, sizeof(ctx->NameHash[0]) * ctx->NameHashSize);
+    memset(ctx->NameHash, 0, sizeof(ctx->NameHash[0]) * ctx->NameHashSize);
+
+    for(int i = 0; i < ctx->NameListIndex; i++) {
+        ctx->NameHash[findNameSlot(ctx, ctx->NameList[i], strlen(ctx->NameList[i]))] = i + 1;
+    }
+}
+
+void growSymbols(compileContext * ctx) {
+    int capacity = ctx->SymbolTableCapacity == 0 ? TABLE_START_SIZE : ctx->SymbolTableCapacity * 2;
+
+    ctx->SymbolTable = arenaGrow(ctx, ctx->SymbolTable, ctx->SymbolTableIndex, sizeof(ctx->SymbolTable[0]), capacity);
+    ctx->SymbolTableCapacity = capacity;
+}
+
+// Double the symbol index and insert every claimed slot again
+void growSymbolHash(compileContext * ctx) {
+    symbolSlot * old = ctx->SymbolHash;
+    int oldSize = ctx->SymbolHashSize;
+
+    ctx->SymbolHashSize = ctx->SymbolHashSize == 0 ? TABLE_START_SIZE * 2 : ctx->SymbolHashSize * 2;
+    ctx->SymbolHash = arenaAlloc(ctx, sizeof(ctx->SymbolHash[0]) * ctx->SymbolHashSize);
+    memset(ctx->SymbolHash, 0, sizeof(ctx->SymbolHash[0]) * ctx->SymbolHashSize);
+
+    for(int i = 0; i < oldSize; i++) {
+        if(old[i].key != 0) {
+            ctx->SymbolHash[findSymbolSlot(ctx, old[i].key - 1)] = old[i];
+        }
+    }
+}
+
+// Pick the widest scanning kernels the CPU supports, once per process
+void selectScanKernels() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2")) {
+        Scan = &ScanAvx2;
+    } else if(__builtin_cpu_supports("sse2")) {
+        Scan = &ScanSse2;
+    }
+#endif
+}
+
+// First byte at or after i that is not whitespace, or length
+size_t skipSpaceScalar(const char * src, size_t i, size_t length) {
+    while(i < length && CharClass[(unsigned char) src[i]] == CC_SPACE) {
+        i++;
+    }
+
+    return i;
+}
+
+// Index of the "*" of the first "*/" at or after i, or length
+size_t findCommentEndScalar(const char * src, size_t i, size_t length) {
+    for(; i + 1 < length; i++) {
+        if(src[i] == '*' && src[i + 1] == '/') {
+            return i;
+        }
+    }
+
+    return length;
+}
+
+// First byte at or after i that ends a word (whitespace or a symbol), or length
+// The classes of the bytes passed over are added to classes
+size_t scanWordScalar(const char * src, size_t i, size_t length, int * classes) {
+    int found = *classes;
+
+    for(; i < length; i++) {
+        int charClass = CharClass[(unsigned char) src[i]];
+
+        if(charClass & (CC_SPACE | CC_SYMBOL)) {
+            break;
+        }
+        found |= charClass;
+    }
+
+    *classes = found;
+
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Bytes from lo to hi, both at most 127; bytes of 128 and up compare as negative and are never in range
+#define SSE2_RANGE(v, lo, hi) _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((lo) - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8((hi) + 1)))
+#define AVX2_RANGE(v, lo, hi) _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((lo) - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), v))
+
+// The SIMD kernels test whole blocks while one fits before length and leave the tail to the scalar ones
+size_t skipSpaceSse2(const char * src, size_t i, size_t length) {
+    for(; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) &src[i]);
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')), SSE2_RANGE(bytes, '\t', '\r'));
+        unsigned int other = ~_mm_movemask_epi8(space) & 0xFFFFu;
+
+        if(other != 0) {
+            return i + __builtin_ctz(other);
+        }
+    }
+
+    return skipSpaceScalar(src, i, length);
+}
+
+size_t findCommentEndSse2(const char * src, size_t i, size_t length) {
+    for(; i + 17 <= length; i += 16) {
+        __m128i star = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &src[i]), _mm_set1_epi8('*'));
+        __m128i slash = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) &src[i + 1]), _mm_set1_epi8('/'));
+        unsigned int found = _mm_movemask_epi8(_mm_and_si128(star, slash));
+
+        if(found != 0) {
+            return i + __builtin_ctz(found);
+        }
+    }
+
+    return findCommentEndScalar(src, i, length);
+}
+
+size_t scanWordSse2(const char * src, size_t i, size_t length, int * classes) {
+    for(; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) &src[i]);
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')), SSE2_RANGE(bytes, '\t', '\r'));
+        __m128i symbol = _mm_or_si128(_mm_or_si128(SSE2_RANGE(bytes, '!', '/'), SSE2_RANGE(bytes, ':', '@')),
+            _mm_or_si128(SSE2_RANGE(bytes, '[', '`'), SSE2_RANGE(bytes, '{', '~')));
+        unsigned int end = _mm_movemask_epi8(_mm_or_si128(space, symbol));
+        unsigned int letter = _mm_movemask_epi8(SSE2_RANGE(bytes, 'a', 'z'));
+        unsigned int digit = _mm_movemask_epi8(SSE2_RANGE(bytes, '0', '9'));
+        // Bytes before the first one that ends the word
+        unsigned int word = end != 0 ? (end & -end) - 1 : 0xFFFFu;
+
+        *classes |= (letter & word ? CC_LETTER : 0) | (digit & word ? CC_DIGIT : 0) | (~(letter | digit) & word ? CC_OTHER : 0);
+
+        if(end != 0) {
+            return i + __builtin_ctz(end);
+        }
+    }
+
+    return scanWordScalar(src, i, length, classes);
+}
+
+__attribute__((target("avx2")))
+size_t skipSpaceAvx2(const char * src, size_t i, size_t length) {
+    for(; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) &src[i]);
+        __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')), AVX2_RANGE(bytes, '\t', '\r'));
+        unsigned int other = ~(unsigned int) _mm256_movemask_epi8(space);
+
+        if(other != 0) {
+            return i + __builtin_ctz(other);
+        }
+    }
+
+    return skipSpaceSse2(src, i, length);
+}
+
+__attribute__((target("avx2")))
+size_t findCommentEndAvx2(const char * src, size_t i, size_t length) {
+    for(; i + 33 <= length; i += 32) {
+        __m256i star = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &src[i]), _mm256_set1_epi8('*'));
+        __m256i slash = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) &src[i + 1]), _mm256_set1_epi8('/'));
+        unsigned int found = (unsigned int) _mm256_movemask_epi8(_mm256_and_si256(star, slash));
+
+        if(found != 0) {
+            return i + __builtin_ctz(found);
+        }
+    }
+
+    return findCommentEndSse2(src, i, length);
+}
+#endif
+
+// Lex the whole source on several threads before parsing, in slices split at whitespace
+// Every slice is lexed as if it started outside a comment and, up to its sync point, as if it
+// started inside one; the lexer state at the end of each slice then picks the right tokens for
+// the next. Names are interned in source order afterwards, so the tokens and name IDs are the
+// same as a serial lex. Returns -1 without touching the context when the source is too small
+// to split; fail()s when memory runs out
+int lexParallel(compileContext * ctx, int threads) {
+    const char * src = ctx->Source;
+    size_t length = ctx->SourceLength;
+
+    if(threads > (int) (length / LEX_CHUNK_MIN)) {
+        threads = (int) (length / LEX_CHUNK_MIN);
+    }
+
+    if(threads < 2) {
+        return -1;
+    }
+
+    lexChunk * chunks = calloc(threads, sizeof(lexChunk));
+
+    if(chunks == NULL) {
+        return -1;
+    }
+
+    // Each slice ends just after a whitespace byte, so no token crosses into the next one
+    int count = 0;
+    size_t start = 0;
+
+    while(start < length && count < threads) {
+        size_t end = start + (length - start) / (threads - count);
+
+        while(end < length && CharClass[(unsigned char) src[end - 1]] != CC_SPACE) {
+            end++;
+        }
+
+        chunks[count].parent = ctx;
+        chunks[count].start = start;
+        chunks[count].end = end;
+        count++;
+        start = end;
+    }
+
+    if(count < 2) {
+        free(chunks);
+        return -1;
+    }
+
+    runLexChunks(chunks, count, lexChunkMain);
+
+    // Pick each slice's tokens by the state the one before it ended in
+    lexStates state = LEX_START;
+    size_t total = 0;
+    int failed = 0;
+
+    for(int i = 0; i < count; i++) {
+        lexPiece * pieces[2];
+        int pieceCount;
+
+        failed |= chunks[i].failed;
+        if(failed) {
+            continue;
+        }
+
+        chunks[i].useInside = state == LEX_COMMENT;
+        chunks[i].first = total;
+        pieceCount = lexChunkPieces(&chunks[i], pieces);
+
+        for(int j = 0; j < pieceCount; j++) {
+            total += pieces[j]->count;
+            state = pieces[j]->state;
+        }
+    }
+
+    if(failed) {
+        for(int i = 0; i < count; i++) {
+            releasePiece(&chunks[i].outside);
+            releasePiece(&chunks[i].inside);
+            releasePiece(&chunks[i].rest);
+            releasePiece(&chunks[i].insideRest);
+        }
+        free(chunks);
+        fail(ctx, "Error: out of memory\n");
+    }
+
+    // A piece's names are in the order they first appear in it, and the pieces are in source
+    // order, so interning them piece by piece gives every name the ID a serial lex would
+    for(int i = 0; i < count; i++) {
+        lexPiece * pieces[2];
+        int pieceCount = lexChunkPieces(&chunks[i], pieces);
+
+        for(int j = 0; j < pieceCount; j++) {
+            compileContext * piece = pieces[j]->ctx;
+
+            if(piece == NULL) {
+                continue;
+            }
+
+#ifdef STATS
+            for(int k = 0; k <= elsesym; k++) {
+                ctx->Stats.tokens[k] += piece->Stats.tokens[k];
+            }
+            ctx->Stats.bytesRead += piece->Stats.bytesRead;
+#endif
+
+            if(piece->NameListIndex > 0) {
+                pieces[j]->map = arenaAlloc(ctx, sizeof(int) * piece->NameListIndex);
+            }
+            for(int k = 0; k < piece->NameListIndex; k++) {
+                pieces[j]->map[k] = internName(ctx, piece->NameList[k], strlen(piece->NameList[k]));
+            }
+        }
+    }
+
+    ctx->LexedKind = arenaAlloc(ctx, total + 1);
+    ctx->LexedPayload = arenaAlloc(ctx, sizeof(int) * (total + 1));
+    ctx->LexedOffset = arenaAlloc(ctx, sizeof(unsigned int) * (total + 1));
+    ctx->LexedCount = total;
+    ctx->LexedNext = 0;
+    ctx->tokenIndex += (int) total;
+
+    runLexChunks(chunks, count, copyChunkMain);
+    free(chunks);
+
+    ctx->LexPosition = length;
+
+    return 0;
+}
+
+// Run work on every chunk, the first on this thread and the others on threads of their own
+// A chunk whose thread fails to start runs here after the first
+void runLexChunks(lexChunk * chunks, int count, void * (* work)(void *)) {
+    int * started = calloc(count, sizeof(int));
+
+    for(int i = 1; started != NULL && i < count; i++) {
+        started[i] = pthread_create(&chunks[i].thread, NULL, work, &chunks[i]) == 0;
+    }
+
+    work(&chunks[0]);
+
+    for(int i = 1; i < count; i++) {
+        if(started != NULL && started[i]) {
+            pthread_join(chunks[i].thread, NULL);
+        } else {
+            work(&chunks[i]);
+        }
+    }
+
+    free(started);
+}
+
+// Lex one slice: both guesses up to the sync point, then the rest once, or twice if they disagree
+// The first slice starts the source, so it is never inside a comment
+void * lexChunkMain(void * arg) {
+    lexChunk * chunk = arg;
+    compileContext * parent = chunk->parent;
+    lexStates state = LEX_START;
+
+    chunk->sync = chunk->start == 0 ? 0 : findLexSync(parent->Source, chunk->start, chunk->end);
+
+    if(chunk->sync > chunk->start) {
+        if(lexPieceRange(&chunk->outside, parent, chunk->start, chunk->sync, LEX_START) == -1 ||
+            lexPieceRange(&chunk->inside, parent, chunk->start, chunk->sync, LEX_COMMENT) == -1) {
+            chunk->failed = 1;
+            return NULL;
+        }
+
+        state = chunk->outside.state;
+    }
+
+    if(lexPieceRange(&chunk->rest, parent, chunk->sync, chunk->end, state) == -1) {
+        chunk->failed = 1;
+        return NULL;
+    }
+
+    if(chunk->sync > chunk->start && chunk->inside.state != state &&
+        lexPieceRange(&chunk->insideRest, parent, chunk->sync, chunk->end, chunk->inside.state) == -1) {
+        chunk->failed = 1;
+    }
+
+    return NULL;
+}
+
+// Write a slice's tokens into the whole-source arrays with the compile's name IDs
+void * copyChunkMain(void * arg) {
+    lexChunk * chunk = arg;
+    compileContext * parent = chunk->parent;
+    lexPiece * pieces[2];
+    int pieceCount = lexChunkPieces(chunk, pieces);
+    size_t next = chunk->first;
+
+    for(int j = 0; j < pieceCount; j++) {
+        lexPiece * piece = pieces[j];
+
+        if(piece->count == 0) {
+            continue;
+        }
+
+        memcpy(&parent->LexedKind[next], piece->kind, piece->count);
+        memcpy(&parent->LexedOffset[next], piece->offset, sizeof(unsigned int) * piece->count);
+
+        for(int k = 0; k < piece->count; k++) {
+            int payload = piece->payload[k];
+            parent->LexedPayload[next + k] = piece->kind[k] == identsym ? piece->map[payload] : payload;
+        }
+
+        next += piece->count;
+    }
+
+    releasePiece(&chunk->outside);
+    releasePiece(&chunk->inside);
+    releasePiece(&chunk->rest);
+    releasePiece(&chunk->insideRest);
+
+    return NULL;
+}
+
+// Lex [from, to) starting in the given state, in a context that shares only the source
+// Returns -1 when memory runs out
+int lexPieceRange(lexPiece * piece, compileContext * parent, size_t from, size_t to, lexStates state) {
+    piece->state = state;
+
+    if(from == to) {
+        return 0;
+    }
+
+    compileContext * ctx = createContext(0, 0);
+
+    if(ctx == NULL) {
+        return -1;
+    }
+
+    piece->ctx = ctx;
+    ctx->Source = parent->Source;
+    ctx->SourceLength = parent->SourceLength;
+    ctx->LexState = state;
+    ctx->LexPosition = from;
+
+    if(setjmp(ctx->Bail) != 0) {
+        return -1;
+    }
+
+    for(;;) {
+        ctx->TokenHead = 0;
+        ctx->TokenCount = 0;
+        lexTokens(ctx, ctx->Source, to);
+
+        if(ctx->TokenCount == 0) {
+            break;
+        }
+
+        if(piece->count + ctx->TokenCount > piece->capacity) {
+            // About one token for every four bytes of typical source
+            int capacity = piece->capacity == 0 ? (int) ((to - from) / 4) + LOOKAHEAD_SIZE : piece->capacity * 2;
+            unsigned char * kind = realloc(piece->kind, capacity);
+            if(kind != NULL) {
+                piece->kind = kind;
+            }
+            int * payload = realloc(piece->payload, sizeof(int) * capacity);
+            if(payload != NULL) {
+                piece->payload = payload;
+            }
+            unsigned int * offset = realloc(piece->offset, sizeof(unsigned int) * capacity);
+            if(offset != NULL) {
+                piece->offset = offset;
+            }
+
+            if(kind == NULL || payload == NULL || offset == NULL) {
+                return -1;
+            }
+            piece->capacity = capacity;
+        }
+
+        memcpy(&piece->kind[piece->count], ctx->TokenKind, ctx->TokenCount);
+        memcpy(&piece->payload[piece->count], ctx->TokenPayload, sizeof(int) * ctx->TokenCount);
+        memcpy(&piece->offset[piece->count], ctx->TokenOffset, sizeof(unsigned int) * ctx->TokenCount);
+        piece->count += ctx->TokenCount;
+    }
+
+    piece->state = ctx->LexState;
+
+    return 0;
+}
+
+// The pieces that make up a slice once it is known whether it starts inside a comment
+int lexChunkPieces(lexChunk * chunk, lexPiece ** pieces) {
+    if(chunk->sync == chunk->start) {
+        pieces[0] = &chunk->rest;
+        return 1;
+    }
+
+    if(!chunk->useInside) {
+        pieces[0] = &chunk->outside;
+        pieces[1] = &chunk->rest;
+    } else {
+        pieces[0] = &chunk->inside;
+        pieces[1] = chunk->inside.state == chunk->outside.state ? &chunk->rest : &chunk->insideRest;
+    }
+
+    return 2;
+}
+
+void releasePiece(lexPiece * piece) {
+    if(piece->ctx != NULL) {
+        // The source belongs to the parent
+        piece->ctx->Source = NULL;
+        destroyContext(piece->ctx);
+        piece->ctx = NULL;
+    }
+
+    free(piece->kind);
+    free(piece->payload);
+    free(piece->offset);
+    piece->kind = NULL;
+    piece->payload = NULL;
+    piece->offset = NULL;
+    piece->count = 0;
+}
+
+// Just after the first whitespace that follows the first "*/" of a slice, or its end
+// A lexer that started inside a comment is outside it from that "*/" on, and at whitespace
+// both guesses are either outside a comment or inside one, with nothing pending
+size_t findLexSync(const char * src, size_t start, size_t end) {
+    const char * star = memchr(&src[start], '*', end - start);
+
+    while(star != NULL && star + 1 < &src[end] && star[1] != '/') {
+        star = memchr(star + 1, '*', &src[end] - star - 1);
+    }
+
+    if(star == NULL || star + 1 >= &src[end]) {
+        return end;
+    }
+
+    for(size_t i = star - src + 2; i < end; i++) {
+        if(CharClass[(unsigned char) src[i]] == CC_SPACE) {
+            return i + 1;
+        }
+    }
+
+    return end;
+}
+
+// Single pass state machine over the source bytes, run until the lookahead ring is full
+// Whitespace runs, words and comment bodies are each crossed by one call to a scanning kernel
+// Comments may span any number of lines and there is no line length limit
+void lexTokens(compileContext * ctx, const char * src, size_t length) {
+    const scanKernels * scan = Scan;
+    lexStates state = ctx->LexState;
+    size_t i = ctx->LexPosition;
+
+    // Each step stores at most one token
+    while(i < length && ctx->TokenCount < LOOKAHEAD_SIZE) {
+        char c = src[i];
+        int charClass = CharClass[(unsigned char) c];
+
+        switch(state) {
+            case LEX_START:
+                // Most whitespace runs and words are short, the kernels only take over past the first bytes
+                if(charClass == CC_SPACE) {
+                    i++;
+                    if(i < length && CharClass[(unsigned char) src[i]] == CC_SPACE) {
+                        i = scan->skipSpace(src, i + 1, length);
+                    }
+                } else if(charClass != CC_SYMBOL) {
+                    // Words end at whitespace or any symbol
+                    int wordClasses = charClass;
+                    size_t end = i + 1;
+
+                    while(end < length && end - i < 8) {
+                        int nextClass = CharClass[(unsigned char) src[end]];
+
+                        if(nextClass & (CC_SPACE | CC_SYMBOL)) {
+                            break;
+                        }
+                        wordClasses |= nextClass;
+                        end++;
+                    }
+
+                    if(end < length && end - i == 8) {
+                        end = scan->scanWord(src, end, length, &wordClasses);
+                    }
+
+                    addWord(ctx, &src[i], end - i, wordClasses);
+                    i = end;
+                } else {
+                    i++;
+                    switch(c) {
+                        case '/': state = LEX_SLASH; break;
+                        case ':': state = LEX_COLON; break;
+                        case '<': state = LEX_LESS; break;
+                        case '>': state = LEX_GREATER; break;
+                        case '!': state = LEX_BANG; break;
+                        default: addSymbol(ctx, SymbolValue[(unsigned char) c], i - 1); break;
+                    }
+                }
+                break;
+
+            case LEX_SLASH:
+                if(c == '*') {
+                    state = LEX_COMMENT;
+                    i++;
+                } else {
+                    addSymbol(ctx, slashsym, i - 1);
+                    state = LEX_START;
+                }
+                break;
+
+            case LEX_COMMENT:
+                // An unclosed comment runs to the end of the input
+                i = scan->findCommentEnd(src, i, length);
+                if(i < length) {
+                    state = LEX_START;
+                    i += 2;
+                }
+                break;
+
+            case LEX_COLON:
+                if(c == '=') {
+                    addSymbol(ctx, becomessym, i - 1);
+                    i++;
+                }
+                // A lone colon is not a token
+                state = LEX_START;
+                break;
+
+            case LEX_LESS:
+                if(c == '=') {
+                    addSymbol(ctx, leqsym, i - 1);
+                    i++;
+                } else if(c == '>') {
+                    addSymbol(ctx, neqsym, i - 1);
+                    i++;
+                } else {
+                    addSymbol(ctx, lessym, i - 1);
+                }
+                state = LEX_START;
+                break;
+
+            case LEX_GREATER:
+                if(c == '=') {
+                    addSymbol(ctx, geqsym, i - 1);
+                    i++;
+                } else {
+                    addSymbol(ctx, gtrsym, i - 1);
+                }
+                state = LEX_START;
+                break;
+
+            case LEX_BANG:
+                // "!" and "!=" are not tokens
+                if(c == '=') {
+                    i++;
+                }
+                state = LEX_START;
+                break;
+        }
+    }
+
+    // Flush whatever was pending at the end of the input
+    // A slice of a parallel lex ends at whitespace and keeps its state for the next one
+    if(i >= length && length == ctx->SourceLength && ctx->TokenCount < LOOKAHEAD_SIZE) {
+        switch(state) {
+            case LEX_SLASH: addSymbol(ctx, slashsym, length - 1); break;
+            case LEX_LESS: addSymbol(ctx, lessym, length - 1); break;
+            case LEX_GREATER: addSymbol(ctx, gtrsym, length - 1); break;
+            default: break;
+        }
+        state = LEX_START;
+    }
+
+    STAT_ADD(bytesRead, i - ctx->LexPosition);
+
+    ctx->LexState = state;
+    ctx->LexPosition = i;
+}
+
+// Classify a word and store it in the token stream if it is a valid token
+// Identifiers are interned and numbers are converted here, once
+void addWord(compileContext * ctx, const char * word, size_t length, int classes) {
+    int tokenValue = findTokenValue(word, length, classes);
+    int payload = 0;
+
+    if(tokenValue == 0) {
+        return;
+    }
+
+    if(tokenValue == identsym) {
+        payload = internName(ctx, word, length);
+    } else if(tokenValue == numbersym) {
+        for(size_t i = 0; i < length; i++) {
+            payload = payload * 10 + (word[i] - '0');
+        }
+    }
+
+    storeToken(ctx, tokenValue, payload, word - ctx->Source);
+
+    if(ctx->BuildLexemeList) {
+        addToken(ctx, word, length, tokenValue);
+    }
+}
+
+// Symbols carry no payload, offset is where their first character is
+void addSymbol(compileContext * ctx, int tokenValue, size_t offset) {
+    if(tokenValue == 0) {
+        return;
+    }
+
+    storeToken(ctx, tokenValue, 0, offset);
+
+    if(ctx->BuildLexemeList) {
+        addToken(ctx, NULL, 0, tokenValue);
+    }
+}
+
+// Append to the lookahead ring, the lexer never calls this when the ring is full
+void storeToken(compileContext * ctx, int tokenValue, int payload, size_t offset) {
+    int slot = (ctx->TokenHead + ctx->TokenCount) & (LOOKAHEAD_SIZE - 1);
+
+    STAT_ADD(tokens[tokenValue], 1);
+
+    ctx->TokenKind[slot] = tokenValue;
+    ctx->TokenPayload[slot] = payload;
+    ctx->TokenOffset[slot] = offset;
+    ctx->TokenCount++;
+    ctx->tokenIndex++;
+}
+
+// Return the ID of a name, adding it to the name list the first time it is seen
+int internName(compileContext * ctx, const char * name, size_t length) {
+    // Keep the index at most half full
+    if(ctx->NameListIndex * 2 >= ctx->NameHashSize) {
+        growNameHash(ctx);
+    }
+
+    unsigned int slot = findNameSlot(ctx, name, length);
+
+    if(ctx->NameHash[slot] != 0) {
+        return ctx->NameHash[slot] - 1;
+    }
+
+    if(ctx->NameListIndex == ctx->NameListCapacity) {
+        growNames(ctx);
+    }
+
+    memcpy(ctx->NameList[ctx->NameListIndex], name, length);
+    ctx->NameList[ctx->NameListIndex][length] = '\0';
+    ctx->NameHash[slot] = ctx->NameListIndex + 1;
+
+    return ctx->NameListIndex++;
+}
+
+// FNV-1a hash, used for names and object file checksums
+unsigned int hashBytes(const char * bytes, size_t length) {
+    unsigned int hash = 2166136261u;
+
+    for(size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) bytes[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+// Probe for the slot holding a name, or the empty slot where it would go
+unsigned int findNameSlot(compileContext * ctx, const char * name, size_t length) {
+    unsigned int slot = hashBytes(name, length) & (ctx->NameHashSize - 1);
+
+    while(ctx->NameHash[slot] != 0) {
+        int nameId = ctx->NameHash[slot] - 1;
+
+        if(memcmp(ctx->NameList[nameId], name, length) == 0 && ctx->NameList[nameId][length] == '\0') {
+            break;
+        }
+
+        slot = (slot + 1) & (ctx->NameHashSize - 1);
+    }
+
+    return slot;
+}
+
+// Words made only of letters are reserved words or identifiers of up to 11 characters
+// Words made only of digits are numbers of up to 5 digits
+// Anything else (mixed, uppercase, invalid characters) is not a token and returns 0
+int findTokenValue(const char * word, size_t length, int classes) {
+    if(classes == CC_DIGIT) {
+        return length <= 5 ? numbersym : 0;
+    }
+
+    if(classes == CC_LETTER) {
+        int reserved = findReservedWord(word, length);
+
+        if(reserved != 0) {
+            return reserved;
+        }
+
+        return length <= 11 ? identsym : 0;
+    }
+
+    return 0;
+}
+
+// Reserved words, picked out by length and first character before one compare
+int findReservedWord(const char * word, size_t length) {
+    switch(length) {
+        case 2:
+            switch(word[0]) {
+                case 'd': return word[1] == 'o' ? dosym : 0;
+                case 'i': return word[1] == 'f' ? ifsym : 0;
+            }
+            break;
+        case 3:
+            switch(word[0]) {
+                case 'e': return memcmp(word, "end", 3) == 0 ? endsym : 0;
+                case 'o': return memcmp(word, "odd", 3) == 0 ? oddsym : 0;
+                case 'v': return memcmp(word, "var", 3) == 0 ? varsym : 0;
+            }
+            break;
+        case 4:
+            switch(word[0]) {
+                case 'c': return memcmp(word, "call", 4) == 0 ? callsym : 0;
+                case 'e': return memcmp(word, "else", 4) == 0 ? elsesym : 0;
+                case 'r': return memcmp(word, "read", 4) == 0 ? readsym : 0;
+                case 's': return memcmp(word, "skip", 4) == 0 ? skipsym : 0;
+                case 't': return memcmp(word, "then", 4) == 0 ? thensym : 0;
+            }
+            break;
+        case 5:
+            switch(word[0]) {
+                case 'b': return memcmp(word, "begin", 5) == 0 ? beginsym : 0;
+                case 'c': return memcmp(word, "const", 5) == 0 ? constsym : 0;
+                case 'w':
+                    if(memcmp(word, "while", 5) == 0) {return whilesym;}
+                    return memcmp(word, "write", 5) == 0 ? writesym : 0;
+            }
+            break;
+        case 9:
+            return memcmp(word, "procedure", 9) == 0 ? procsym : 0;
+    }
+
+    return 0;
+}
+
+// Create a function to add the token to the lexeme list
+void addToken(compileContext * ctx, const char * tokenize, size_t length, int tokenValue) {
+    // Room for the longest entry, a value, a space, 11 characters and a space
+    if(ctx->LexemeListIndex + 16 > ctx->LexemeListCapacity) {
+        int capacity = ctx->LexemeListCapacity == 0 ? TABLE_START_SIZE * 16 : ctx->LexemeListCapacity * 2;
+
+        ctx->LexemeList = arenaGrow(ctx, ctx->LexemeList, ctx->LexemeListIndex, 1, capacity);
+        ctx->LexemeListCapacity = capacity;
+    }
+
+    // Add to lexeme list
+    if(tokenValue == 2 || tokenValue == 3) {
+        int tokenLength = length;
+
+        ctx->LexemeList[ctx->LexemeListIndex] = tokenValue + '0';
+        ctx->LexemeListIndex++;
+
+        ctx->LexemeList[ctx->LexemeListIndex] = ' ';
+        ctx->LexemeListIndex++;
+
+        for(int i = 0; i < tokenLength; i++) {
+            ctx->LexemeList[ctx->LexemeListIndex] = tokenize[i];
+            ctx->LexemeListIndex++;
+        }
+
+    } else if (tokenValue < 10) {
+        ctx->LexemeList[ctx->LexemeListIndex] = tokenValue + '0';
+        ctx->LexemeListIndex++; 
+    } else {
+        char tokenValueChar[2];
+        int i = 1;
+
+        // Converting the token value to a char
+        while(tokenValue > 0)
+        {
+            int digit = tokenValue % 10;
+            tokenValue = tokenValue / 10;
+            char value = digit + '0';
+
+            tokenValueChar[i] = value;
+            i--;
+        }
+
+        // Adding the token value
+        ctx->LexemeList[ctx->LexemeListIndex] = tokenValueChar[0];
+        ctx->LexemeListIndex++;
+
+        ctx->LexemeList[ctx->LexemeListIndex] = tokenValueChar[1];
+        ctx->LexemeListIndex++;
+    }
+
+    ctx->LexemeList[ctx->LexemeListIndex] = ' ';
+    ctx->LexemeListIndex++;
+}
+
+// SYMBOLTABLECHECK (name ID)
+//  hashed lookup of the innermost declaration that is still in scope
+//  return index if found, -1 if not
+int symbolTableCheck(compileContext * ctx, int nameId) {
+    STAT_ADD(symbolChecks, 1);
+
+    if(ctx->SymbolHashSize == 0) {
+        return -1;
+    }
+
+    unsigned int slot = findSymbolSlot(ctx, nameId);
+
+    return ctx->SymbolHash[slot].key == 0 ? -1 : ctx->SymbolHash[slot].symIdx;
+}
+
+// Probe for the slot of a name ID, or the empty slot where it would go
+unsigned int findSymbolSlot(compileContext * ctx, int nameId) {
+    unsigned int slot = ((unsigned int) nameId * 2654435761u) & (ctx->SymbolHashSize - 1);
+
+    STAT_ADD(symbolCompares, 1);
+
+    while(ctx->SymbolHash[slot].key != 0 && ctx->SymbolHash[slot].key != nameId + 1) {
+        slot = (slot + 1) & (ctx->SymbolHashSize - 1);
+        STAT_ADD(symbolCompares, 1);
+    }
+
+    return slot;
+}
+
+// Mark every live declaration of a level unavailable at the end of its block
+// and uncover the declarations they were hiding
+// Inner levels are already marked, the first live entry of an outer level stops the walk
+void markScope(compileContext * ctx, int level) {
+    for(int i = ctx->SymbolTableIndex - 1; i >= 0; i--) {
+        if(ctx->SymbolTable[i].mark == 1) {
+            continue;
+        }
+
+        if(ctx->SymbolTable[i].level < level) {
+            break;
+        }
+
+        ctx->SymbolTable[i].mark = 1;
+        ctx->SymbolHash[findSymbolSlot(ctx, ctx->SymbolTable[i].nameId)].symIdx = ctx->SymbolTable[i].shadow;
+    }
+}
+
+// Create emit function
+void emit(compileContext * ctx, int op, int l, int m) {
+    if(ctx->AssemblyCodeListIndex == ctx->AssemblyCodeListCapacity) {
+        int capacity = ctx->AssemblyCodeListCapacity == 0 ? TABLE_START_SIZE : ctx->AssemblyCodeListCapacity * 2;
+
+        ctx->AssemblyCodeList = arenaGrow(ctx, ctx->AssemblyCodeList, ctx->AssemblyCodeListIndex, sizeof(ctx->AssemblyCodeList[0]), capacity);
+        ctx->AssemblyCodeListCapacity = capacity;
+    }
+
+    STAT_ADD(emitted[op], 1);
+
+    ctx->AssemblyCodeList[ctx->AssemblyCodeListIndex].op = op;
+    ctx->AssemblyCodeList[ctx->AssemblyCodeListIndex].l = l;
+    ctx->AssemblyCodeList[ctx->AssemblyCodeListIndex].m = m;
+
+    ctx->AssemblyCodeListIndex++;
+}
+
+// Insert an instruction in front of already emitted code
+// Only used inside expressions, which contain no jumps to shift
+void insertInstruction(compileContext * ctx, int index, int op, int l, int m) {
+    emit(ctx, op, l, m);
+
+    AssemblyCode inserted = ctx->AssemblyCodeList[ctx->AssemblyCodeListIndex - 1];
+    memmove(&ctx->AssemblyCodeList[index + 1], &ctx->AssemblyCodeList[index], sizeof(AssemblyCode) * (ctx->AssemblyCodeListIndex - 1 - index));
+    ctx->AssemblyCodeList[index] = inserted;
+}
+
+// A constant operand, pending when folding and emitted right away otherwise
+operand constantOperand(compileContext * ctx, int value) {
+    operand x = { 1, value, ctx->Optimize, ctx->AssemblyCodeListIndex, 0 };
+
+    if(!ctx->Optimize) {
+        emit(ctx, LIT, 0, value);
+    }
+
+    return x;
+}
+
+// Emit the LIT of a pending constant at the end of the code
+void materialize(compileContext * ctx, operand * x) {
+    if(x->pending) {
+        x->start = ctx->AssemblyCodeListIndex;
+        emit(ctx, LIT, 0, x->value);
+        x->pending = 0;
+    }
+}
+
+operand negateOperand(compileContext * ctx, operand x) {
+    if(x.constant) {
+        x.value = (int) (0u - (unsigned int) x.value);
+    }
+
+    if(!x.pending) {
+        emit(ctx, OPR, 0, NEG);
+    }
+
+    return x;
+}
+
+// Apply a binary OPR to two operands whose code (if any) is already in order
+// Division by a known zero is a compile error; with folding on, constants fold and
+//  x + 0, 0 + x, x - 0, x * 1, 1 * x, x / 1  -> x
+//  x * -1, -1 * x, x / -1, 0 - x             -> x NEG
+//  x * 0, 0 * x                              -> 0, dropping the code of x unless it divides
+operand combine(compileContext * ctx, operand left, int opr, operand right) {
+    operand result = { 0, 0, 0, left.start, 0 };
+
+    if(opr == DIV && right.constant && right.value == 0 && !right.derived) {
+        error(ctx, 16);
+    }
+
+    if(left.constant && right.constant && foldOperation(opr, left.value, right.value, &result.value)) {
+        result.constant = 1;
+        result.derived = left.derived || right.derived;
+
+        if(left.pending && right.pending) {
+            result.pending = 1;
+            return result;
+        }
+    } else if(ctx->Optimize && (left.pending || right.pending)) {
+        operand x = left.pending ? right : left;
+        int c = left.pending ? left.value : right.value;
+        int onRight = right.pending;
+
+        if((c == 0 && (opr == ADD || (opr == SUB && onRight))) || (c == 1 && (opr == MUL || (opr == DIV && onRight)))) {
+            return x;
+        }
+
+        if((c == -1 && (opr == MUL || (opr == DIV && onRight))) || (c == 0 && opr == SUB && !onRight)) {
+            return negateOperand(ctx, x);
+        }
+
+        if(c == 0 && opr == MUL) {
+            int divides = 0;
+
+            for(int i = x.start; i < ctx->AssemblyCodeListIndex; i++) {
+                divides |= ctx->AssemblyCodeList[i].op == OPR && ctx->AssemblyCodeList[i].m == DIV;
+            }
+
+            if(!divides) {
+                ctx->AssemblyCodeListIndex = x.start;
+                result = constantOperand(ctx, 0);
+                result.derived = 1;
+                return result;
+            }
+        }
+    }
+
+    // The left constant goes in front of the code of the right operand
+    if(left.pending) {
+        insertInstruction(ctx, right.start, LIT, 0, left.value);
+        result.start = right.start;
+    }
+
+    materialize(ctx, &right);
+    emit(ctx, OPR, 0, opr);
+
+    return result;
+}
+
+// Internal marker for a JPC to the next line, which only pops the stack
+#define PEEPHOLE_POP -1
+
+// Rewrite AssemblyCodeList with peephole passes until one removes nothing
+// Returns the number of instructions removed
+int optimizeCode(compileContext * ctx) {
+    int count = ctx->AssemblyCodeListIndex;
+    scratchMark mark = scratchSave(ctx);
+    int * isTarget = scratchAlloc(ctx, sizeof(int) * (count + 1));
+    int * newIndex = scratchAlloc(ctx, sizeof(int) * (count + 1));
+    char * outTarget = scratchAlloc(ctx, count + 1);
+    char * kept = scratchAlloc(ctx, count + 1);
+
+    if(isTarget == NULL || newIndex == NULL || outTarget == NULL || kept == NULL) {
+        scratchRelease(ctx, mark);
+        return 0;
+    }
+
+    while(peepholePass(ctx, isTarget, newIndex, outTarget, kept) > 0) {
+    }
+
+    scratchRelease(ctx, mark);
+
+    return count - ctx->AssemblyCodeListIndex;
+}
+
+// One pass over the code with a window on the tail of the rewritten code:
+//  LIT a; LIT b; OPR op   -> LIT (a op b)
+//  LIT a; OPR NEG / ODD   -> LIT (-a) / LIT (odd a)
+//  LOD x; STO x           -> nothing
+//  LIT a; JPC m           -> JMP m if a is 0, nothing otherwise
+//  JMP / JPC / CAL to a JMP -> straight to its target
+//  JMP to the next line   -> nothing
+//  JPC to the next line   -> pop, which cancels the LIT / LOD / operation (not DIV) that pushed the value
+//  LIT / LOD; pop; any    -> any
+//  code after JMP, RTN or halt that no jump reaches -> nothing
+// A window never spans a jump target except at its first instruction
+// Procedure addresses follow their calls, a procedure removed as dead code gets -1
+// Returns the number of instructions removed
+int peepholePass(compileContext * ctx, int * isTarget, int * newIndex, char * outTarget, char * kept) {
+    AssemblyCode * code = ctx->AssemblyCodeList;
+    int count = ctx->AssemblyCodeListIndex;
+    int outCount = 0;
+    int dead = 0;
+
+    // Thread jumps through unconditional jumps, and procedure addresses like the calls to them
+    for(int i = 0; i < count; i++) {
+        if(code[i].op == JMP || code[i].op == JPC || code[i].op == CAL) {
+            code[i].m = threadJump(code, count, code[i].m);
+        }
+    }
+    for(int i = 0; i < ctx->SymbolTableIndex; i++) {
+        if(ctx->SymbolTable[i].kind == 3) {
+            ctx->SymbolTable[i].addr = threadJump(code, count, ctx->SymbolTable[i].addr);
+        }
+    }
+
+    // Jumps to the next line do not make their target a merge point
+    memset(isTarget, 0, sizeof(int) * (count + 1));
+    for(int i = 0; i < count; i++) {
+        if((code[i].op == JMP || code[i].op == JPC || code[i].op == CAL) && code[i].m >= 0 && code[i].m <= count && code[i].m != i + 1) {
+            isTarget[code[i].m] = 1;
+        }
+    }
+
+    for(int i = 0; i < count; i++) {
+        AssemblyCode instruction = code[i];
+
+        newIndex[i] = outCount;
+
+        if(isTarget[i]) {
+            dead = 0;
+        }
+
+        kept[i] = !dead;
+        if(dead || (instruction.op == JMP && instruction.m == i + 1)) {
+            continue;
+        }
+
+        if(instruction.op == JPC && instruction.m == i + 1) {
+            instruction.op = PEEPHOLE_POP;
+        }
+
+        code[outCount] = instruction;
+        outTarget[outCount] = isTarget[i];
+        outCount++;
+
+        int appended = outCount;
+        int jumped = 0;
+
+        // Apply the window rules to the tail until none matches
+        for(;;) {
+            AssemblyCode * last = &code[outCount - 1];
+            AssemblyCode * previous = outCount >= 2 && !outTarget[outCount - 1] ? &code[outCount - 2] : NULL;
+            AssemblyCode * first = previous != NULL && outCount >= 3 && !outTarget[outCount - 2] ? &code[outCount - 3] : NULL;
+            int folded;
+
+            if(first != NULL && first->op == LIT && previous->op == LIT && last->op == OPR &&
+            foldOperation(last->m, first->m, previous->m, &folded)) {
+                first->m = folded;
+                outCount -= 2;
+            } else if(previous != NULL && previous->op == LIT && last->op == OPR && last->m == NEG) {
+                previous->m = (int) (0u - (unsigned int) previous->m);
+                outCount--;
+            } else if(previous != NULL && previous->op == LIT && last->op == OPR && last->m == ODD) {
+                previous->m = previous->m % 2 != 0;
+                outCount--;
+            } else if(previous != NULL && previous->op == LOD && last->op == STO && previous->l == last->l && previous->m == last->m) {
+                outCount -= 2;
+            } else if(previous != NULL && previous->op == LIT && last->op == JPC) {
+                if(previous->m == 0) {
+                    *previous = *last;
+                    previous->op = JMP;
+                    outCount--;
+                    jumped = 1;
+                } else {
+                    outCount -= 2;
+                }
+            } else if(previous != NULL && (previous->op == LIT || previous->op == LOD) && last->op == PEEPHOLE_POP) {
+                outCount -= 2;
+            } else if(previous != NULL && previous->op == OPR && previous->m >= ADD && previous->m <= GEQ && previous->m != DIV && last->op == PEEPHOLE_POP) {
+                // Both operands are popped instead of the result, DIV stays since it can fail
+                previous->op = PEEPHOLE_POP;
+            } else if(first != NULL && (first->op == LIT || first->op == LOD) && previous->op == PEEPHOLE_POP) {
+                *first = *last;
+                outTarget[outCount - 3] = outTarget[outCount - 1];
+                outCount -= 2;
+            } else if(previous != NULL && previous->op == OPR && (previous->m == NEG || previous->m == ODD) && last->op == PEEPHOLE_POP) {
+                *previous = *last;
+                outCount--;
+            } else {
+                break;
+            }
+
+            if(outCount == 0) {
+                break;
+            }
+        }
+
+        // Nothing falls through an unconditional jump, a return or a halt
+        // Only this instruction can start dead code, not an older one the rules uncovered
+        AssemblyCode * tail = outCount > 0 && (outCount == appended || jumped) ? &code[outCount - 1] : NULL;
+        if(tail != NULL && (tail->op == JMP || (tail->op == OPR && tail->m == 0) || (tail->op == SYS && tail->m == 3))) {
+            dead = 1;
+        }
+    }
+
+    newIndex[count] = outCount;
+    kept[count] = 1;
+
+    for(int i = 0; i < outCount; i++) {
+        if(code[i].op == PEEPHOLE_POP) {
+            code[i].op = JPC;
+            code[i].l = 0;
+            code[i].m = i + 1;
+        } else if((code[i].op == JMP || code[i].op == JPC || code[i].op == CAL) && code[i].m >= 0 && code[i].m <= count) {
+            code[i].m = newIndex[code[i].m];
+        }
+    }
+
+    for(int i = 0; i < ctx->SymbolTableIndex; i++) {
+        if(ctx->SymbolTable[i].kind == 3 && ctx->SymbolTable[i].addr >= 0 && ctx->SymbolTable[i].addr <= count) {
+            ctx->SymbolTable[i].addr = kept[ctx->SymbolTable[i].addr] ? newIndex[ctx->SymbolTable[i].addr] : -1;
+        }
+    }
+
+    ctx->AssemblyCodeListIndex = outCount;
+
+    return count - outCount;
+}
+
+// Follow a jump target through unconditional jumps, the hop limit stops on loops
+int threadJump(const AssemblyCode * code, int count, int target) {
+    for(int hops = 0; hops < count && target >= 0 && target < count && code[target].op == JMP && code[target].m != target; hops++) {
+        target = code[target].m;
+    }
+
+    return target;
+}
+
+// Compute a binary OPR at compile time with the VM's wrapping arithmetic
+// Returns 0 if it cannot be folded (not binary, or division by zero)
+int foldOperation(int opr, int left, int right, int * result) {
+    switch(opr) {
+        case ADD: *result = (int) ((unsigned int) left + (unsigned int) right); return 1;
+        case SUB: *result = (int) ((unsigned int) left - (unsigned int) right); return 1;
+        case MUL: *result = (int) ((unsigned int) left * (unsigned int) right); return 1;
+        case DIV:
+            if(right == 0) {
+                return 0;
+            }
+            *result = right == -1 ? (int) (0u - (unsigned int) left) : left / right;
+            return 1;
+        case EQL: *result = left == right; return 1;
+        case NEQ: *result = left != right; return 1;
+        case LSS: *result = left < right; return 1;
+        case LEQ: *result = left <= right; return 1;
+        case GTR: *result = left > right; return 1;
+        case GEQ: *result = left >= right; return 1;
+    }
+
+    return 0;
+}
+
+// Record the frame of a block, its INC and end are filled in once they are emitted
+int addFrame(compileContext * ctx, int firstVar, int vars) {
+    if(ctx->FrameCount == ctx->FrameCapacity) {
+        int capacity = ctx->FrameCapacity == 0 ? 16 : ctx->FrameCapacity * 2;
+
+        ctx->Frames = arenaGrow(ctx, ctx->Frames, ctx->FrameCount, sizeof(frameInfo), capacity);
+        ctx->FrameCapacity = capacity;
+    }
+
+    frameInfo * frame = &ctx->Frames[ctx->FrameCount];
+    frame->inc = 0;
+    frame->end = 0;
+    frame->parent = ctx->CurrentFrame;
+    frame->firstVar = firstVar;
+    frame->vars = vars;
+
+    return ctx->FrameCount++;
+}
+
+// Variable flags of the frame compaction
+#define VAR_READ 1
+#define VAR_PINNED 2
+
+// Shrink every activation record to the variables that are read, sharing a slot between
+// variables that are never live at the same time
+//  - a variable no LOD reads gets no slot, its stores become pops (JPC to the next line)
+//  - a variable a nested procedure accesses (VAR_PINNED) keeps a slot of its own, any call may touch it
+//  - the others get live ranges from a liveness pass over the frame and a linear scan packs them
+// INC, every LOD / STO of the frame and the symbol table addresses are rewritten to match
+// Returns the number of slots removed
+int compactFrames(compileContext * ctx) {
+    AssemblyCode * code = ctx->AssemblyCodeList;
+    scratchMark mark = scratchSave(ctx);
+    int * varOffset = scratchAlloc(ctx, sizeof(int) * (ctx->FrameCount + 1));
+
+    if(varOffset == NULL) {
+        return 0;
+    }
+
+    // Variables of every frame numbered one after another
+    varOffset[0] = 0;
+    for(int f = 0; f < ctx->FrameCount; f++) {
+        varOffset[f + 1] = varOffset[f] + ctx->Frames[f].vars;
+    }
+
+    int total = varOffset[ctx->FrameCount];
+    char * flags = scratchAlloc(ctx, total + 1);
+    int * newAddr = scratchAlloc(ctx, sizeof(int) * (total + 1));
+    int * candidate = scratchAlloc(ctx, sizeof(int) * (total + 1));
+    liveRange * ranges = scratchAlloc(ctx, sizeof(liveRange) * (total + 1));
+
+    if(flags == NULL || newAddr == NULL || candidate == NULL || ranges == NULL) {
+        scratchRelease(ctx, mark);
+        return 0;
+    }
+
+    memset(flags, 0, total + 1);
+
+    for(int f = 0; f < ctx->FrameCount; f++) {
+        for(int i = ctx->Frames[f].inc; i <= ctx->Frames[f].end; i++) {
+            int var = frameVariable(ctx, f, varOffset, code[i]);
+
+            if(var != -1) {
+                flags[var] |= (code[i].op == LOD ? VAR_READ : 0) | (code[i].l > 0 ? VAR_PINNED : 0);
+            }
+        }
+    }
+
+    int removed = 0;
+
+    for(int f = 0; f < ctx->FrameCount; f++) {
+        frameInfo * frame = &ctx->Frames[f];
+        int count = 0;
+
+        for(int v = varOffset[f]; v < varOffset[f + 1]; v++) {
+            newAddr[v] = -1;
+            if(flags[v] == VAR_READ) {
+                candidate[count++] = v;
+            }
+        }
+
+        // Without liveness every candidate is live through the whole body
+        if(frameLiveRanges(ctx, f, varOffset[f], candidate, count, ranges) == -1) {
+            for(int c = 0; c < count; c++) {
+                ranges[c].first = frame->inc;
+                ranges[c].last = frame->end;
+                ranges[c].var = candidate[c];
+            }
+        }
+
+        for(int v = varOffset[f]; v < varOffset[f + 1]; v++) {
+            if(flags[v] == (VAR_READ | VAR_PINNED)) {
+                ranges[count].first = frame->inc;
+                ranges[count].last = frame->end;
+                ranges[count].var = v;
+                count++;
+            }
+        }
+
+        int slots = assignSlots(ctx, ranges, count, newAddr);
+
+        code[frame->inc].m = slots + 3;
+        ctx->VariableSlots += frame->vars;
+        removed += frame->vars - slots;
+    }
+
+    for(int f = 0; f < ctx->FrameCount; f++) {
+        for(int i = ctx->Frames[f].inc; i <= ctx->Frames[f].end; i++) {
+            int var = frameVariable(ctx, f, varOffset, code[i]);
+
+            if(var == -1) {
+                continue;
+            }
+
+            if(newAddr[var] == -1) {
+                code[i].op = JPC;
+                code[i].l = 0;
+                code[i].m = i + 1;
+            } else {
+                code[i].m = newAddr[var];
+            }
+        }
+
+        for(int v = 0; v < ctx->Frames[f].vars; v++) {
+            ctx->SymbolTable[ctx->Frames[f].firstVar + v].addr = newAddr[varOffset[f] + v];
+        }
+    }
+
+    scratchRelease(ctx, mark);
+
+    return removed;
+}
+
+// Number of the variable a LOD / STO in the body of a frame accesses, -1 for anything else
+int frameVariable(compileContext * ctx, int frame, int * varOffset, AssemblyCode instruction) {
+    if(instruction.op != LOD && instruction.op != STO) {
+        return -1;
+    }
+
+    for(int l = instruction.l; l > 0 && frame != -1; l--) {
+        frame = ctx->Frames[frame].parent;
+    }
+
+    if(frame == -1 || instruction.m < 3 || instruction.m - 3 >= ctx->Frames[frame].vars) {
+        return -1;
+    }
+
+    return varOffset[frame] + instruction.m - 3;
+}
+
+// Live range of every candidate variable of a frame, from backward liveness over its basic blocks
+// offset is the number of the frame's first variable; a variable read before it is assigned
+// is live from the INC, so it keeps the value its slot starts with
+// Returns -1 if the frame is too large for the bitsets or a jump leaves the body
+int frameLiveRanges(compileContext * ctx, int frame, int offset, int * candidate, int candidates, liveRange * ranges) {
+    const AssemblyCode * code = ctx->AssemblyCodeList;
+    int inc = ctx->Frames[frame].inc;
+    int end = ctx->Frames[frame].end;
+    int length = end - inc + 1;
+
+    if(candidates == 0) {
+        return 0;
+    }
+
+    scratchMark mark = scratchSave(ctx);
+    int * local = scratchAlloc(ctx, sizeof(int) * (ctx->Frames[frame].vars + 1));
+    int * blockOf = scratchAlloc(ctx, sizeof(int) * (length + 1));
+    int * blockStart = scratchAlloc(ctx, sizeof(int) * (length + 2));
+    char * leader = scratchAlloc(ctx, length + 1);
+    unsigned long long * in = NULL;
+    unsigned long long * live = NULL;
+    int status = -1;
+
+    if(local == NULL || blockOf == NULL || blockStart == NULL || leader == NULL) {
+        goto done;
+    }
+
+    memset(leader, 0, length + 1);
 
-                while(buffer[commentEndIndex] != '*' && buffer[commentEndIndex + 1] != '/') {
-                    commentEndIndex++;
-                }
-            } 
-        }
+    // Candidate number of each variable of the frame, -1 if it is not one
+    for(int v = 0; v < ctx->Frames[frame].vars; v++) {
+        local[v] = -1;
+    }
+    for(int c = 0; c < candidates; c++) {
+        local[candidate[c] - offset] = c;
+    }
 
-        if(isComment == 1) {
-            continue;
+    // Blocks start at the INC, at jump targets and after jumps, returns and halts
+    leader[0] = 1;
+    for(int i = inc; i <= end; i++) {
+        if(code[i].op == JMP || code[i].op == JPC) {
+            if(code[i].m < inc || code[i].m > end) {
+                goto done;
+            }
+            leader[code[i].m - inc] = 1;
+            leader[i - inc + 1] = 1;
+        } else if((code[i].op == OPR && code[i].m == RTN) || (code[i].op == SYS && code[i].m == 3)) {
+            leader[i - inc + 1] = 1;
         }
+    }
 
-        // While buffer is not empty
-        // Store buffer into tokenize array until a space is reached
-        // Print tokenize array and get the token value using function
-        int buffer_index = 0;
-        if(commentEndIndex != -1 && (commentStartIndex == 0 || commentStartIndex == -1)) {
-            buffer_index = commentEndIndex + 2;
+    int blocks = 0;
+    for(int j = 0; j < length; j++) {
+        if(leader[j]) {
+            blockStart[blocks++] = j;
         }
+        blockOf[j] = blocks - 1;
+    }
+    blockStart[blocks] = length;
 
-        while (buffer[buffer_index] != '\0' && buffer_index < bufferLength)
-        {
-            char tokenize[MAX_LINE_LENGTH] = {0};
-            int tokenize_index = 0;
-            int didWhileWork = 0;
+    if((size_t) candidates * blocks > LIVENESS_BUDGET) {
+        goto done;
+    }
 
-            // Store buffer into tokenize array until a space is reached or a symbol is reached
-            while(isSymbol(buffer[buffer_index]) == 0 && buffer[buffer_index] != ' ' && buffer[buffer_index] != '\0' && buffer[buffer_index] != '\n' && buffer[buffer_index] != '\t')
-            {
-                tokenize[tokenize_index] = buffer[buffer_index];
-                tokenize_index++;
-                buffer_index++;
-                didWhileWork = 1;
-            }
+    int words = (candidates + 63) / 64;
+    in = scratchAlloc(ctx, sizeof(unsigned long long) * blocks * words);
+    live = scratchAlloc(ctx, sizeof(unsigned long long) * words);
 
-            // Print tokenize array and get the token value using function
+    if(in == NULL || live == NULL) {
+        goto done;
+    }
 
-            if(didWhileWork == 1) {
-                tokenize[tokenize_index] = '\0';
+    memset(in, 0, sizeof(unsigned long long) * blocks * words);
 
-                int tokenValue = findTokenValue(tokenize);
+    // Iterate to a fixed point, blocks in reverse order so most of it settles in one pass
+    int changed;
+    do {
+        changed = 0;
 
-                if(tokenValue != 0) {
-                    // printf("%-15s %-10d\n", tokenize,  tokenValue);
+        for(int b = blocks - 1; b >= 0; b--) {
+            blockLiveOut(code, inc, b, blocks, blockOf, blockStart, in, words, live);
 
-                    // Store token into token array
-                    strcpy(token[tokenIndex], tokenize);
-                    value[tokenIndex] = tokenValue;
-                    tokenIndex++;
+            for(int i = inc + blockStart[b + 1] - 1; i >= inc + blockStart[b]; i--) {
+                if((code[i].op == LOD || code[i].op == STO) && code[i].l == 0 && code[i].m >= 3 && code[i].m - 3 < ctx->Frames[frame].vars && local[code[i].m - 3] != -1) {
+                    int c = local[code[i].m - 3];
 
-                    // Add to lexeme list
-                    addToken(tokenize, tokenValue);
+                    if(code[i].op == STO) {
+                        live[c / 64] &= ~(1ULL << (c % 64));
+                    } else {
+                        live[c / 64] |= 1ULL << (c % 64);
+                    }
                 }
             }
 
-            // While buffer has a symbol, print the symbol and get the token value using function
-            while(isSymbol(buffer[buffer_index]) == 1)
-            {
-                char symbol[3] = {0};
-                symbol[0] = buffer[buffer_index];
-                symbol[1] = '\0';
-
-                if(symbol[0] == ':' && buffer[buffer_index + 1] == '=')
-                {
-                    symbol[1] = '=';
-                    symbol[2] = '\0';
-                    buffer_index++;
-                } else if(symbol[0] == '<' && buffer[buffer_index + 1] == '=')
-                {
-                    symbol[1] = '=';
-                    symbol[2] = '\0';
-                    buffer_index++;
-                } else if(symbol[0] == '>' && buffer[buffer_index + 1] == '=')
-                {
-                    symbol[1] = '=';
-                    symbol[2] = '\0';
-                    buffer_index++;
-                } else if(symbol[0] == '!' && buffer[buffer_index + 1] == '=')
-                {
-                    symbol[1] = '=';
-                    symbol[2] = '\0';
-                    buffer_index++;
-                } else if(symbol[0] == '<' && buffer[buffer_index + 1] == '>')
-                {
-                    symbol[1] = '>';
-                    symbol[2] = '\0';
-                    buffer_index++;
-                }
+            if(memcmp(&in[(size_t) b * words], live, sizeof(unsigned long long) * words) != 0) {
+                memcpy(&in[(size_t) b * words], live, sizeof(unsigned long long) * words);
+                changed = 1;
+            }
+        }
+    } while(changed);
 
-                int tokenValue = findTokenValue(symbol);
-                
-                if(tokenValue != 0) {
-                    // printf("%-15s %-10d\n", symbol,  tokenValue);
+    for(int c = 0; c < candidates; c++) {
+        ranges[c].first = end + 1;
+        ranges[c].last = -1;
+        ranges[c].var = candidate[c];
+    }
 
-                    strcpy(token[tokenIndex], symbol);
-                    value[tokenIndex] = tokenValue;
-                    tokenIndex++;
+    // A range runs from the first block entry or access to the last block exit or access
+    // where the variable is live, so no store to another variable in the same slot falls inside it
+    for(int b = 0; b < blocks; b++) {
+        int first = inc + blockStart[b];
+        int last = inc + blockStart[b + 1] - 1;
 
-                    // Add to lexeme list
-                    addToken(symbol, tokenValue);
-                }
+        blockLiveOut(code, inc, b, blocks, blockOf, blockStart, in, words, live);
 
-                buffer_index++;
+        for(int w = 0; w < words; w++) {
+            for(unsigned long long bits = live[w]; bits != 0; bits &= bits - 1) {
+                int c = w * 64 + __builtin_ctzll(bits);
+                ranges[c].last = ranges[c].last > last ? ranges[c].last : last;
             }
 
-            // Remove whitespace from buffer
-            while (buffer[buffer_index] == ' ' || buffer[buffer_index] == '\t' || buffer[buffer_index] == '\n')
-            {
-                buffer_index++;
+            for(unsigned long long bits = in[(size_t) b * words + w]; bits != 0; bits &= bits - 1) {
+                int c = w * 64 + __builtin_ctzll(bits);
+                ranges[c].first = ranges[c].first < first ? ranges[c].first : first;
             }
+        }
 
-            if(buffer_index >= commentStartIndex && commentEndIndex > buffer_index && commentEndIndex != 0) {
-                buffer_index = commentEndIndex+2;
+        for(int i = first; i <= last; i++) {
+            if((code[i].op == LOD || code[i].op == STO) && code[i].l == 0 && code[i].m >= 3 && code[i].m - 3 < ctx->Frames[frame].vars && local[code[i].m - 3] != -1) {
+                int c = local[code[i].m - 3];
+
+                ranges[c].first = ranges[c].first < i ? ranges[c].first : i;
+                ranges[c].last = ranges[c].last > i ? ranges[c].last : i;
             }
         }
-
     }
 
-    // Close file
-    fclose(fp);
+    status = 0;
 
-    LexemeList[LexemeListIndex-1] = '\0';
+done:
+    scratchRelease(ctx, mark);
 
-    emit(JMP, 0, 3);
-
-    addSymbolTable(3, "main", 0, 0, 3, 1);
-
-    program();
+    return status;
+}
 
-    printf("Assembly Code: \n");
-    printf("%-4s %-4s %-4s %-4s\n", "LINE", "OP", "L", "M");
-    for(int i = 0; i < AssemblyCodeListIndex; i++) {
-        printf("%-4d %-4s %-4d %-4d\n", i, AssemblyCodeList[i].op, AssemblyCodeList[i].l, AssemblyCodeList[i].m);
+// Union of the live-in sets of a block's successors
+// CAL falls through, the callee cannot reach the frame's unpinned variables
+void blockLiveOut(const AssemblyCode * code, int inc, int block, int blocks, int * blockOf, int * blockStart,
+                  unsigned long long * in, int words, unsigned long long * live) {
+    const AssemblyCode * last = &code[inc + blockStart[block + 1] - 1];
+    int successors[2];
+    int count = 0;
+
+    if(last->op == JMP) {
+        successors[count++] = blockOf[last->m - inc];
+    } else if(!(last->op == OPR && last->m == RTN) && !(last->op == SYS && last->m == 3)) {
+        if(block + 1 < blocks) {
+            successors[count++] = block + 1;
+        }
+        if(last->op == JPC) {
+            successors[count++] = blockOf[last->m - inc];
+        }
     }
 
-    printf("\n");
+    memset(live, 0, sizeof(unsigned long long) * words);
 
-    printf("Symbol Table: \n");
-    printf("%-4s | %-11s | %-5s | %-5s | %-7s | %-4s\n", "KIND", "NAME", "VALUE", "LEVEL", "ADDRESS", "MARK");
-    printf("----------------------------------------------------\n");
-    for(int i = 0; i < SymbolTableIndex; i++) {
-        printf("%4d | %11s | %5d | %5d | %7d | %4d\n", SymbolTable[i].kind, SymbolTable[i].name, SymbolTable[i].val, SymbolTable[i].level, SymbolTable[i].addr, SymbolTable[i].mark);
+    for(int s = 0; s < count; s++) {
+        for(int w = 0; w < words; w++) {
+            live[w] |= in[(size_t) successors[s] * words + w];
+        }
     }
-
-    return 0;
 }
 
-int findTokenValue(char * token) {
-
-    // If token is a reserved word, return the token value
-    // Else return 3 (numbersym) if token is a number and 2 (identsym) if token is an identifier
-    // Emit error if token is not a reserved word, number more than 5 digits, or identifier more than 11 characters
-    if(token[0] == 's' && token[1] == 'k' && token[2] == 'i' && token[3] == 'p' && token[4] == '\0') {return skipsym;}
-    if(token[0] == '+' && token[1] == '\0') {return plussym;}
-    if(token[0] == '-' && token[1] == '\0') {return minussym;}
-    if(token[0] == '*' && token[1] == '\0') {return multsym;}
-    if(token[0] == '/' && token[1] == '\0') {return slashsym;}
-    if(token[0] == 'o' && token[1] == 'd' && token[2] == 'd' && token[3] == '\0') {return oddsym;}
-    if(token[0] == '=' && token[1] == '\0') {return eqlsym;}
-    if(token[0] == '<' && token[1] == '>' && token[2] == '\0') {return neqsym;}
-    if(token[0] == '<' && token[1] == '\0') {return lessym;}
-    if(token[0] == '<' && token[1] == '=' && token[2] == '\0') {return leqsym;}
-    if(token[0] == '>' && token[1] == '\0') {return gtrsym;}
-    if(token[0] == '>' && token[1] == '=' && token[2] == '\0') {return geqsym;}
-    if(token[0] == '(' && token[1] == '\0') {return lparentsym;}
-    if(token[0] == ')' && token[1] == '\0') {return rparentsym;}
-    if(token[0] == ',' && token[1] == '\0') {return commasym;}
-    if(token[0] == ';' && token[1] == '\0') {return semicolonsym;}
-    if(token[0] == '.' && token[1] == '\0') {return periodsym;}
-    if(token[0] == ':' && token[1] == '=' && token[2] == '\0') {return becomessym;}
-    if(token[0] == 'b' && token[1] == 'e' && token[2] == 'g' && token[3] == 'i' && token[4] == 'n' && token[5] == '\0') {return beginsym;}
-    if(token[0] == 'e' && token[1] == 'n' && token[2] == 'd' && token[3] == '\0') {return endsym;}
-    if(token[0] == 'i' && token[1] == 'f' && token[2] == '\0') {return ifsym;}
-    if(token[0] == 't' && token[1] == 'h' && token[2] == 'e' && token[3] == 'n' && token[4] == '\0') {return thensym;}
-    if(token[0] == 'w' && token[1] == 'h' && token[2] == 'i' && token[3] == 'l' && token[4] == 'e' && token[5] == '\0') {return whilesym;}
-    if(token[0] == 'd' && token[1] == 'o' && token[2] == '\0') {return dosym;}
-    if(token[0] == 'c' && token[1] == 'a' && token[2] == 'l' && token[3] == 'l' && token[4] == '\0') {return callsym;}
-    if(token[0] == 'c' && token[1] == 'o' && token[2] == 'n' && token[3] == 's' && token[4] == 't' && token[5] == '\0') {return constsym;}
-    if(token[0] == 'v' && token[1] == 'a' && token[2] == 'r' && token[3] == '\0') {return varsym;}
-    if(token[0] == 'p' && token[1] == 'r' && token[2] == 'o' && token[3] == 'c' && token[4] == 'e' && token[5] == 'd' && token[6] == 'u' && token[7] == 'r' && token[8] == 'e' && token[9] == '\0') {return procsym;}
-    if(token[0] == 'w' && token[1] == 'r' && token[2] == 'i' && token[3] == 't' && token[4] == 'e' && token[5] == '\0') {return writesym;}
-    if(token[0] == 'r' && token[1] == 'e' && token[2] == 'a' && token[3] == 'd' && token[4] == '\0') {return readsym;}
-    if(token[0] == 'e' && token[1] == 'l' && token[2] == 's' && token[3] == 'e' && token[4] == '\0') {return elsesym;}
-    if(isNumber(token) == 1) {return numbersym;}
-    if(isIdentifier(token) == 1) {return identsym;}
-
-    return 0;
-}
+// Give every range the lowest numbered free slot, freeing the slots of ranges that ended
+// before it starts; writes the address of each range's variable to addresses
+// Returns the number of slots used
+int assignSlots(compileContext * ctx, liveRange * ranges, int count, int * addresses) {
+    // Ranges still holding a slot, a min-heap on last with the slot in var
+    scratchMark mark = scratchSave(ctx);
+    liveRange * active = scratchAlloc(ctx, sizeof(liveRange) * (count + 1));
+    int activeCount = 0;
+    int slots = 0;
+
+    qsort(ranges, count, sizeof(liveRange), compareLiveRanges);
+
+    for(int r = 0; r < count; r++) {
+        int slot;
+
+        if(active != NULL && activeCount > 0 && active[0].last < ranges[r].first) {
+            slot = active[0].var;
+
+            // Pop the heap
+            liveRange moved = active[--activeCount];
+            int i = 0;
+            for(;;) {
+                int child = 2 * i + 1;
+                if(child >= activeCount) {
+                    break;
+                }
+                if(child + 1 < activeCount && active[child + 1].last < active[child].last) {
+                    child++;
+                }
+                if(moved.last <= active[child].last) {
+                    break;
+                }
+                active[i] = active[child];
+                i = child;
+            }
+            if(activeCount > 0) {
+                active[i] = moved;
+            }
+        } else {
+            slot = slots++;
+        }
 
-// Function to check if the token is a number is under 5 digits long
-// If a number is greater than 5 digits long, it is an error
-int isNumber(char *token) {
-    int i = 0;
-    int length = strlen(token);
+        addresses[ranges[r].var] = slot + 3;
 
-    // Check if the token is a number
-    while(i < length) {
-        if(token[i] < '0' || token[i] > '9') {
-            return 0;
+        // Push the range with its slot
+        if(active != NULL) {
+            int i = activeCount++;
+            while(i > 0 && active[(i - 1) / 2].last > ranges[r].last) {
+                active[i] = active[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+            active[i].last = ranges[r].last;
+            active[i].var = slot;
         }
-        i++;
     }
 
-    // Check if the length of the token is greater than 5
-    if(length > 5) {
-        // printf("Error: Number is greater than 5 digits long\n");
-        return 0;
-    }  
+    scratchRelease(ctx, mark);
 
-    // Return 1 if the token is a valid number
-    return 1;
+    return slots;
 }
 
-// Function to check if the token is a word and less than 11 characters long
-// If a word is greater than 11 characters long, it is an error
-int isIdentifier(char *token) {
-    int i = 0;
-    int length = strlen(token);
+// Ranges in order of their start, ties in declaration order
+int compareLiveRanges(const void * a, const void * b) {
+    const liveRange * x = a;
+    const liveRange * y = b;
 
-    // Check if the length of the token is greater than 11
-    if(length > 11) {
-        // printf("Error: Word is greater than 11 characters long\n");
-        return 0;
+    if(x->first != y->first) {
+        return x->first < y->first ? -1 : 1;
     }
 
-    // Check if the first character of the token is a letter
-    if(token[0] > '0' && token[0] < '9') {
-        // printf("Error: Identifier must start with a letter\n");
-        return 0;
-    }
+    return (x->var > y->var) - (x->var < y->var);
+}
 
-    // Check if the token has any symbols, if it does, then return 0
-    if(checkInvalidSymbols(token)) {
-        return 0;
+// Create get token function
+// Pulls the next token from the ring, refilling it from the lexer when it runs dry
+// At the end of the input the current token becomes 0
+void getToken(compileContext * ctx) {
+    if(ctx->LexedKind != NULL) {
+        size_t next = ctx->LexedNext < ctx->LexedCount ? ctx->LexedNext++ : ctx->LexedCount;
+
+        // The entry past the last token is the end of the input
+        ctx->CurrentTokenValue = next < ctx->LexedCount ? ctx->LexedKind[next] : 0;
+        ctx->CurrentTokenPayload = next < ctx->LexedCount ? ctx->LexedPayload[next] : 0;
+        ctx->CurrentTokenOffset = next < ctx->LexedCount ? ctx->LexedOffset[next] : ctx->SourceLength;
+        return;
     }
 
-    while(i < length) {
-        // Check if the token is a letter
-        if(token[i] < 'a' || token[i] > 'z') {
-            return 0;
-        }
-        i++;
+    if(ctx->TokenCount == 0) {
+        STAT_START(lexStart);
+        lexTokens(ctx, ctx->Source, ctx->SourceLength);
+        STAT_PHASE(lexSeconds, lexStart);
     }
 
-    // Return 1 if the token is a valid identifier
-    return 1;
+    if(ctx->TokenCount > 0) {
+        ctx->CurrentTokenValue = ctx->TokenKind[ctx->TokenHead];
+        ctx->CurrentTokenPayload = ctx->TokenPayload[ctx->TokenHead];
+        ctx->CurrentTokenOffset = ctx->TokenOffset[ctx->TokenHead];
+        ctx->TokenHead = (ctx->TokenHead + 1) & (LOOKAHEAD_SIZE - 1);
+        ctx->TokenCount--;
+    } else {
+        ctx->CurrentTokenValue = 0;
+        ctx->CurrentTokenPayload = 0;
+        ctx->CurrentTokenOffset = ctx->SourceLength;
+    }
 }
 
-// Function to check if the current token has any invalid symbols
-int checkInvalidSymbols(char * token) {
-    int found = 0;
-    int length = strlen(token);
+void addSymbolTable(compileContext * ctx, int kind, int nameId, int val, int level, int addr, int mark) {
+    STAT_ADD(declarations, 1);
 
-    // Check if the token has any invalid symbols
-    for(int i = 0; i < length; i++) {
-        if(token[i] == '`' || token[i] == '~' || token[i] == '!' || token[i] == '@' || 
-        token[i] == '#' || token[i] == '$' || token[i] == '%' || token[i] == '^' || 
-        token[i] == '&' || token[i] == '_' || token[i] == '{' || token[i] == '}' || 
-        token[i] == '[' || token[i] == ']' || token[i] == '|' || token[i] == '\\' || 
-        token[i] == '\'' || token[i] == '"' || token[i] == '?') {
-            // If the token has an invalid symbol, then print an error message and return 1
-            // fprintf(stdout, "Error: Invalid symbol found\n");
-            found = 1;
-        }
+    if(ctx->SymbolTableIndex == ctx->SymbolTableCapacity) {
+        growSymbols(ctx);
     }
 
-    // Return 0 if there are no invalid symbols
-    if(found) {
-        return 1;
+    // Keep the index at most half full
+    if(ctx->SymbolHashCount * 2 >= ctx->SymbolHashSize) {
+        growSymbolHash(ctx);
     }
 
-    return 0;
-}
+    symbolSlot * slot = &ctx->SymbolHash[findSymbolSlot(ctx, nameId)];
 
-// Function to check if the token is a symbol
-int isSymbol(char token) {
-    // Check if the token is a symbol
-    if(token == '+' || token == '-' || token == '*' || token == '/' || token == '(' || token == ')' || token == '=' || 
-    token == ',' || token == '.' || token == '<' || token == '>' || token == ';' || token == ':' || token == '!' || 
-    token == '&' || token == '|' || token == '~' || token == '#' || token == '%' || token == '^' || token == '_' || 
-    token == '{' || token == '}' || token == '[' || token == ']' || token == '\\' || token == '\'' || token == '"' ||
-    token == '?' || token == '`' || token == '@' || token == '$') {
-        return 1;
+    if(slot->key == 0) {
+        slot->key = nameId + 1;
+        slot->symIdx = -1;
+        ctx->SymbolHashCount++;
     }
 
-    return 0;
-}
-
-// Create a function to add the token to the lexeme list
-void addToken(char * tokenize, int tokenValue) {
-    // Add to lexeme list
-    if(tokenValue == 2 || tokenValue == 3) {
-        int tokenLength = strlen(tokenize);
-
-        LexemeList[LexemeListIndex] = tokenValue + '0';
-        LexemeListIndex++;
-
-        LexemeList[LexemeListIndex] = ' ';
-        LexemeListIndex++;
-
-        for(int i = 0; i < tokenLength; i++) {
-            LexemeList[LexemeListIndex] = tokenize[i];
-            LexemeListIndex++;
-        }
+    ctx->SymbolTable[ctx->SymbolTableIndex].kind = kind;
+    ctx->SymbolTable[ctx->SymbolTableIndex].nameId = nameId;
+    memcpy(ctx->SymbolTable[ctx->SymbolTableIndex].name, ctx->NameList[nameId], sizeof(ctx->SymbolTable[ctx->SymbolTableIndex].name));
+    ctx->SymbolTable[ctx->SymbolTableIndex].val = val;
+    ctx->SymbolTable[ctx->SymbolTableIndex].level = level;
+    ctx->SymbolTable[ctx->SymbolTableIndex].addr = addr;
+    ctx->SymbolTable[ctx->SymbolTableIndex].mark = mark;
+    ctx->SymbolTable[ctx->SymbolTableIndex].shadow = slot->symIdx;
 
-    } else if (tokenValue < 10) {
-        LexemeList[LexemeListIndex] = tokenValue + '0';
-        LexemeListIndex++; 
-    } else {
-        char tokenValueChar[2];
-        int i = 1;
+    // Newest declaration hides the older ones until its scope ends
+    slot->symIdx = ctx->SymbolTableIndex;
 
-        // Converting the token value to a char
-        while(tokenValue > 0)
-        {
-            int digit = tokenValue % 10;
-            tokenValue = tokenValue / 10;
-            char value = digit + '0';
+    ctx->SymbolTableIndex++;
+}
 
-            tokenValueChar[i] = value;
-            i--;
-        }
+void program(compileContext * ctx) {
+    getToken(ctx);
+    // main is the first symbol, its address is set to its INC like a procedure's
+    block(ctx, 0);
 
-        // Adding the token value
-        LexemeList[LexemeListIndex] = tokenValueChar[0];
-        LexemeListIndex++;
+    if(ctx->Panicking) {
+        recover(ctx);
+    }
 
-        LexemeList[LexemeListIndex] = tokenValueChar[1];
-        LexemeListIndex++;
+    if(ctx->CurrentTokenValue != periodsym) {
+        syntaxError(ctx, 12);
     }
 
-    LexemeList[LexemeListIndex] = ' ';
-    LexemeListIndex++;
+    emit(ctx, SYS, 0, 3);
 }
 
-// SYMBOLTABLECHECK (string)
-//  linear search through symbol table looking at name
-//  return index if found, -1 if not
-int symbolTableCheck(char * name) {
-    int i = 0;
-
-    while(i < SymbolTableIndex) {
-        if(strcmp(name, SymbolTable[i].name) == 0) {
-            return i;
-        }
-        i++;
+// procIdx is the symbol of the procedure whose body this is, -1 if it has none
+void block(compileContext * ctx, int procIdx) {
+    // Jump over the procedures declared in this block, backpatched once they are emitted
+    int jmpIdx = ctx->AssemblyCodeListIndex;
+    emit(ctx, JMP, 0, 0);
+
+    constDeclaration(ctx);
+    int firstVar = ctx->SymbolTableIndex;
+    int numVars = varDeclaration(ctx);
+
+    // Procedures declared here are nested in this block's frame
+    int parentFrame = ctx->CurrentFrame;
+    int frame = -1;
+    if(ctx->Optimize) {
+        frame = addFrame(ctx, firstVar, numVars);
+        ctx->CurrentFrame = frame;
     }
 
-    return -1;
-}
-
-// Create emit function
-void emit(int op, int l, int m) {
-    AssemblyCodeList[AssemblyCodeListIndex].op[0] = op_code[op][0];
-    AssemblyCodeList[AssemblyCodeListIndex].op[1] = op_code[op][1];
-    AssemblyCodeList[AssemblyCodeListIndex].op[2] = op_code[op][2];
-    AssemblyCodeList[AssemblyCodeListIndex].op[3] = '\0';
-    
-    AssemblyCodeList[AssemblyCodeListIndex].l = l;
-    AssemblyCodeList[AssemblyCodeListIndex].m = m;
+    procDeclaration(ctx);
 
-    AssemblyCodeListIndex++;
-}
+    ctx->AssemblyCodeList[jmpIdx].m = ctx->AssemblyCodeListIndex;
+    STAT_ADD(backpatches, 1);
 
-// Create get token function
-void getToken() {
-    if(CurrentIndex < tokenIndex) {
-        strcpy(CurrentToken, token[CurrentIndex]);
-        CurrentTokenValue = value[CurrentIndex];
-        CurrentIndex++;
+    // Calls compiled from now on skip the jump
+    if(procIdx != -1) {
+        ctx->SymbolTable[procIdx].addr = ctx->AssemblyCodeListIndex;
     }
-}
 
-void addSymbolTable(int kind, char * name, int val, int level, int addr, int mark) {
-    SymbolTable[SymbolTableIndex].kind = kind;
-    strcpy(SymbolTable[SymbolTableIndex].name, name);
-    SymbolTable[SymbolTableIndex].val = val;
-    SymbolTable[SymbolTableIndex].level = level;
-    SymbolTable[SymbolTableIndex].addr = addr;
-    SymbolTable[SymbolTableIndex].mark = mark;
-
-    SymbolTableIndex++;
-}
+    if(frame != -1) {
+        ctx->Frames[frame].inc = ctx->AssemblyCodeListIndex;
+    }
 
-void program() {
-    getToken();
-    block();
+    emit(ctx, INC, 0, numVars + 3);
+    ctx->TopLevel = ctx->RecordStatements && ctx->CurrentLevel == 0;
+    statement(ctx);
 
-    if(CurrentTokenValue != periodsym) {
-        fprintf(stdout, "Error: Period expected\n");
-        exit(0);
+    // The RTN or halt after the block ends the body
+    if(frame != -1) {
+        ctx->Frames[frame].end = ctx->AssemblyCodeListIndex;
+        ctx->CurrentFrame = parentFrame;
     }
 
-    emit(SYS, 0, 3);
-}
-
-void block() {
-    constDeclaration();
-    int numVars = varDeclaration();
-    emit(INC, 0, numVars + 3);
-    statement();
+    // Declarations of this block go out of scope
+    markScope(ctx, ctx->CurrentLevel);
 }
 
 
-void constDeclaration() {
-    if(CurrentTokenValue == constsym) {
+// A bad declaration skips to the end of the list, the names after it are not declared
+void constDeclaration(compileContext * ctx) {
+    if(ctx->CurrentTokenValue == constsym) {
         do {
-            getToken();
-            if(CurrentTokenValue != identsym) {
-                fprintf(stdout, "Error: Identifier expected\n");
-                exit(0);
+            getToken(ctx);
+            if(ctx->CurrentTokenValue != identsym) {
+                syntaxError(ctx, 2);
+                break;
             }
 
-            if(symbolTableCheck(CurrentToken) != -1) {
-                fprintf(stdout, "Error: Identifier already declared\n");
-                exit(0);
+            int symIdx = symbolTableCheck(ctx, ctx->CurrentTokenPayload);
+            int redeclared = symIdx != -1 && ctx->SymbolTable[symIdx].level == ctx->CurrentLevel;
+            if(redeclared) {
+                error(ctx, 15);
             }
 
-            char * name = CurrentToken;
-            getToken();
-            if(CurrentTokenValue != eqlsym) {
-                fprintf(stdout, "Error: = expected\n");
-                exit(0);
+            int nameId = ctx->CurrentTokenPayload;
+            getToken(ctx);
+            if(ctx->CurrentTokenValue != eqlsym) {
+                syntaxError(ctx, 1);
+                break;
             }
 
-            getToken();
-            if(CurrentTokenValue != numbersym) {
-                fprintf(stdout, "Error: Number expected\n");
-                exit(0);
+            getToken(ctx);
+            if(ctx->CurrentTokenValue != numbersym) {
+                syntaxError(ctx, 4);
+                break;
             }
 
-            addSymbolTable(1, name, atoi(CurrentToken), 0, 0, 1);
-            getToken();
-        } while(CurrentTokenValue == commasym);
+            if(!redeclared) {
+                addSymbolTable(ctx, 1, nameId, ctx->CurrentTokenPayload, ctx->CurrentLevel, 0, 0);
+            }
+            getToken(ctx);
+        } while(ctx->CurrentTokenValue == commasym);
 
-        if(CurrentTokenValue != semicolonsym) {
-            fprintf(stdout, "Error: Semicolon expected\n");
-            exit(0);
+        if(!ctx->Panicking && ctx->CurrentTokenValue != semicolonsym) {
+            syntaxError(ctx, 3);
+        }
+
+        if(ctx->Panicking) {
+            recover(ctx);
         }
 
-        getToken();
+        if(ctx->CurrentTokenValue == semicolonsym) {
+            getToken(ctx);
+        }
     }
 }
 
 
-int varDeclaration() {
+int varDeclaration(compileContext * ctx) {
     int numVars = 0;
 
-    if(CurrentTokenValue == varsym) {
+    if(ctx->CurrentTokenValue == varsym) {
         do {
-            numVars++;
-            getToken();
-            if(CurrentTokenValue != identsym) {
-                fprintf(stdout, "Error: Identifier expected\n");
-                exit(0);
+            getToken(ctx);
+            if(ctx->CurrentTokenValue != identsym) {
+                syntaxError(ctx, 2);
+                break;
             }
 
-            if(symbolTableCheck(CurrentToken) != -1) {
-                fprintf(stdout, "Error: Identifier already declared\n");
-                exit(0);
+            int symIdx = symbolTableCheck(ctx, ctx->CurrentTokenPayload);
+            if(symIdx != -1 && ctx->SymbolTable[symIdx].level == ctx->CurrentLevel) {
+                error(ctx, 15);
+            } else {
+                numVars++;
+                addSymbolTable(ctx, 2, ctx->CurrentTokenPayload, 0, ctx->CurrentLevel, numVars + 2, 0);
             }
+            getToken(ctx);
+        } while(ctx->CurrentTokenValue == commasym);
 
-            addSymbolTable(2, CurrentToken, 0, 0, numVars + 2, 1);
-            getToken();
-        } while(CurrentTokenValue == commasym);
+        if(!ctx->Panicking && ctx->CurrentTokenValue != semicolonsym) {
+            syntaxError(ctx, 3);
+        }
 
-        if(CurrentTokenValue != semicolonsym) {
-            fprintf(stdout, "Error: Semicolon expected\n");
-            exit(0);
+        if(ctx->Panicking) {
+            recover(ctx);
         }
 
-        getToken();
+        if(ctx->CurrentTokenValue == semicolonsym) {
+            getToken(ctx);
+        }
     }
 
     return numVars;
 }
 
-void statement() {
-    if(CurrentTokenValue == identsym) {
-        int symIdx = symbolTableCheck(CurrentToken);
-        if(symIdx == -1) {
-            fprintf(stdout, "Error: Identifier not declared\n");
-            exit(0);
+// procedure ident ; block ; for each procedure, its body is one level deeper
+// The address is the body's jump until the body's INC is emitted, so nested procedures can call it
+void procDeclaration(compileContext * ctx) {
+    while(ctx->CurrentTokenValue == procsym) {
+        int procIdx = -1;
+
+        getToken(ctx);
+        if(ctx->CurrentTokenValue != identsym) {
+            syntaxError(ctx, 2);
+        } else {
+            int symIdx = symbolTableCheck(ctx, ctx->CurrentTokenPayload);
+            if(symIdx != -1 && ctx->SymbolTable[symIdx].level == ctx->CurrentLevel) {
+                error(ctx, 15);
+            } else {
+                procIdx = ctx->SymbolTableIndex;
+                addSymbolTable(ctx, 3, ctx->CurrentTokenPayload, 0, ctx->CurrentLevel, ctx->AssemblyCodeListIndex, 0);
+            }
+            getToken(ctx);
         }
 
-        if(SymbolTable[symIdx].kind != 2) {
-            fprintf(stdout, "Error: Identifier must be a variable\n");
-            exit(0);
+        if(!ctx->Panicking && ctx->CurrentTokenValue != semicolonsym) {
+            syntaxError(ctx, 17);
         }
 
-        getToken();
-        if(CurrentTokenValue != becomessym) {
-            error(1);
-            fprintf(stdout, "Error: = expected\n");
-            exit(0);
+        if(ctx->Panicking) {
+            recover(ctx);
+        }
+
+        if(ctx->CurrentTokenValue == semicolonsym) {
+            getToken(ctx);
+        }
+
+        if(ctx->CurrentLevel + ctx->Nesting >= NESTING_LIMIT) {
+            nestedTooDeep(ctx);
+        } else {
+            ctx->CurrentLevel++;
+            block(ctx, procIdx);
+            ctx->CurrentLevel--;
+        }
+        emit(ctx, OPR, 0, RTN);
+
+        if(!ctx->Panicking && ctx->CurrentTokenValue != semicolonsym) {
+            syntaxError(ctx, 17);
         }
 
-        getToken();
-        expression();
-        emit(STO, 0, SymbolTable[symIdx].addr);
+        if(ctx->Panicking) {
+            recover(ctx);
+        }
+
+        if(ctx->CurrentTokenValue == semicolonsym) {
+            getToken(ctx);
+        }
+    }
+}
+
+// After a syntax error a statement returns at once, the statement list it is in recovers
+void statement(compileContext * ctx) {
+    STAT_ADD(statements, 1);
+
+    // Only the statements of the begin that is the main block's body are marked
+    int topLevel = ctx->TopLevel;
+    ctx->TopLevel = 0;
+
+    if((ctx->CurrentTokenValue == beginsym || ctx->CurrentTokenValue == ifsym || ctx->CurrentTokenValue == whilesym) &&
+    ctx->CurrentLevel + ctx->Nesting >= NESTING_LIMIT) {
+        nestedTooDeep(ctx);
+        return;
+    }
+
+    if(ctx->CurrentTokenValue == identsym) {
+        int symIdx = symbolTableCheck(ctx, ctx->CurrentTokenPayload);
+        if(symIdx == -1) {
+            //undeclared identifier
+            error(ctx, 8);
+        } else if(ctx->SymbolTable[symIdx].kind != 2) {
+            //must be a variable
+            error(ctx, 13);
+            symIdx = -1;
+        }
+
+        getToken(ctx);
+        if(ctx->CurrentTokenValue != becomessym) {
+            syntaxError(ctx, 14);
+            return;
+        }
+
+        getToken(ctx);
+        operand value = expression(ctx);
+        materialize(ctx, &value);
+        if(symIdx != -1) {
+            emit(ctx, STO, ctx->CurrentLevel - ctx->SymbolTable[symIdx].level, ctx->SymbolTable[symIdx].addr);
+        }
         return;
     }
 
-    if(CurrentTokenValue == beginsym) {
+    if(ctx->CurrentTokenValue == beginsym) {
         do {
-            getToken();
-            statement();
-        } while(CurrentTokenValue == semicolonsym);
+            getToken(ctx);
+            if(topLevel) {
+                addStatementMark(ctx);
+            }
+            ctx->Nesting++;
+            statement(ctx);
+            ctx->Nesting--;
+
+            // Anything but ; or end here means one of them is missing
+            if(!ctx->Panicking && ctx->CurrentTokenValue != semicolonsym && ctx->CurrentTokenValue != endsym) {
+                syntaxError(ctx, 5);
+            }
+
+            if(ctx->Panicking) {
+                recover(ctx);
+            }
+        } while(ctx->CurrentTokenValue == semicolonsym);
 
-        if(CurrentTokenValue != endsym) {
+        if(ctx->CurrentTokenValue != endsym) {
             //end expected
-            error(5);
-            exit(0);
+            syntaxError(ctx, 5);
+            return;
+        }
+
+        if(topLevel) {
+            addStatementMark(ctx);
         }
 
-        getToken();
+        getToken(ctx);
         return;
     }
 
-    if(CurrentTokenValue == ifsym) {
-        getToken();
-        condition();
-        int jpcIdx = AssemblyCodeListIndex;
-        emit(JPC, 0, 0);
-        if(CurrentTokenValue != thensym) {
+    if(ctx->CurrentTokenValue == ifsym) {
+        getToken(ctx);
+        condition(ctx);
+        if(ctx->Panicking) {
+            return;
+        }
+
+        int jpcIdx = ctx->AssemblyCodeListIndex;
+        emit(ctx, JPC, 0, 0);
+        if(ctx->CurrentTokenValue != thensym) {
             //Then expected
-            error(10);
-            exit(0);
+            syntaxError(ctx, 10);
+            return;
         }
 
-        getToken();
-        statement();
-        AssemblyCodeList[jpcIdx].m = AssemblyCodeListIndex;
+        getToken(ctx);
+        ctx->Nesting++;
+        statement(ctx);
+        ctx->Nesting--;
+        ctx->AssemblyCodeList[jpcIdx].m = ctx->AssemblyCodeListIndex;
+        STAT_ADD(backpatches, 1);
         return;
     }
 
-    if(CurrentTokenValue == whilesym) {
-        getToken();
-        int loopIdx = AssemblyCodeListIndex;
-        condition();
-        if(CurrentTokenValue != dosym) {
+    if(ctx->CurrentTokenValue == whilesym) {
+        getToken(ctx);
+        int loopIdx = ctx->AssemblyCodeListIndex;
+        condition(ctx);
+        if(ctx->Panicking) {
+            return;
+        }
+
+        if(ctx->CurrentTokenValue != dosym) {
             //do expected
-            error(11);
-            exit(0);
+            syntaxError(ctx, 11);
+            return;
         }
 
-        getToken();
-        int jpcIdx = AssemblyCodeListIndex;
-        emit(JPC, 0, 0);
-        statement();
-        emit(JMP, 0, loopIdx);
-        AssemblyCodeList[jpcIdx].m = AssemblyCodeListIndex;
+        getToken(ctx);
+        int jpcIdx = ctx->AssemblyCodeListIndex;
+        emit(ctx, JPC, 0, 0);
+        ctx->Nesting++;
+        statement(ctx);
+        ctx->Nesting--;
+        emit(ctx, JMP, 0, loopIdx);
+        ctx->AssemblyCodeList[jpcIdx].m = ctx->AssemblyCodeListIndex;
+        STAT_ADD(backpatches, 1);
         return;
     }
 
-    if(CurrentTokenValue == readsym) {
-        getToken();
-        if(CurrentTokenValue != identsym) {
+    if(ctx->CurrentTokenValue == readsym) {
+        getToken(ctx);
+        if(ctx->CurrentTokenValue != identsym) {
             //expected identifier
-            error(2);
-            exit(0);
+            syntaxError(ctx, 2);
+            return;
         }
 
-        int symIdx = symbolTableCheck(CurrentToken);
+        int symIdx = symbolTableCheck(ctx, ctx->CurrentTokenPayload);
         if(symIdx == -1) {
             //undeclared identifier
-            error(8);
-            exit(0);
+            error(ctx, 8);
+        } else if(ctx->SymbolTable[symIdx].kind != 2) {
+            //must be a variable
+            error(ctx, 13);
+        } else {
+            emit(ctx, SYS, 0, 2);
+            emit(ctx, STO, ctx->CurrentLevel - ctx->SymbolTable[symIdx].level, ctx->SymbolTable[symIdx].addr);
         }
 
-        if(SymbolTable[symIdx].kind != 2) {
-            //must be a variable
-            error(2);
-            exit(0);
+        getToken(ctx);
+        return;
+    }
+
+    if(ctx->CurrentTokenValue == callsym) {
+        getToken(ctx);
+        if(ctx->CurrentTokenValue != identsym) {
+            //expected identifier
+            syntaxError(ctx, 2);
+            return;
         }
 
-        getToken();
-        emit(SYS, 0, 2);
-        emit(STO, 0, SymbolTable[symIdx].addr);
+        int symIdx = symbolTableCheck(ctx, ctx->CurrentTokenPayload);
+        if(symIdx == -1) {
+            //undeclared identifier
+            error(ctx, 8);
+        } else if(ctx->SymbolTable[symIdx].kind != 3) {
+            //must be a procedure
+            error(ctx, 18);
+        } else {
+            emit(ctx, CAL, ctx->CurrentLevel - ctx->SymbolTable[symIdx].level, ctx->SymbolTable[symIdx].addr);
+        }
 
+        getToken(ctx);
         return;
     }
 
-    if(CurrentTokenValue == writesym) {
-        getToken();
-        expression();
-        emit(SYS, 0, 1);
+    if(ctx->CurrentTokenValue == writesym) {
+        getToken(ctx);
+        operand value = expression(ctx);
+        materialize(ctx, &value);
+        emit(ctx, SYS, 0, 1);
 
         return;
     }
 }
 
+void condition(compileContext * ctx) {
+    operand result;
 
-void condition() {
-    if(CurrentTokenValue == oddsym) {
-        getToken();
-        expression();
-        emit(OPR, 0, ODD);
-    } else {
-        expression();
-        if(CurrentTokenValue == eqlsym) {
-            getToken();
-            expression();
-            emit(OPR, 0, EQL);
-        } else if(CurrentTokenValue == neqsym) {
-            getToken();
-            expression();
-            emit(OPR, 0, NEQ);
-        } else if(CurrentTokenValue == lessym) {
-            getToken();
-            expression();
-            emit(OPR, 0, LSS);
-        } else if(CurrentTokenValue == leqsym) {
-            getToken();
-            expression();
-            emit(OPR, 0, LEQ);
-        } else if(CurrentTokenValue == gtrsym) {
-            getToken();
-            expression();
-            emit(OPR, 0, GTR);
-        } else if(CurrentTokenValue == geqsym) {
-            getToken();
-            expression();
-            emit(OPR, 0, GEQ);
+    if(ctx->CurrentTokenValue == oddsym) {
+        getToken(ctx);
+        result = expression(ctx);
+
+        if(result.pending) {
+            result.value = result.value % 2 != 0;
         } else {
+            emit(ctx, OPR, 0, ODD);
+        }
+    } else {
+        int relational;
+
+        result = parseExpression(ctx, &relational);
+
+        if(!relational) {
             //relational operator
-            error(9);
-            exit(0);
+            syntaxError(ctx, 9);
+            return;
         }
     }
+
+    // JPC needs the result on the stack
+    materialize(ctx, &result);
 }
 
 
-void expression() {
-    if(CurrentTokenValue == minussym) {
-        getToken();
-        term();
-        emit(OPR, 0, NEG);
+operand expression(compileContext * ctx) {
+    return parseExpression(ctx, NULL);
+}
+
+// Operator precedence parsing of an expression, or with relational set of a condition's
+// expression relop expression; *relational says whether the relop was there
+// Operators waiting for their right operand, leading minuses waiting for their term and open
+// parentheses go on ctx->ExprStack instead of the C stack, so nesting only needs memory
+// combine() sees the operands in the same order as the grammar's left to right reduction,
+// so the code, the folding and the errors are those of recursive descent
+operand parseExpression(compileContext * ctx, int * relational) {
+    int base = ctx->ExprDepth;
+    // Lowest precedence taken outside parentheses, inside them it is always PREC_ADDITIVE
+    int lowest = relational != NULL ? PREC_RELATIONAL : PREC_ADDITIVE;
+    int opens = 0;
+    // A sign may start the whole expression, a parenthesised one and the right side of a relop
+    int signAllowed = 1;
+    operand x = { 0, 0, 0, ctx->AssemblyCodeListIndex, 0 };
+
+    if(relational != NULL) {
+        *relational = 0;
+    }
 
-        while(CurrentTokenValue == plussym || CurrentTokenValue == minussym) {
-            if(CurrentTokenValue == plussym) {
-                getToken();
-                term();
-                emit(OPR, 0, ADD);
-            } else {
-                getToken();
-                term();
-                emit(OPR, 0, SUB);
-            }
+    for(;;) {
+        if(signAllowed && ctx->CurrentTokenValue == minussym) {
+            getToken(ctx);
+            pushExpr(ctx, EXPR_NEGATE, NEG, PREC_ADDITIVE, x);
+        } else if(signAllowed && ctx->CurrentTokenValue == plussym) {
+            getToken(ctx);
         }
-    } else {
-        if(CurrentTokenValue == plussym) {
-            getToken();
+
+        if(ctx->CurrentTokenValue == lparentsym) {
+            getToken(ctx);
+            pushExpr(ctx, EXPR_PAREN, 0, PREC_NONE, x);
+            opens++;
+            signAllowed = 1;
+            continue;
         }
 
-        term();
+        x = parseFactor(ctx);
+
+        // Close parentheses until an operator this level takes comes up
+        int precedence = BinaryOperators[ctx->CurrentTokenValue].precedence;
 
-        while(CurrentTokenValue == plussym || CurrentTokenValue == minussym) {
-            if(CurrentTokenValue == plussym) {
-                getToken();
-                term();
-                emit(OPR, 0, ADD);
+        while(precedence < (opens > 0 ? PREC_ADDITIVE : lowest)) {
+            x = reduceExpr(ctx, x, base, PREC_RELATIONAL);
+
+            if(opens == 0) {
+                return x;
+            }
+
+            ctx->ExprDepth--;
+            opens--;
+
+            if(ctx->CurrentTokenValue != rparentsym) {
+                syntaxError(ctx, 6);
             } else {
-                getToken();
-                term();
-                emit(OPR, 0, SUB);
+                getToken(ctx);
             }
+
+            precedence = BinaryOperators[ctx->CurrentTokenValue].precedence;
+        }
+
+        // Operators bind left to right, so everything as tight as this one is applied first
+        x = reduceExpr(ctx, x, base, precedence);
+        pushExpr(ctx, EXPR_BINARY, BinaryOperators[ctx->CurrentTokenValue].opr, precedence, x);
+        signAllowed = precedence == PREC_RELATIONAL;
+
+        if(signAllowed) {
+            *relational = 1;
+            lowest = PREC_ADDITIVE;
         }
+
+        getToken(ctx);
     }
 }
 
+static inline void pushExpr(compileContext * ctx, int kind, int opr, int precedence, operand left) {
+    if(ctx->ExprDepth == ctx->ExprCapacity) {
+        int capacity = ctx->ExprCapacity == 0 ? 64 : ctx->ExprCapacity * 2;
 
-void term() {
-    factor();
+        ctx->ExprStack = arenaGrow(ctx, ctx->ExprStack, ctx->ExprDepth, sizeof(exprEntry), capacity);
+        ctx->ExprCapacity = capacity;
+    }
 
-    while(CurrentTokenValue == multsym || CurrentTokenValue == slashsym) {
-        if(CurrentTokenValue == multsym) {
-            getToken();
-            factor();
-            emit(OPR, 0, MUL);
-        } else {
-            getToken();
-            factor();
-            emit(OPR, 0, DIV);
+    exprEntry * entry = &ctx->ExprStack[ctx->ExprDepth++];
+    entry->left = left;
+    entry->kind = kind;
+    entry->opr = opr;
+    entry->precedence = precedence;
+}
+
+// Apply the operators on top of the stack that bind at least as tight as precedence to x,
+// stopping at an open parenthesis or the bottom of the expression
+static inline operand reduceExpr(compileContext * ctx, operand x, int base, int precedence) {
+    while(ctx->ExprDepth > base) {
+        exprEntry * top = &ctx->ExprStack[ctx->ExprDepth - 1];
+
+        if(top->kind == EXPR_PAREN || top->precedence < precedence) {
+            break;
         }
+
+        ctx->ExprDepth--;
+        x = top->kind == EXPR_NEGATE ? negateOperand(ctx, x) : combine(ctx, top->left, top->opr, x);
     }
+
+    return x;
 }
 
+// ident | number, the parentheses are parseExpression()'s
+static inline operand parseFactor(compileContext * ctx) {
+    operand result = { 0, 0, 0, ctx->AssemblyCodeListIndex, 0 };
 
-void factor() {
-    if(CurrentTokenValue == identsym) {
-        int symIdx = symbolTableCheck(CurrentToken);
+    if(ctx->CurrentTokenValue == identsym) {
+        int symIdx = symbolTableCheck(ctx, ctx->CurrentTokenPayload);
 
         if(symIdx == -1) {
-            fprintf(stdout, "Error: Identifier is not declared");
-            exit(0);
-        }
-
-        if(SymbolTable[symIdx].kind == 1) {
-            emit(LIT, 0, SymbolTable[symIdx].val);
+            //undeclared identifier
+            error(ctx, 8);
+        } else if(ctx->SymbolTable[symIdx].kind == 1) {
+            result = constantOperand(ctx, ctx->SymbolTable[symIdx].val);
+        } else if(ctx->SymbolTable[symIdx].kind == 2) {
+            emit(ctx, LOD, ctx->CurrentLevel - ctx->SymbolTable[symIdx].level, ctx->SymbolTable[symIdx].addr);
         } else {
-            emit(LOD, 0, SymbolTable[symIdx].addr);
-        }
-
-        getToken();
-    } else if(CurrentTokenValue == numbersym) {
-        emit(LIT, 0, atoi(CurrentToken));
-        getToken();
-    } else if(CurrentTokenValue == lparentsym) {
-        getToken();
-        expression();
-
-        if(CurrentTokenValue != rparentsym) {
-            fprintf(stdout, "Error: Right parenthesis expected\n");
-            exit(0);
+            //procedure in an expression
+            error(ctx, 19);
         }
 
-        getToken();
+        getToken(ctx);
+    } else if(ctx->CurrentTokenValue == numbersym) {
+        result = constantOperand(ctx, ctx->CurrentTokenPayload);
+        getToken(ctx);
     } else {
-        fprintf(stdout, "Error: Identifier, number, or left parenthesis expected\n");
-        exit(0);
+        syntaxError(ctx, 7);
     }
+
+    return result;
 }
 
 
 // //will output all errors, checking for syntax error
-void error(int err){
+// Records the error at the current token and parsing goes on
+// The code is the stable ID of the error; only the first error at a token is kept
+void error(compileContext * ctx, int err){
+	if(ctx->Panicking || (ctx->Recovered && ctx->CurrentTokenOffset == ctx->RecoveredAt)) {
+		return;
+	}
+
+	if(ctx->DiagnosticCount > 0 && ctx->Diagnostics[ctx->DiagnosticCount - 1].offset == ctx->CurrentTokenOffset) {
+		return;
+	}
+
+	if(ctx->DiagnosticCount == ctx->DiagnosticCapacity) {
+		int capacity = ctx->DiagnosticCapacity == 0 ? 16 : ctx->DiagnosticCapacity * 2;
+
+		ctx->Diagnostics = arenaGrow(ctx, ctx->Diagnostics, ctx->DiagnosticCount, sizeof(diagnostic), capacity);
+		ctx->DiagnosticCapacity = capacity;
+	}
+
+	ctx->Diagnostics[ctx->DiagnosticCount].code = err;
+	ctx->Diagnostics[ctx->DiagnosticCount].offset = ctx->CurrentTokenOffset;
+	ctx->DiagnosticCount++;
+}
+
+// The parser no longer knows where it is, errors are ignored until recover()
+void syntaxError(compileContext * ctx, int err) {
+    error(ctx, err);
+    ctx->Panicking = 1;
+}
+
+// Past NESTING_LIMIT the rest of the source is skipped, so recovering cannot recurse deeper
+// and errors at the end of it are not reported
+void nestedTooDeep(compileContext * ctx) {
+    syntaxError(ctx, 20);
+
+    while(ctx->CurrentTokenValue != 0) {
+        getToken(ctx);
+    }
+}
+
+// Panic mode: skip to the next ; end . or declaration keyword
+void recover(compileContext * ctx) {
+    while(ctx->CurrentTokenValue != 0 && ctx->CurrentTokenValue != semicolonsym && ctx->CurrentTokenValue != endsym &&
+          ctx->CurrentTokenValue != periodsym && ctx->CurrentTokenValue != constsym &&
+          ctx->CurrentTokenValue != varsym && ctx->CurrentTokenValue != procsym) {
+        getToken(ctx);
+    }
+
+    ctx->Panicking = 0;
+    ctx->Recovered = 1;
+    ctx->RecoveredAt = ctx->CurrentTokenOffset;
+}
+
+const char * errorMessage(int err){
 	switch(err){
 		case 1: 
-			printf("Error: constants must be assigned with =\n");
-			break;
+			return "constants must be assigned with =";
 		case 2:
-			printf("Error: const, var, and read keywords must be followed by identifier\n");
-			break;
+			return "const, var, procedure, call, and read keywords must be followed by identifier";
 		case 3:
-			printf("Error: constant and variable declarations must be followed by a semicolon\n");
-			break;
+			return "constant and variable declarations must be followed by a semicolon";
 		case 4:
-			printf("Error: constants must be assigned an integer value\n");
-			break;
+			return "constants must be assigned an integer value";
 		case 5:
-			printf("Error: begin must be followed by end\n");
-			break;
+			return "begin must be followed by end";
 		case 6:
-			printf("Error: right parenthesis must follow left parenthesis\n");
-			break;
+			return "right parenthesis must follow left parenthesis";
 		case 7:
-			printf("Error: arithmetic equations must contain operands, parentheses, numbers, or symbols\n");
-			break;
+			return "arithmetic equations must contain operands, parentheses, numbers, or symbols";
 		case 8:
-			printf("Error: undeclared identifier\n");
-			break;
+			return "undeclared identifier";
 		case 9:
-			printf("Error: condition must contain comparison operator\n");
-			break;
+			return "condition must contain comparison operator";
 		case 10:
-			printf("Error: if must be followed by then\n");
-			break;
+			return "if must be followed by then";
 		case 11:
-			printf("Error: while must be followed by do\n");
-			break;
+			return "while must be followed by do";
 		case 12:
-			printf("Error: program must end with period\n");
-			break;
+			return "program must end with period";
 		case 13:
-			printf("Error: only variable values may be altered\n");
-			break;
+			return "only variable values may be altered";
         case 14:
-			printf("Error: assignment statements must use :=\n");
-			break;
+			return "assignment statements must use :=";
         case 15:
-			printf("Error: symbol name has already been declared\n");
-			break;
+			return "symbol name has already been declared";
+        case 16:
+			return "division by zero";
+        case 17:
+			return "procedure declarations must be followed by a semicolon";
+        case 18:
+			return "only procedures may be called";
+        case 19:
+			return "expressions must not contain procedure identifiers";
+        case 20:
+			return "procedures and begin, if and while statements must not be nested more than 10000 deep";
 		default:
-			printf("Invalid choice\n");
-			break;
+			return "Invalid choice";
 	}
 }
 
+#ifndef PL0_LIBRARY
+void printDiagnostics(compileContext * ctx, FILE * out) {
+    outputBuffer buffer;
+
+    if(outputOpen(&buffer, out) == -1) {
+        fputs("Error: out of memory\n", out);
+        return;
+    }
+
+    writeDiagnostics(ctx, &buffer);
+    outputClose(&buffer);
+}
+#endif
+
+// One line per error with its ID and the line and column of its token
+// A fatal error from fail() is printed as it is
+void writeDiagnostics(compileContext * ctx, outputBuffer * out) {
+    unsigned int position = 0;
+    int line = 1;
+    int column = 1;
+
+    for(int i = 0; i < ctx->DiagnosticCount; i++) {
+        const char * message = errorMessage(ctx->Diagnostics[i].code);
+        char * at = outputReserve(out, 64);
+
+        locateOffset(ctx, ctx->Diagnostics[i].offset, &position, &line, &column);
+
+        at = putField(at, "Error ", 6, 0);
+        at = putInt(at, ctx->Diagnostics[i].code, 0);
+        at = putField(at, " at line ", 9, 0);
+        at = putInt(at, line, 0);
+        at = putField(at, ", column ", 9, 0);
+        at = putInt(at, column, 0);
+        at = putField(at, ": ", 2, 0);
+        out->used = at - out->data;
+
+        outputBytes(out, message, strlen(message));
+        outputBytes(out, "\n", 1);
+    }
+
+    if(ctx->Diagnostic != NULL) {
+        outputBytes(out, ctx->Diagnostic, strlen(ctx->Diagnostic));
+    }
+}
+
+
 
+// Line and column of a source offset, counted on from *position unless the offset is before it
+// Errors come in source order, so the count usually carries on from the last one
+void locateOffset(compileContext * ctx, unsigned int offset, unsigned int * position, int * line, int * column) {
+    if(offset < *position) {
+        *position = 0;
+        *line = 1;
+        *column = 1;
+    }
+
+    for(; *position < offset && *position < ctx->SourceLength; (*position)++) {
+        if(ctx->Source[*position] == '\n') {
+            (*line)++;
+            *column = 1;
+        } else {
+            (*column)++;
+        }
+    }
+}
+
+// Keep the first fatal message and abandon the compilation
+void fail(compileContext * ctx, const char * message) {
+    ctx->Diagnostic = message;
+    longjmp(ctx->Bail, 1);
+}
@@ -0,0 +1,80 @@
+#ifndef PL0_H
+#define PL0_H
+
+#include <stddef.h>
+
+// Compile PL/0 source in memory, without files, exit() or global state
+// Build the library from the compiler itself with PL0_LIBRARY defined, which leaves out main() and
+// the command line's files, cache, watch mode, server, VM and assembly output:
+//   cc -O2 -shared -fPIC -fvisibility=hidden -DPL0_LIBRARY parsercodegen.c -o libpl0.so -pthread
+// A context is reused from one compile to the next, so compiles of similar sources stop allocating.
+// A context is used by one thread at a time, different contexts can compile at once
+
+#if defined(__GNUC__)
+#define PL0_API __attribute__((visibility("default")))
+#else
+#define PL0_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pl0_context pl0_context;
+
+// Zeroed options (or NULL) compile like parsercodegen with no flags
+typedef struct {
+    int optimize; // -O
+    int lexemes; // build the lexeme list
+    int lex_threads; // lex sources of 8 MB or more on this many threads, 0 or 1 lexes serially
+} pl0_options;
+
+// One PM/0 instruction, op is 1 (LIT) to 9 (SYS) as in the listing
+typedef struct {
+    int op;
+    int l;
+    int m;
+} pl0_instruction;
+
+// One symbol table row
+typedef struct {
+    int kind; // const = 1, var = 2, procedure = 3
+    const char * name;
+    int value;
+    int level;
+    int address;
+    int mark;
+} pl0_symbol;
+
+// An error as parsercodegen reports it; code 0 is a fatal error whose message is printed as it is
+typedef struct {
+    int code;
+    int line;
+    int column;
+    const char * message;
+} pl0_diagnostic;
+
+// Everything points into the context and stays valid until its next compile or until it is freed
+typedef struct {
+    const pl0_instruction * code;
+    int code_count;
+    const pl0_symbol * symbols;
+    int symbol_count;
+    const pl0_diagnostic * diagnostics;
+    int diagnostic_count;
+    const char * lexemes; // NULL unless options->lexemes, or after a fatal error
+} pl0_result;
+
+// NULL when out of memory
+PL0_API pl0_context * pl0_context_new(void);
+PL0_API void pl0_context_free(pl0_context * ctx);
+
+// Compile length bytes of source, which are only read during the call
+// Returns 0, or -1 when result->diagnostics holds errors; code and symbols are then as far as the compile got
+PL0_API int pl0_compile(pl0_context * ctx, const char * source, size_t length, const pl0_options * options, pl0_result * result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Runtime for the x86-64 assembly parsercodegen --emit-asm writes
+// Build a program with: cc prog.s pl0rt.c -o prog
+// read, write and the errors behave like --run: integers one per line through
+// buffered read() / write(), errors on stderr and exit status 1
+
+#define BUFFER_SIZE 65536
+
+// Runtime errors, the same numbers as in parsercodegen.c
+typedef enum {
+    PL0_DIVISION_BY_ZERO = 1, PL0_STACK_OVERFLOW
+} runtimeErrors;
+
+// Defined by the generated code
+extern const int pl0_stack_words;
+void pl0_main(int * stack);
+
+int pl0_read(int line);
+void pl0_write(int number);
+void pl0_halt();
+void pl0_fail(int error, int line);
+int readInt(int * number);
+void flushOutput();
+
+char Input[BUFFER_SIZE];
+int InputIndex = 0;
+int InputLength = 0;
+char Output[BUFFER_SIZE];
+int OutputIndex = 0;
+
+int main() {
+    int * stack = calloc(pl0_stack_words, sizeof(int));
+
+    if(stack == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    // Never returns, the code ends in pl0_halt() or pl0_fail()
+    pl0_main(stack);
+
+    return 0;
+}
+
+// SYS 0 2, line is the instruction for the error message
+int pl0_read(int line) {
+    int number;
+
+    if(readInt(&number) == -1) {
+        fprintf(stderr, "Error: expected an integer on input at line %d\n", line);
+        flushOutput();
+        exit(1);
+    }
+
+    return number;
+}
+
+// SYS 0 1, formatted straight into the output buffer
+void pl0_write(int number) {
+    char digits[12];
+    int length = 0;
+    unsigned int magnitude = number < 0 ? 0u - (unsigned int) number : (unsigned int) number;
+
+    if(OutputIndex + 13 > BUFFER_SIZE) {
+        flushOutput();
+    }
+
+    do {
+        digits[length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while(magnitude > 0);
+
+    if(number < 0) {
+        Output[OutputIndex++] = '-';
+    }
+
+    while(length > 0) {
+        Output[OutputIndex++] = digits[--length];
+    }
+
+    Output[OutputIndex++] = '\n';
+}
+
+// SYS 0 3, or running off the end of the code
+void pl0_halt() {
+    flushOutput();
+    exit(0);
+}
+
+void pl0_fail(int error, int line) {
+    fprintf(stderr, "Error: %s at line %d\n", error == PL0_DIVISION_BY_ZERO ? "division by zero" : "stack overflow", line);
+    flushOutput();
+    exit(1);
+}
+
+// Read the next integer, refilling the input with one read() at a time
+// Returns -1 at the end of the input or on anything that is not an integer
+int readInt(int * number) {
+    int sign = 1;
+    int digits = 0;
+    unsigned int result = 0;
+
+    for(;;) {
+        if(InputIndex == InputLength) {
+            // Prompt output has to be visible before blocking on input
+            flushOutput();
+
+            ssize_t n = read(0, Input, BUFFER_SIZE);
+            if(n <= 0) {
+                break;
+            }
+
+            InputIndex = 0;
+            InputLength = n;
+        }
+
+        char c = Input[InputIndex];
+
+        if(c >= '0' && c <= '9') {
+            result = result * 10 + (c - '0');
+            digits++;
+        } else if(digits > 0) {
+            break;
+        } else if(c == '-' && sign == 1) {
+            sign = -1;
+        } else if(!(c == ' ' || (c >= '\t' && c <= '\r')) || sign == -1) {
+            return -1;
+        }
+
+        InputIndex++;
+    }
+
+    if(digits == 0) {
+        return -1;
+    }
+
+    *number = (int) (sign == 1 ? result : 0u - result);
+
+    return 0;
+}
+
+void flushOutput() {
+    for(int written = 0; written < OutputIndex; ) {
+        ssize_t n = write(1, Output + written, OutputIndex - written);
+        if(n <= 0) {
+            break;
+        }
+        written += n;
+    }
+
+    OutputIndex = 0;
+}